@@ -294,6 +294,9 @@ EXPORT_SYMBOL(blk_stop_queue);
 void blk_sync_queue(struct request_queue *q)
 {
 	del_timer_sync(&q->timeout);
+	if (q->mq_ops)
+		cancel_work_sync(&q->timeout_work);
+	hrtimer_cancel(&q->flush_coalesce_timer);
 	cancel_delayed_work_sync(&q->delay_work);
 }
 EXPORT_SYMBOL(blk_sync_queue);
@@ -636,6 +639,7 @@ struct request_queue *blk_alloc_queue_node(gfp_t gfp_mask, int node_id)
 	INIT_LIST_HEAD(&q->flush_queue[0]);
 	INIT_LIST_HEAD(&q->flush_queue[1]);
 	INIT_LIST_HEAD(&q->flush_data_in_flight);
+	blk_flush_init_queue(q);
 	INIT_DELAYED_WORK(&q->delay_work, blk_delay_work);
 
 	kobject_init(&q->kobj, &blk_queue_ktype);
@@ -1251,15 +1255,19 @@ part_inc_in_flight() 
 static void part_round_stats_single(int cpu, struct hd_struct *part,
 				    unsigned long now)
 {
+	unsigned int inflight;
+
     //ʱһjiffies
 	if (now == part->stamp)
 		return;
 
     //in_flight Ϊ0˵in flightreq
-	if (part_in_flight(part)) {
+	/* sums the per-cpu counters, at most once a jiffy per partition */
+	inflight = part_in_flight(part);
+	if (inflight) {
         //time_in_queueȻIOеIOIOеʱй
 		__part_stat_add(cpu, part, time_in_queue,
-				part_in_flight(part) * (now - part->stamp));
+				inflight * (now - part->stamp));
 		__part_stat_add(cpu, part, io_ticks, (now - part->stamp));
 	}
     //part->stamp Ϊǰʱ
@@ -3001,12 +3009,31 @@ EXPORT_SYMBOL(kblockd_schedule_delayed_work);
  *   this kind of deadlock.
  */
 void blk_start_plug(struct blk_plug *plug)
+{
+	blk_start_plug_nr_ios(plug, 1);
+}
+EXPORT_SYMBOL(blk_start_plug);
+
+/**
+ * blk_start_plug_nr_ios - start a plug for a known batch of I/Os
+ * @plug:	The &struct blk_plug that needs to be initialized
+ * @nr_ios:	Number of I/Os the caller is about to submit
+ *
+ * Description:
+ *   Like blk_start_plug(), but blk-mq queues allocate requests for up to
+ *   @nr_ios I/Os at once on the first submission and keep the extra ones in
+ *   the plug, see blk_mq_make_request().
+ */
+void blk_start_plug_nr_ios(struct blk_plug *plug, unsigned short nr_ios)
 {
 	struct task_struct *tsk = current;
 
 	plug->magic = PLUG_MAGIC;
 	INIT_LIST_HEAD(&plug->list);
+	INIT_LIST_HEAD(&plug->mq_list);
 	INIT_LIST_HEAD(&plug->cb_list);
+	INIT_LIST_HEAD(&plug->cached_rqs);
+	plug->nr_ios = min_t(unsigned short, nr_ios, BLK_MAX_REQUEST_COUNT);
 
 	/*
 	 * If this is a nested plug, don't actually assign it. It will be
@@ -3020,7 +3047,7 @@ void blk_start_plug(struct blk_plug *plug)
 		tsk->plug = plug;
 	}
 }
-EXPORT_SYMBOL(blk_start_plug);
+EXPORT_SYMBOL(blk_start_plug_nr_ios);
 
 static int plug_rq_cmp(void *priv, struct list_head *a, struct list_head *b)
 {
@@ -3105,6 +3132,10 @@ void blk_flush_plug_list(struct blk_plug *plug, bool from_schedule)//from_schedu
 
 	flush_plug_callbacks(plug, from_schedule);
 
+	/* don't sit on unused tags while sleeping */
+	if (from_schedule && !list_empty(&plug->cached_rqs))
+		blk_mq_free_plug_rqs(plug);
+
     
 /*ȡǰplug->mq_listϵreqIO㷨reqelvfifoУ
 mq-deadline㷨ĻҪûIO㷨Ӳпʱ԰plug->mq_listϵreq
@@ -3185,6 +3216,8 @@ mq-deadline
 void blk_finish_plug(struct blk_plug *plug)
 {
 	blk_flush_plug_list(plug, false);
+	if (!list_empty(&plug->cached_rqs))
+		blk_mq_free_plug_rqs(plug);
 
 	if (plug == current->plug)
 		current->plug = NULL;
@@ -2993,7 +2993,7 @@ void blk_finish_request(struct request *req, int error)
 	struct request_queue *q = req->q;
 
 	if (req->cmd_flags & REQ_STATS)
-		blk_stat_add(req);
+		blk_stat_add(req, ktime_to_ns(ktime_get()));
 
 	if (req->cmd_flags & REQ_QUEUED)
 		blk_queue_end_tag(q, req);
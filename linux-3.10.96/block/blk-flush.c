@@ -49,6 +49,14 @@
  *     starvation in the unlikely case where there are continuous stream of
  *     FUA (without FLUSH) requests.
  *
+ * C4. If q->flush_coalesce_usec is set, a flush for requests which queued
+ *     up while no flush was in flight is held back until the first of
+ *     them has waited that long, so that flushes arriving slightly apart
+ *     share one device flush.  Requests which queued up behind a running
+ *     flush are issued as soon as it completes, they have waited already.
+ *     blk-mq queues apply the same rule to their empty flushes, see
+ *     blk_mq_flush_coalesce().
+ *
  * For devices which support FUA, it isn't clear whether C2 (and thus C3)
  * is beneficial.
  *
@@ -68,6 +76,7 @@
 #include <linux/module.h>
 #include <linux/bio.h>
 #include <linux/blkdev.h>
+#include <linux/blk-mq.h>
 #include <linux/gfp.h>
 
 #include "blk.h"
@@ -160,8 +169,14 @@ static bool blk_flush_complete_seq(struct request *rq, unsigned int seq,
 	case REQ_FSEQ_PREFLUSH:
 	case REQ_FSEQ_POSTFLUSH:
 		/* queue for flush */
-		if (list_empty(pending))
+		if (list_empty(pending)) {
 			q->flush_pending_since = jiffies;
+			/* C4, no coalescing delay behind a running flush */
+			if (q->flush_pending_idx != q->flush_running_idx)
+				q->flush_pending_ns = 0;
+			else
+				q->flush_pending_ns = ktime_to_ns(ktime_get());
+		}
 		list_move_tail(&rq->flush.list, pending);
 		break;
 
@@ -228,6 +243,146 @@ static void flush_end_io(struct request *flush_rq, int error)
 	q->flush_queue_delayed = 0;
 }
 
+/*
+ * C4: returns %true if the pending flush should wait for more requests to
+ * join it, in which case the coalescing timer is armed to kick it later.
+ */
+static bool blk_flush_coalesce_wait(struct request_queue *q)
+{
+	u64 expires;
+
+	if (!q->flush_coalesce_usec || !q->flush_pending_ns)
+		return false;
+
+	expires = q->flush_pending_ns +
+		  (u64)q->flush_coalesce_usec * NSEC_PER_USEC;
+	if (ktime_to_ns(ktime_get()) >= expires)
+		return false;
+
+	if (!hrtimer_active(&q->flush_coalesce_timer))
+		hrtimer_start(&q->flush_coalesce_timer, ns_to_ktime(expires),
+			      HRTIMER_MODE_ABS);
+	return true;
+}
+
+static void blk_mq_flush_leader_end_io(struct request *rq, int error);
+
+/*
+ * C4 for blk-mq: pick the oldest parked flush as the one to issue if no
+ * other is in flight, the rest of them complete along with it.
+ *
+ * CONTEXT:
+ * spin_lock_irq(q->queue_lock)
+ */
+static struct request *blk_mq_flush_pick_leader(struct request_queue *q)
+{
+	struct request *leader;
+
+	if (q->mq_flush_leader || list_empty(&q->mq_flush_pending))
+		return NULL;
+
+	leader = list_first_entry(&q->mq_flush_pending, struct request,
+				  queuelist);
+	list_del_init(&leader->queuelist);
+	list_splice_tail_init(&q->mq_flush_pending, &q->mq_flush_running);
+
+	leader->end_io = blk_mq_flush_leader_end_io;
+	q->mq_flush_leader = leader;
+	q->flush_issued++;
+	return leader;
+}
+
+/*
+ * Hand the leader to the dispatch list through the requeue work, like the
+ * flush machinery does, so that this is fine from the hrtimer too.
+ */
+static void blk_mq_flush_issue(struct request *leader)
+{
+	leader->cmd_flags |= REQ_FLUSH_SEQ;
+	blk_mq_add_to_requeue_list(leader, true, true);
+}
+
+static void blk_mq_flush_leader_end_io(struct request *rq, int error)
+{
+	struct request_queue *q = rq->q;
+	struct request *leader, *follower, *n;
+	unsigned long flags;
+	LIST_HEAD(done);
+
+	spin_lock_irqsave(q->queue_lock, flags);
+	list_splice_init(&q->mq_flush_running, &done);
+	q->mq_flush_leader = NULL;
+	/* those parked meanwhile have waited already */
+	leader = blk_mq_flush_pick_leader(q);
+	spin_unlock_irqrestore(q->queue_lock, flags);
+
+	list_for_each_entry_safe(follower, n, &done, queuelist) {
+		list_del_init(&follower->queuelist);
+		blk_mq_end_request(follower, error);
+	}
+
+	rq->end_io = NULL;
+	blk_mq_free_request(rq);
+
+	if (leader)
+		blk_mq_flush_issue(leader);
+}
+
+/**
+ * blk_mq_flush_coalesce - park an empty blk-mq flush for coalescing
+ * @rq: flush request being inserted
+ * @policy: flush sequence @rq needs, see blk_flush_policy()
+ *
+ * blk-mq queues don't go through the flush_queue state machine, so C4 is
+ * applied to their empty flushes directly: the first one parked opens
+ * the window, those arriving within it are parked behind it, and once
+ * it expires the first one is issued and its completion completes all of
+ * them.  Only one such flush is in flight at a time.
+ *
+ * RETURNS:
+ * %true if @rq was parked, %false if it has to be inserted as usual.
+ */
+static bool blk_mq_flush_coalesce(struct request *rq, unsigned int policy)
+{
+	struct request_queue *q = rq->q;
+	unsigned long flags;
+
+	if (!ACCESS_ONCE(q->flush_coalesce_usec) ||
+	    policy != REQ_FSEQ_PREFLUSH || rq->end_io)
+		return false;
+
+	spin_lock_irqsave(q->queue_lock, flags);
+	if (!q->mq_flush_leader && list_empty(&q->mq_flush_pending))
+		hrtimer_start(&q->flush_coalesce_timer,
+			      ktime_add_us(ktime_get(), q->flush_coalesce_usec),
+			      HRTIMER_MODE_ABS);
+	list_add_tail(&rq->queuelist, &q->mq_flush_pending);
+	q->flush_requested++;
+	spin_unlock_irqrestore(q->queue_lock, flags);
+
+	return true;
+}
+
+static enum hrtimer_restart blk_flush_coalesce_timer_fn(struct hrtimer *timer)
+{
+	struct request_queue *q = container_of(timer, struct request_queue,
+					       flush_coalesce_timer);
+	struct request *leader = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(q->queue_lock, flags);
+	if (q->mq_ops)
+		leader = blk_mq_flush_pick_leader(q);
+	else if (blk_kick_flush(q))
+		blk_run_queue_async(q);
+	spin_unlock_irqrestore(q->queue_lock, flags);
+
+	if (leader)
+		blk_mq_flush_issue(leader);
+
+	return HRTIMER_NORESTART;
+}
+
 /**
  * blk_kick_flush - consider issuing flush request
  * @q: request_queue being kicked
@@ -257,6 +412,10 @@ static bool blk_kick_flush(struct request_queue *q)
 			q->flush_pending_since + FLUSH_PENDING_TIMEOUT))
 		return false;
 
+	/* C4 */
+	if (blk_flush_coalesce_wait(q))
+		return false;
+
 	/*
 	 * Issue flush and toggle pending_idx.  This makes pending_idx
 	 * different from running_idx, which means flush is in flight.
@@ -268,6 +427,7 @@ static bool blk_kick_flush(struct request_queue *q)
 	q->flush_rq.end_io = flush_end_io;
 
 	q->flush_pending_idx ^= 1;
+	q->flush_issued++;
 	list_add_tail(&q->flush_rq.queuelist, &q->queue_head);
 	return true;
 }
@@ -302,6 +462,10 @@ void blk_insert_flush(struct request *rq)
 	unsigned int fflags = q->flush_flags;	/* may change, cache */
 	unsigned int policy = blk_flush_policy(fflags, rq);
 
+	/* C4 for blk-mq, before REQ_FLUSH is taken off for the driver */
+	if (q->mq_ops && blk_mq_flush_coalesce(rq, policy))
+		return;
+
 	/*
 	 * @policy now records what operations need to be done.  Adjust
 	 * REQ_FLUSH and FUA for the driver.
@@ -344,9 +508,28 @@ void blk_insert_flush(struct request *rq)
 	rq->flush.saved_end_io = rq->end_io; /* Usually NULL */
 	rq->end_io = flush_data_end_io;
 
+	/* once per request, even if it needs both PREFLUSH and POSTFLUSH */
+	q->flush_requested++;
+
 	blk_flush_complete_seq(rq, REQ_FSEQ_ACTIONS & ~policy, 0);
 }
 
+/**
+ * blk_flush_init_queue - initialize flush coalescing state of @q
+ * @q: request_queue being allocated
+ *
+ * Coalescing is off until a window is set through the
+ * flush_coalesce_usec queue attribute.
+ */
+void blk_flush_init_queue(struct request_queue *q)
+{
+	hrtimer_init(&q->flush_coalesce_timer, CLOCK_MONOTONIC,
+		     HRTIMER_MODE_ABS);
+	q->flush_coalesce_timer.function = blk_flush_coalesce_timer_fn;
+	INIT_LIST_HEAD(&q->mq_flush_pending);
+	INIT_LIST_HEAD(&q->mq_flush_running);
+}
+
 /**
  * blk_abort_flushes - @q is being aborted, abort flush requests
  * @q: request_queue being aborted
@@ -0,0 +1,483 @@
+/*
+ * Latency based IO protection for blk-mq queues
+ *
+ * A cgroup is given a completion latency target per device through
+ * blkio.latency.target_usec_device.  Each protected group samples the
+ * latency of its requests over a window of 16 x target, clamped to
+ * 100ms - 1s.  If more than 10% of the requests in a window finished over
+ * the target, the scale step of the group's parent is raised, which halves
+ * the queue depth available to every sibling that has a looser target or
+ * none at all.  Windows that meet the target lower the step again.  If the
+ * protected group goes quiet, its siblings ramp back up by themselves, one
+ * step a second.
+ *
+ * Only sibling sets that contain a protected group take part: requests of
+ * other groups are neither counted nor throttled, and never touch the
+ * queue lock here.
+ */
+
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/ktime.h>
+#include "blk-cgroup.h"
+#include "blk.h"
+
+/* Sampling window bounds, the window is 16 x target in between */
+#define IOLAT_MIN_WIN_NSEC	(100 * NSEC_PER_MSEC)
+#define IOLAT_MAX_WIN_NSEC	NSEC_PER_SEC
+
+/* Don't judge a window on fewer requests than this */
+#define IOLAT_MIN_SAMPLES	3
+
+/* Each step halves the depth of the siblings, 1 is the floor anyway */
+#define IOLAT_MAX_SCALE_STEP	16
+
+/* Without news from the protected group, unthrottle a step this often */
+#define IOLAT_SCALE_UP_DELAY	HZ
+
+static struct blkcg_policy blkcg_policy_iolatency;
+
+enum {
+	IOLAT_PRINT_TARGET,
+	IOLAT_PRINT_DEPTH,
+	IOLAT_PRINT_MISSED,
+};
+
+struct iolatency_grp {
+	/* must be the first member */
+	struct blkg_policy_data pd;
+
+	/* requests of this group in flight, tasks waiting for a slot */
+	struct rq_wait rq_wait;
+
+	/* completion latency target in nsecs, 0 if not protected */
+	u64 min_lat_nsec;
+
+	/* sampling window of a protected group */
+	u64 cur_win_nsec;
+	atomic64_t window_start;
+	atomic_t nr_samples;
+	atomic_t nr_missed;
+
+	/* number of windows in which the target was missed */
+	u64 missed_windows;
+
+	/*
+	 * As a parent: the tightest target among the children, and how far
+	 * the other children are scaled down to protect it.
+	 */
+	u64 child_min_lat_nsec;
+	atomic_t scale_step;
+	unsigned long last_scale;
+};
+
+static inline struct iolatency_grp *pd_to_lat(struct blkg_policy_data *pd)
+{
+	return pd ? container_of(pd, struct iolatency_grp, pd) : NULL;
+}
+
+static inline struct iolatency_grp *blkg_to_lat(struct blkcg_gq *blkg)
+{
+	return pd_to_lat(blkg_to_pd(blkg, &blkcg_policy_iolatency));
+}
+
+/*
+ * Siblings of a protected group that has gone quiet would stay throttled
+ * forever, as nobody reports good windows any more. Give back a step
+ * whenever the last scaling event is older than IOLAT_SCALE_UP_DELAY.
+ */
+static void iolat_maybe_scale_up(struct iolatency_grp *parent)
+{
+	unsigned long last = ACCESS_ONCE(parent->last_scale);
+
+	if (!atomic_read(&parent->scale_step) ||
+	    time_before(jiffies, last + IOLAT_SCALE_UP_DELAY))
+		return;
+
+	if (cmpxchg(&parent->last_scale, last, jiffies) != last)
+		return;
+
+	atomic_add_unless(&parent->scale_step, -1, 0);
+}
+
+/*
+ * Walk up from @blkg and add up the scale steps of every level where it
+ * is not the most protected sibling. Returns -1 if there is no protected
+ * group at any level, i.e. @blkg takes no part in latency control.
+ */
+static int iolat_scale_shift(struct blkcg_gq *blkg)
+{
+	int shift = -1;
+
+	for (; blkg && blkg->parent; blkg = blkg->parent) {
+		struct iolatency_grp *iolat = blkg_to_lat(blkg);
+		struct iolatency_grp *parent = blkg_to_lat(blkg->parent);
+		u64 target;
+
+		if (!iolat || !parent)
+			break;
+
+		target = ACCESS_ONCE(parent->child_min_lat_nsec);
+		if (!target)
+			continue;
+
+		if (shift < 0)
+			shift = 0;
+		if (iolat->min_lat_nsec && iolat->min_lat_nsec <= target)
+			continue;
+
+		iolat_maybe_scale_up(parent);
+		shift += atomic_read(&parent->scale_step);
+	}
+
+	return shift;
+}
+
+static int iolat_max_depth(struct blkcg_gq *blkg)
+{
+	unsigned int depth = blk_queue_depth(blkg->q);
+	int shift = iolat_scale_shift(blkg);
+
+	if (shift <= 0)
+		return INT_MAX;
+	if (shift >= 31)
+		return 1;
+
+	return max(depth >> shift, 1U);
+}
+
+/*
+ * Recompute the tightest target among the children of @parent, leaving
+ * out @exclude which is going away. Resets the scaling of the siblings
+ * if it changed.
+ */
+static void iolat_update_parent(struct blkcg_gq *parent,
+				struct blkcg_gq *exclude)
+{
+	struct iolatency_grp *plat = blkg_to_lat(parent);
+	struct blkcg_gq *blkg;
+	u64 min_lat = 0;
+
+	lockdep_assert_held(parent->q->queue_lock);
+
+	list_for_each_entry(blkg, &parent->q->blkg_list, q_node) {
+		struct iolatency_grp *iolat = blkg_to_lat(blkg);
+
+		if (blkg->parent != parent || blkg == exclude ||
+		    !iolat || !iolat->min_lat_nsec)
+			continue;
+		if (!min_lat || iolat->min_lat_nsec < min_lat)
+			min_lat = iolat->min_lat_nsec;
+	}
+
+	if (plat->child_min_lat_nsec != min_lat) {
+		plat->child_min_lat_nsec = min_lat;
+		atomic_set(&plat->scale_step, 0);
+		plat->last_scale = jiffies;
+	}
+}
+
+/*
+ * Called on completions of a protected group. The completion that closes
+ * the window judges it; only the most protected sibling moves the scale.
+ */
+static void iolat_check_window(struct blkcg_gq *blkg,
+			       struct iolatency_grp *iolat, u64 now)
+{
+	struct iolatency_grp *parent;
+	unsigned int samples, missed;
+	u64 start = atomic64_read(&iolat->window_start);
+
+	if (now - start < iolat->cur_win_nsec)
+		return;
+	if (atomic64_cmpxchg(&iolat->window_start, start, now) != start)
+		return;
+
+	samples = atomic_xchg(&iolat->nr_samples, 0);
+	missed = atomic_xchg(&iolat->nr_missed, 0);
+	if (samples < IOLAT_MIN_SAMPLES)
+		return;
+
+	if (missed * 10 > samples)
+		iolat->missed_windows++;
+
+	parent = blkg->parent ? blkg_to_lat(blkg->parent) : NULL;
+	if (!parent || iolat->min_lat_nsec > parent->child_min_lat_nsec)
+		return;
+
+	if (missed * 10 > samples) {
+		if (atomic_read(&parent->scale_step) < IOLAT_MAX_SCALE_STEP)
+			atomic_inc(&parent->scale_step);
+	} else
+		atomic_add_unless(&parent->scale_step, -1, 0);
+	parent->last_scale = jiffies;
+}
+
+/**
+ * blk_iolatency_throttle - charge a bio to its latency group
+ * @q: the request_queue the bio is going to
+ * @bio: the bio about to be turned into a request
+ *
+ * Sleeps while the group of @bio is at its current depth limit. Returns
+ * the group, pinned, if the request is to be accounted; the caller hands
+ * it to blk_iolatency_track() or, if no request could be allocated, to
+ * blk_iolatency_cancel(). Returns %NULL if the group takes no part.
+ */
+struct blkcg_gq *blk_iolatency_throttle(struct request_queue *q,
+					struct bio *bio)
+{
+	struct iolatency_grp *iolat;
+	struct blkcg_gq *blkg;
+	struct blkcg *blkcg;
+	DEFINE_WAIT(wait);
+
+	rcu_read_lock();
+	blkcg = bio_blkcg(bio);
+	if (blkcg == &blkcg_root)
+		goto out_unlock;
+
+	/* cheap check first, most groups don't take part */
+	blkg = blkg_lookup(blkcg, q);
+	if (blkg && iolat_scale_shift(blkg) < 0)
+		goto out_unlock;
+
+	spin_lock_irq(q->queue_lock);
+	if (!blkg) {
+		blkg = blkg_lookup_create(blkcg, q);
+		if (IS_ERR(blkg) || iolat_scale_shift(blkg) < 0)
+			goto out_unlock_queue;
+	}
+	if (!blkg->online || !blkg_to_lat(blkg))
+		goto out_unlock_queue;
+	blkg_get(blkg);
+	spin_unlock_irq(q->queue_lock);
+	rcu_read_unlock();
+
+	iolat = blkg_to_lat(blkg);
+	if (rq_wait_inc_below(&iolat->rq_wait, iolat_max_depth(blkg)))
+		return blkg;
+
+	do {
+		prepare_to_wait_exclusive(&iolat->rq_wait.wait, &wait,
+					  TASK_UNINTERRUPTIBLE);
+
+		if (rq_wait_inc_below(&iolat->rq_wait, iolat_max_depth(blkg)))
+			break;
+
+		io_schedule();
+	} while (1);
+
+	finish_wait(&iolat->rq_wait.wait, &wait);
+	return blkg;
+
+out_unlock_queue:
+	spin_unlock_irq(q->queue_lock);
+out_unlock:
+	rcu_read_unlock();
+	return NULL;
+}
+
+static void __blk_iolatency_done(struct request_queue *q,
+				 struct blkcg_gq *blkg, u64 start_ns)
+{
+	struct iolatency_grp *iolat = blkg_to_lat(blkg);
+	unsigned long flags;
+
+	atomic_dec(&iolat->rq_wait.inflight);
+	if (waitqueue_active(&iolat->rq_wait.wait))
+		wake_up(&iolat->rq_wait.wait);
+
+	if (start_ns) {
+		u64 now = ktime_to_ns(ktime_get());
+		u64 lat = now > start_ns ? now - start_ns : 0;
+		struct blkcg_gq *pos;
+
+		/* protected ancestors see the latency of their children */
+		for (pos = blkg; pos; pos = pos->parent) {
+			struct iolatency_grp *plat = blkg_to_lat(pos);
+
+			if (!plat || !plat->min_lat_nsec)
+				continue;
+
+			atomic_inc(&plat->nr_samples);
+			if (lat > plat->min_lat_nsec)
+				atomic_inc(&plat->nr_missed);
+			iolat_check_window(pos, plat, now);
+		}
+	}
+
+	spin_lock_irqsave(q->queue_lock, flags);
+	blkg_put(blkg);
+	spin_unlock_irqrestore(q->queue_lock, flags);
+}
+
+void blk_iolatency_track(struct request *rq, struct blkcg_gq *blkg)
+{
+	struct request_aux *aux = rq_aux(rq);
+
+	aux->iolat_blkg = blkg;
+	if (blkg)
+		aux->iolat_start_ns = ktime_to_ns(ktime_get());
+}
+
+void blk_iolatency_cancel(struct request_queue *q, struct blkcg_gq *blkg)
+{
+	if (blkg)
+		__blk_iolatency_done(q, blkg, 0);
+}
+
+/* Called when @rq is freed */
+void blk_iolatency_done(struct request *rq)
+{
+	struct request_aux *aux = rq_aux(rq);
+	struct blkcg_gq *blkg = aux->iolat_blkg;
+
+	if (!blkg)
+		return;
+
+	aux->iolat_blkg = NULL;
+	__blk_iolatency_done(rq->q, blkg, aux->iolat_start_ns);
+}
+
+static void iolatency_pd_init(struct blkcg_gq *blkg)
+{
+	struct iolatency_grp *iolat = blkg_to_lat(blkg);
+
+	rq_wait_init(&iolat->rq_wait);
+	iolat->cur_win_nsec = IOLAT_MIN_WIN_NSEC;
+	atomic64_set(&iolat->window_start, ktime_to_ns(ktime_get()));
+	atomic_set(&iolat->nr_samples, 0);
+	atomic_set(&iolat->nr_missed, 0);
+	atomic_set(&iolat->scale_step, 0);
+	iolat->last_scale = jiffies;
+}
+
+static void iolatency_pd_offline(struct blkcg_gq *blkg)
+{
+	struct iolatency_grp *iolat = blkg_to_lat(blkg);
+
+	/* stop protecting a group that is going away */
+	if (blkg->parent && iolat->min_lat_nsec)
+		iolat_update_parent(blkg->parent, blkg);
+
+	wake_up_all(&iolat->rq_wait.wait);
+}
+
+static void iolatency_pd_reset_stats(struct blkcg_gq *blkg)
+{
+	blkg_to_lat(blkg)->missed_windows = 0;
+}
+
+static u64 iolatency_prfill(struct seq_file *sf, struct blkg_policy_data *pd,
+			    int off)
+{
+	struct iolatency_grp *iolat = pd_to_lat(pd);
+	int depth;
+
+	switch (off) {
+	case IOLAT_PRINT_TARGET:
+		if (!iolat->min_lat_nsec)
+			return 0;
+		return __blkg_prfill_u64(sf, pd,
+				div_u64(iolat->min_lat_nsec, NSEC_PER_USEC));
+	case IOLAT_PRINT_DEPTH:
+		depth = iolat_max_depth(pd->blkg);
+		if (depth == INT_MAX)
+			return 0;
+		return __blkg_prfill_u64(sf, pd, depth);
+	case IOLAT_PRINT_MISSED:
+		return __blkg_prfill_u64(sf, pd, iolat->missed_windows);
+	}
+
+	return 0;
+}
+
+static int iolatency_print(struct cgroup *cgrp, struct cftype *cft,
+			   struct seq_file *sf)
+{
+	blkcg_print_blkgs(sf, cgroup_to_blkcg(cgrp), iolatency_prfill,
+			  &blkcg_policy_iolatency, cft->private, false);
+	return 0;
+}
+
+static int iolatency_set_target(struct cgroup *cgrp, struct cftype *cft,
+				const char *buf)
+{
+	struct blkcg *blkcg = cgroup_to_blkcg(cgrp);
+	struct blkg_conf_ctx ctx;
+	struct iolatency_grp *iolat;
+	int ret;
+
+	ret = blkg_conf_prep(blkcg, &blkcg_policy_iolatency, buf, &ctx);
+	if (ret)
+		return ret;
+
+	/* the root group has no siblings to throttle */
+	if (!ctx.blkg->parent) {
+		ret = -EINVAL;
+		goto out_finish;
+	}
+
+	iolat = blkg_to_lat(ctx.blkg);
+	iolat->min_lat_nsec = ctx.v * NSEC_PER_USEC;
+	iolat->cur_win_nsec = clamp_t(u64, iolat->min_lat_nsec << 4,
+				      IOLAT_MIN_WIN_NSEC, IOLAT_MAX_WIN_NSEC);
+	atomic_set(&iolat->nr_samples, 0);
+	atomic_set(&iolat->nr_missed, 0);
+	atomic64_set(&iolat->window_start, ktime_to_ns(ktime_get()));
+
+	iolat_update_parent(ctx.blkg->parent, NULL);
+
+out_finish:
+	blkg_conf_finish(&ctx);
+	return ret;
+}
+
+static struct cftype iolatency_files[] = {
+	{
+		.name = "latency.target_usec_device",
+		.private = IOLAT_PRINT_TARGET,
+		.read_seq_string = iolatency_print,
+		.write_string = iolatency_set_target,
+		.max_write_len = 256,
+	},
+	{
+		.name = "latency.depth",
+		.private = IOLAT_PRINT_DEPTH,
+		.read_seq_string = iolatency_print,
+	},
+	{
+		.name = "latency.missed_windows",
+		.private = IOLAT_PRINT_MISSED,
+		.read_seq_string = iolatency_print,
+	},
+	{ }	/* terminate */
+};
+
+static struct blkcg_policy blkcg_policy_iolatency = {
+	.pd_size		= sizeof(struct iolatency_grp),
+	.cftypes		= iolatency_files,
+
+	.pd_init_fn		= iolatency_pd_init,
+	.pd_offline_fn		= iolatency_pd_offline,
+	.pd_reset_stats_fn	= iolatency_pd_reset_stats,
+};
+
+int blk_iolatency_init(struct request_queue *q)
+{
+	return blkcg_activate_policy(q, &blkcg_policy_iolatency);
+}
+
+void blk_iolatency_exit(struct request_queue *q)
+{
+	blkcg_deactivate_policy(q, &blkcg_policy_iolatency);
+}
+
+static int __init iolatency_init(void)
+{
+	return blkcg_policy_register(&blkcg_policy_iolatency);
+}
+
+module_init(iolatency_init);
@@ -11,13 +11,19 @@
 #include <linux/cpu.h>
 #include <linux/blk-iopoll.h>
 #include <linux/delay.h>
+#include <linux/sched.h>
 
 #include "blk.h"
 
 int blk_iopoll_enabled = 1;
 EXPORT_SYMBOL(blk_iopoll_enabled);
 
-static unsigned int blk_iopoll_budget __read_mostly = 256;
+/*
+ * Completions one softirq run may reap over all polled instances, and the
+ * time it may spend doing so, before the rest is punted to a later run.
+ */
+int blk_iopoll_budget __read_mostly = 256;
+int blk_iopoll_time_limit_us __read_mostly = 2000;
 
 static DEFINE_PER_CPU(struct list_head, blk_cpu_iopoll);
 
@@ -81,7 +87,8 @@ static void blk_iopoll_softirq(struct softirq_action *h)
 {
 	struct list_head *list = &__get_cpu_var(blk_cpu_iopoll);
 	int rearm = 0, budget = blk_iopoll_budget;
-	unsigned long start_time = jiffies;
+	u64 time_limit = (u64) blk_iopoll_time_limit_us * NSEC_PER_USEC;
+	u64 start_time = local_clock();
 
 	local_irq_disable();
 
@@ -92,7 +99,7 @@ static void blk_iopoll_softirq(struct softirq_action *h)
 		/*
 		 * If softirq window is exhausted then punt.
 		 */
-		if (budget <= 0 || time_after(jiffies, start_time)) {
+		if (budget <= 0 || local_clock() - start_time > time_limit) {
 			rearm = 1;
 			break;
 		}
@@ -6,6 +6,9 @@
 #include <linux/bio.h>
 #include <linux/blkdev.h>
 #include <linux/scatterlist.h>
+#include <linux/rbtree.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
 
 #include "blk.h"
 
@@ -26,6 +29,65 @@ static void bio_batch_end_io(struct bio *bio, int err)
 	bio_put(bio);
 }
 
+/*
+ * Discard geometry of @bdev, in sectors: the largest discard that keeps
+ * the following one aligned after a split, and the granularity and
+ * alignment offset the device wants.
+ */
+static int blk_discard_limits(struct request_queue *q,
+			      struct block_device *bdev, sector_t *max_sectors,
+			      sector_t *granularity, sector_t *alignment)
+{
+	sector_t max_discard_sectors, align;
+
+	/* Zero-sector (unknown) and one-sector granularities are the same.  */
+	*granularity = max(q->limits.discard_granularity >> 9, 1U);
+	align = bdev_discard_alignment(bdev) >> 9;
+	*alignment = sector_div(align, *granularity);
+
+	/*
+	 * Ensure that max_discard_sectors is of the proper
+	 * granularity, so that requests stay aligned after a split.
+	 */
+	max_discard_sectors = min(q->limits.max_discard_sectors, UINT_MAX >> 9);
+	sector_div(max_discard_sectors, *granularity);
+	max_discard_sectors *= *granularity;
+	if (unlikely(!max_discard_sectors)) {
+		/* Avoid infinite loop below. Being cautious never hurts. */
+		return -EOPNOTSUPP;
+	}
+
+	*max_sectors = max_discard_sectors;
+	return 0;
+}
+
+/*
+ * Length of the first discard of [sector, sector + nr_sects).  If the
+ * range has to be split, and the next starting sector would be
+ * misaligned, stop the discard at the previous aligned sector.
+ */
+static unsigned int blk_discard_split(sector_t sector, sector_t nr_sects,
+				      sector_t max_discard_sectors,
+				      sector_t granularity, sector_t alignment)
+{
+	unsigned int req_sects;
+	sector_t end_sect, tmp;
+
+	req_sects = min_t(sector_t, nr_sects, max_discard_sectors);
+
+	end_sect = sector + req_sects;
+	tmp = end_sect;
+	if (req_sects < nr_sects &&
+	    sector_div(tmp, granularity) != alignment) {
+		end_sect = end_sect - alignment;
+		sector_div(end_sect, granularity);
+		end_sect = end_sect * granularity + alignment;
+		req_sects = end_sect - sector;
+	}
+
+	return req_sects;
+}
+
 /**
  * blkdev_issue_discard - queue a discard
  * @bdev:	blockdev to issue discard for
@@ -56,22 +118,10 @@ int blkdev_issue_discard(struct block_device *bdev, sector_t sector,
 	if (!blk_queue_discard(q))
 		return -EOPNOTSUPP;
 
-	/* Zero-sector (unknown) and one-sector granularities are the same.  */
-	granularity = max(q->limits.discard_granularity >> 9, 1U);
-	alignment = bdev_discard_alignment(bdev) >> 9;
-	alignment = sector_div(alignment, granularity);
-
-	/*
-	 * Ensure that max_discard_sectors is of the proper
-	 * granularity, so that requests stay aligned after a split.
-	 */
-	max_discard_sectors = min(q->limits.max_discard_sectors, UINT_MAX >> 9);
-	sector_div(max_discard_sectors, granularity);
-	max_discard_sectors *= granularity;
-	if (unlikely(!max_discard_sectors)) {
-		/* Avoid infinite loop below. Being cautious never hurts. */
-		return -EOPNOTSUPP;
-	}
+	ret = blk_discard_limits(q, bdev, &max_discard_sectors, &granularity,
+				 &alignment);
+	if (ret)
+		return ret;
 
 	if (flags & BLKDEV_DISCARD_SECURE) {
 		if (!blk_queue_secdiscard(q))
@@ -86,7 +136,6 @@ int blkdev_issue_discard(struct block_device *bdev, sector_t sector,
 	blk_start_plug(&plug);
 	while (nr_sects) {
 		unsigned int req_sects;
-		sector_t end_sect, tmp;
 
 		bio = bio_alloc(gfp_mask, 1);
 		if (!bio) {
@@ -94,21 +143,9 @@ int blkdev_issue_discard(struct block_device *bdev, sector_t sector,
 			break;
 		}
 
-		req_sects = min_t(sector_t, nr_sects, max_discard_sectors);
-
-		/*
-		 * If splitting a request, and the next starting sector would be
-		 * misaligned, stop the discard at the previous aligned sector.
-		 */
-		end_sect = sector + req_sects;
-		tmp = end_sect;
-		if (req_sects < nr_sects &&
-		    sector_div(tmp, granularity) != alignment) {
-			end_sect = end_sect - alignment;
-			sector_div(end_sect, granularity);
-			end_sect = end_sect * granularity + alignment;
-			req_sects = end_sect - sector;
-		}
+		req_sects = blk_discard_split(sector, nr_sects,
+					      max_discard_sectors,
+					      granularity, alignment);
 
 		bio->bi_sector = sector;
 		bio->bi_end_io = bio_batch_end_io;
@@ -117,7 +154,7 @@ int blkdev_issue_discard(struct block_device *bdev, sector_t sector,
 
 		bio->bi_size = req_sects << 9;
 		nr_sects -= req_sects;
-		sector = end_sect;
+		sector += req_sects;
 
 		atomic_inc(&bb.done);
 		submit_bio(type, bio);
@@ -143,6 +180,345 @@ int blkdev_issue_discard(struct block_device *bdev, sector_t sector,
 }
 EXPORT_SYMBOL(blkdev_issue_discard);
 
+/*
+ * Asynchronous discard batching.
+ *
+ * blkdev_queue_discard() only records the range in a per-queue tree, in
+ * whole-device sectors, merging it with the adjacent and overlapping
+ * ranges already there.  A kblockd work item issues the merged ranges
+ * BLK_DISCARD_BATCH_DELAY after the first one came in, split along
+ * max_discard_sectors and the discard alignment like blkdev_issue_discard()
+ * does, with at most BLK_DISCARD_BATCH_INFLIGHT discards in flight and no
+ * more than queue/discard_batch_mbps worth of sectors per second, so a
+ * discard storm doesn't monopolize the device.  The rate is enforced with
+ * a sector credit that accrues with time and is charged the full size of
+ * every discard issued, so one large discard delays the following ones
+ * accordingly.  blkdev_flush_discards() only skips the batching delay,
+ * the rate limit still applies.
+ */
+#define BLK_DISCARD_BATCH_DELAY		msecs_to_jiffies(10)
+#define BLK_DISCARD_BATCH_INFLIGHT	2
+
+struct blk_discard_batch {
+	spinlock_t		lock;
+	struct rb_root		ranges;
+	sector_t		nr_sects;	/* queued, not yet issued */
+	struct block_device	*bdev;		/* whole device */
+	struct request_queue	*queue;
+	struct delayed_work	work;
+	atomic_t		inflight;
+	s64			credit;		/* sectors we may still issue */
+	unsigned long		stamp;		/* last credit update */
+	wait_queue_head_t	wait;
+	int			error;
+};
+
+struct blk_discard_range {
+	struct rb_node		node;
+	sector_t		start;
+	sector_t		end;
+};
+
+/*
+ * Add [start, end) to the tree, absorbing every range it touches.
+ * Called with b->lock held.
+ */
+static void blk_discard_batch_insert(struct blk_discard_batch *b,
+				     struct blk_discard_range *new)
+{
+	struct rb_node **p = &b->ranges.rb_node, *parent = NULL;
+	struct blk_discard_range *r;
+	struct rb_node *node;
+
+	while (*p) {
+		parent = *p;
+		r = rb_entry(parent, struct blk_discard_range, node);
+		if (new->start < r->start)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&new->node, parent, p);
+	rb_insert_color(&new->node, &b->ranges);
+	b->nr_sects += new->end - new->start;
+
+	/* merge with a predecessor reaching up to us */
+	node = rb_prev(&new->node);
+	if (node) {
+		r = rb_entry(node, struct blk_discard_range, node);
+		if (r->end >= new->start) {
+			b->nr_sects -= min(r->end, new->end) - new->start;
+			new->start = r->start;
+			new->end = max(r->end, new->end);
+			rb_erase(&r->node, &b->ranges);
+			kfree(r);
+		}
+	}
+
+	/* and with the successors we reach */
+	while ((node = rb_next(&new->node))) {
+		r = rb_entry(node, struct blk_discard_range, node);
+		if (r->start > new->end)
+			break;
+		b->nr_sects -= min(r->end, new->end) - r->start;
+		new->end = max(r->end, new->end);
+		rb_erase(&r->node, &b->ranges);
+		kfree(r);
+	}
+}
+
+static void blk_discard_batch_end_io(struct bio *bio, int err)
+{
+	struct blk_discard_batch *b = bio->bi_private;
+
+	if (err && err != -EOPNOTSUPP)
+		cmpxchg(&b->error, 0, err);
+	if (atomic_dec_and_test(&b->inflight))
+		wake_up(&b->wait);
+	bio_put(bio);
+}
+
+static void blk_discard_batch_work(struct work_struct *work)
+{
+	struct blk_discard_batch *b = container_of(to_delayed_work(work),
+					struct blk_discard_batch, work);
+	struct request_queue *q = b->queue;
+	sector_t max_discard_sectors, granularity, alignment;
+	unsigned int mbps = ACCESS_ONCE(q->discard_batch_mbps);
+	struct blk_discard_range *r;
+	struct blk_plug plug;
+	struct bio *bio;
+
+	if (blk_discard_limits(q, b->bdev, &max_discard_sectors,
+			       &granularity, &alignment))
+		max_discard_sectors = 0;
+
+	if (mbps) {
+		/*
+		 * Credit the sectors the elapsed time is worth, but never
+		 * bank more than one batching period so an idle device
+		 * doesn't get a burst.
+		 */
+		u64 rate = (u64) mbps << 11;	/* sectors per second */
+		s64 max = max_t(s64, div_u64(rate *
+				jiffies_to_msecs(BLK_DISCARD_BATCH_DELAY), 1000), 1);
+		unsigned long elapsed = min_t(unsigned long, jiffies - b->stamp,
+					      BLK_DISCARD_BATCH_DELAY);
+
+		b->credit += div_u64(rate * jiffies_to_msecs(elapsed), 1000);
+		b->credit = min(b->credit, max);
+	}
+	b->stamp = jiffies;
+
+	blk_start_plug(&plug);
+	for (;;) {
+		unsigned int req_sects;
+		struct rb_node *node;
+
+		if (mbps && b->credit <= 0)
+			break;
+		if (atomic_read(&b->inflight) >= BLK_DISCARD_BATCH_INFLIGHT)
+			break;
+
+		bio = bio_alloc(GFP_NOIO, 1);
+		if (!bio)
+			break;
+
+		spin_lock_irq(&b->lock);
+		node = rb_first(&b->ranges);
+		if (!node) {
+			spin_unlock_irq(&b->lock);
+			bio_put(bio);
+			break;
+		}
+		r = rb_entry(node, struct blk_discard_range, node);
+
+		if (!max_discard_sectors || !blk_queue_discard(q)) {
+			/* the device lost discard support, drop the range */
+			b->nr_sects -= r->end - r->start;
+			rb_erase(&r->node, &b->ranges);
+			spin_unlock_irq(&b->lock);
+			kfree(r);
+			bio_put(bio);
+			continue;
+		}
+
+		req_sects = blk_discard_split(r->start, r->end - r->start,
+					      max_discard_sectors,
+					      granularity, alignment);
+		bio->bi_sector = r->start;
+		bio->bi_size = req_sects << 9;
+		r->start += req_sects;
+		b->nr_sects -= req_sects;
+		if (mbps)
+			b->credit -= req_sects;
+		if (r->start == r->end) {
+			rb_erase(&r->node, &b->ranges);
+			kfree(r);
+		}
+		spin_unlock_irq(&b->lock);
+
+		bio->bi_end_io = blk_discard_batch_end_io;
+		bio->bi_bdev = b->bdev;
+		bio->bi_private = b;
+		atomic_inc(&b->inflight);
+		submit_bio(REQ_WRITE | REQ_DISCARD, bio);
+	}
+	blk_finish_plug(&plug);
+
+	spin_lock_irq(&b->lock);
+	if (!RB_EMPTY_ROOT(&b->ranges))
+		kblockd_schedule_delayed_work(q, &b->work,
+					      BLK_DISCARD_BATCH_DELAY);
+	else
+		wake_up(&b->wait);
+	spin_unlock_irq(&b->lock);
+}
+
+static struct blk_discard_batch *blk_discard_batch_get(struct request_queue *q,
+						       gfp_t gfp_mask)
+{
+	struct blk_discard_batch *b = ACCESS_ONCE(q->discard_batch);
+
+	if (b)
+		return b;
+
+	b = kzalloc_node(sizeof(*b), gfp_mask, q->node);
+	if (!b)
+		return NULL;
+
+	spin_lock_init(&b->lock);
+	b->ranges = RB_ROOT;
+	b->queue = q;
+	INIT_DELAYED_WORK(&b->work, blk_discard_batch_work);
+	atomic_set(&b->inflight, 0);
+	b->stamp = jiffies;
+	init_waitqueue_head(&b->wait);
+
+	if (cmpxchg(&q->discard_batch, NULL, b)) {
+		kfree(b);
+		b = q->discard_batch;
+	}
+	return b;
+}
+
+/**
+ * blkdev_queue_discard - queue a discard for batched, asynchronous issue
+ * @bdev:	blockdev to issue discard for
+ * @sector:	start sector
+ * @nr_sects:	number of sectors to discard
+ * @gfp_mask:	memory allocation flags
+ *
+ * Description:
+ *    Record a discard of the sectors in question and return without
+ *    waiting for it.  The range may be merged with other queued ranges
+ *    and is issued in the background at a rate bounded by the queue's
+ *    discard_batch_mbps.  The caller must not write to the range again
+ *    until blkdev_flush_discards() has returned.  Pending discards are
+ *    flushed when the last opener of the device closes it.  Secure
+ *    discards are not batched, use blkdev_issue_discard() for those.
+ */
+int blkdev_queue_discard(struct block_device *bdev, sector_t sector,
+			 sector_t nr_sects, gfp_t gfp_mask)
+{
+	struct request_queue *q = bdev_get_queue(bdev);
+	struct blk_discard_batch *b;
+	struct blk_discard_range *r;
+	unsigned long flags;
+
+	if (!q)
+		return -ENXIO;
+
+	if (!blk_queue_discard(q))
+		return -EOPNOTSUPP;
+
+	if (!nr_sects)
+		return 0;
+
+	b = blk_discard_batch_get(q, gfp_mask);
+	if (!b)
+		return -ENOMEM;
+
+	r = kmalloc(sizeof(*r), gfp_mask);
+	if (!r)
+		return -ENOMEM;
+
+	r->start = sector + get_start_sect(bdev);
+	r->end = r->start + nr_sects;
+
+	spin_lock_irqsave(&b->lock, flags);
+	b->bdev = bdev->bd_contains;
+	if (RB_EMPTY_ROOT(&b->ranges))
+		kblockd_schedule_delayed_work(q, &b->work,
+					      BLK_DISCARD_BATCH_DELAY);
+	blk_discard_batch_insert(b, r);
+	spin_unlock_irqrestore(&b->lock, flags);
+
+	return 0;
+}
+EXPORT_SYMBOL(blkdev_queue_discard);
+
+static bool blk_discard_batch_idle(struct blk_discard_batch *b)
+{
+	bool idle;
+
+	spin_lock_irq(&b->lock);
+	idle = RB_EMPTY_ROOT(&b->ranges) && !atomic_read(&b->inflight);
+	spin_unlock_irq(&b->lock);
+	return idle;
+}
+
+/**
+ * blkdev_flush_discards - issue queued discards and wait for them
+ * @bdev:	blockdev the discards were queued for
+ *
+ * Description:
+ *    Start issuing the discards queued on @bdev's device with
+ *    blkdev_queue_discard() without waiting for the batching delay, and
+ *    wait for their completion.  The discards are still issued at the
+ *    rate allowed by the queue's discard_batch_mbps, so the caller is
+ *    throttled along with them.  Returns the first error seen by a
+ *    batched discard since the last flush.
+ */
+int blkdev_flush_discards(struct block_device *bdev)
+{
+	struct request_queue *q = bdev_get_queue(bdev);
+	struct blk_discard_batch *b;
+	int ret;
+
+	if (!q)
+		return -ENXIO;
+
+	b = ACCESS_ONCE(q->discard_batch);
+	if (!b)
+		return 0;
+
+	if (cancel_delayed_work(&b->work))
+		kblockd_schedule_delayed_work(q, &b->work, 0);
+	wait_event(b->wait, blk_discard_batch_idle(b));
+
+	ret = xchg(&b->error, 0);
+	return ret;
+}
+EXPORT_SYMBOL(blkdev_flush_discards);
+
+void blk_discard_batch_exit(struct request_queue *q)
+{
+	struct blk_discard_batch *b = q->discard_batch;
+	struct rb_node *node;
+
+	if (!b)
+		return;
+
+	cancel_delayed_work_sync(&b->work);
+	while ((node = rb_first(&b->ranges))) {
+		rb_erase(node, &b->ranges);
+		kfree(rb_entry(node, struct blk_discard_range, node));
+	}
+	kfree(b);
+	q->discard_batch = NULL;
+}
+
 /**
  * blkdev_issue_write_same - queue a write same operation
  * @bdev:	target blockdev
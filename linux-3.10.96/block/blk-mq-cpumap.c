@@ -36,12 +36,81 @@ static int get_first_sibling(unsigned int cpu)
 	return cpu;
 }
 
+static unsigned int node_nr_online_cpus(int node)
+{
+	unsigned int cpu, nr = 0;
+
+	for_each_cpu_and(cpu, cpumask_of_node(node), cpu_online_mask)
+		nr++;
+
+	return nr;
+}
+
+/*
+ * BLK_MQ_F_NUMA_MAP: hand each node with online cpus its own range of
+ * hardware queues, sized by its share of the online cpus and at least one,
+ * and spread the node's cpus over that range, siblings together. Queues
+ * then never serve cpus of two nodes, so their tags and requests can live
+ * on that node, see blk_mq_hw_queue_to_node().
+ */
+static void blk_mq_map_queues_numa(struct blk_mq_tag_set *set,
+				   unsigned int nr_nodes)
+{
+	unsigned int *map = set->mq_map;
+	unsigned int queues_left = set->nr_hw_queues;
+	unsigned int cpus_left = num_online_cpus();
+	unsigned int queue = 0, node_queues, node_cpus, cpu, first_sibling, i;
+	int node;
+
+	/* offline cpus go to queue 0, like in blk_mq_map_queues() */
+	for_each_possible_cpu(cpu)
+		map[cpu] = 0;
+
+	for_each_online_node(node) {
+		node_cpus = node_nr_online_cpus(node);
+		if (!node_cpus)
+			continue;
+
+		node_queues = queues_left * node_cpus / cpus_left;
+		node_queues = clamp(node_queues, 1U, queues_left - (nr_nodes - 1));
+
+		i = 0;
+		for_each_cpu_and(cpu, cpumask_of_node(node), cpu_online_mask) {
+			first_sibling = get_first_sibling(cpu);
+			if (first_sibling < cpu &&
+			    cpu_to_node(first_sibling) == node &&
+			    cpu_online(first_sibling))
+				map[cpu] = map[first_sibling];
+			else
+				map[cpu] = queue + (i++ % node_queues);
+		}
+
+		queue += node_queues;
+		queues_left -= node_queues;
+		cpus_left -= node_cpus;
+		nr_nodes--;
+	}
+}
+
 int blk_mq_map_queues(struct blk_mq_tag_set *set)
 {
 	unsigned int *map = set->mq_map;
 	unsigned int nr_queues = set->nr_hw_queues;
 	const struct cpumask *online_mask = cpu_online_mask;
-	unsigned int cpu, first_sibling;
+	unsigned int cpu, first_sibling, nr_nodes = 0;
+	int node;
+
+	if (set->flags & BLK_MQ_F_NUMA_MAP) {
+		for_each_online_node(node)
+			if (node_nr_online_cpus(node))
+				nr_nodes++;
+
+		/* needs a queue per node at least */
+		if (nr_nodes > 1 && nr_queues >= nr_nodes) {
+			blk_mq_map_queues_numa(set, nr_nodes);
+			return 0;
+		}
+	}
 
 	for_each_possible_cpu(cpu) {
 		/*
@@ -23,6 +23,7 @@
 #include "blk-mq.h"
 #include "blk-mq-debugfs.h"
 #include "blk-mq-tag.h"
+#include "blk-stat.h"
 
 static int blk_flags_show(struct seq_file *m, const unsigned long flags,
 			  const char *const *flag_name, int flag_name_count)
@@ -80,9 +81,34 @@ static const char *const blk_queue_flag_name[] = {
 	QUEUE_FLAG_NAME(POLL_STATS),
 	QUEUE_FLAG_NAME(PREEMPT_ONLY),
 	QUEUE_FLAG_NAME(QUIESCED),
+	QUEUE_FLAG_NAME(POLL),
 };
 #undef QUEUE_FLAG_NAME
 
+static void print_stat(struct seq_file *m, struct blk_rq_stat *stat)
+{
+	if (stat->nr_samples) {
+		seq_printf(m, "samples=%d, mean=%lld, min=%llu, max=%llu",
+			   stat->nr_samples, stat->mean, stat->min, stat->max);
+	} else {
+		seq_puts(m, "samples=0");
+	}
+}
+
+static int queue_poll_stat_show(void *data, struct seq_file *m)
+{
+	struct request_queue *q = data;
+
+	seq_puts(m, "read: ");
+	print_stat(m, &q->poll_stat[READ]);
+	seq_puts(m, "\n");
+
+	seq_puts(m, "write: ");
+	print_stat(m, &q->poll_stat[WRITE]);
+	seq_puts(m, "\n");
+	return 0;
+}
+
 static int queue_state_show(void *data, struct seq_file *m)
 {
 	struct request_queue *q = data;
@@ -160,6 +186,7 @@ static const char *const hctx_flag_name[] = {
 	HCTX_FLAG_NAME(SHOULD_MERGE),
 	HCTX_FLAG_NAME(TAG_SHARED),
 	HCTX_FLAG_NAME(SG_MERGE),
+	HCTX_FLAG_NAME(NUMA_MAP),
 	HCTX_FLAG_NAME(BLOCKING),
 	HCTX_FLAG_NAME(NO_SCHED),
 };
@@ -441,6 +468,70 @@ out:
 	return res;
 }
 
+/*
+ * One line per operation and size class with samples, each bucket as
+ * "<upper bound in usecs>:<count>".  Writing anything clears the counts.
+ */
+static int hctx_lat_hist_show(void *data, struct seq_file *m)
+{
+	struct blk_mq_hw_ctx *hctx = data;
+	struct request_queue *q = hctx->queue;
+	struct blk_rq_hist *hist;
+	int op, size, i, res;
+
+	hist = kmalloc(sizeof(*hist), GFP_KERNEL);
+	if (!hist)
+		return -ENOMEM;
+
+	res = mutex_lock_interruptible(&q->sysfs_lock);
+	if (res)
+		goto out;
+	if (!blk_stat_hist_sum(hctx, hist))
+		goto unlock;
+
+	for (op = 0; op < BLK_STAT_HIST_OPS; op++) {
+		for (size = 0; size < BLK_STAT_HIST_SIZES; size++) {
+			unsigned long *b = hist->buckets[op][size];
+			bool empty = true;
+
+			for (i = 0; i < BLK_STAT_HIST_BUCKETS; i++) {
+				if (!b[i])
+					continue;
+				if (empty)
+					seq_printf(m, "%s %s:",
+						   blk_stat_hist_op_name[op],
+						   blk_stat_hist_size_name[size]);
+				empty = false;
+				seq_printf(m, " %llu:%lu", div_u64(
+					   blk_stat_hist_bucket_nsec(i), 1000),
+					   b[i]);
+			}
+			if (!empty)
+				seq_putc(m, '\n');
+		}
+	}
+unlock:
+	mutex_unlock(&q->sysfs_lock);
+out:
+	kfree(hist);
+	return res;
+}
+
+static ssize_t hctx_lat_hist_write(void *data, const char __user *buf,
+				   size_t count, loff_t *ppos)
+{
+	struct blk_mq_hw_ctx *hctx = data;
+	struct request_queue *q = hctx->queue;
+	int res;
+
+	res = mutex_lock_interruptible(&q->sysfs_lock);
+	if (res)
+		return res;
+	blk_stat_hist_reset(hctx);
+	mutex_unlock(&q->sysfs_lock);
+	return count;
+}
+
 static int hctx_dispatched_show(void *data, struct seq_file *m)
 {
 	struct blk_mq_hw_ctx *hctx = data;
@@ -511,6 +602,25 @@ static int hctx_active_show(void *data, struct seq_file *m)
 	return 0;
 }
 
+static int hctx_io_poll_show(void *data, struct seq_file *m)
+{
+	struct blk_mq_hw_ctx *hctx = data;
+
+	seq_printf(m, "considered=%lu\n", hctx->poll_considered);
+	seq_printf(m, "invoked=%lu\n", hctx->poll_invoked);
+	seq_printf(m, "success=%lu\n", hctx->poll_success);
+	return 0;
+}
+
+static ssize_t hctx_io_poll_write(void *data, const char __user *buf,
+				  size_t count, loff_t *ppos)
+{
+	struct blk_mq_hw_ctx *hctx = data;
+
+	hctx->poll_considered = hctx->poll_invoked = hctx->poll_success = 0;
+	return count;
+}
+
 static int hctx_dispatch_busy_show(void *data, struct seq_file *m)
 {
 	struct blk_mq_hw_ctx *hctx = data;
@@ -584,6 +694,23 @@ static ssize_t ctx_merged_write(void *data, const char __user *buf,
 	return count;
 }
 
+static int ctx_merge_miss_show(void *data, struct seq_file *m)
+{
+	struct blk_mq_ctx *ctx = data;
+
+	seq_printf(m, "%lu\n", ctx->rq_merge_miss);
+	return 0;
+}
+
+static ssize_t ctx_merge_miss_write(void *data, const char __user *buf,
+				    size_t count, loff_t *ppos)
+{
+	struct blk_mq_ctx *ctx = data;
+
+	ctx->rq_merge_miss = 0;
+	return count;
+}
+
 static int ctx_completed_show(void *data, struct seq_file *m)
 {
 	struct blk_mq_ctx *ctx = data;
@@ -601,6 +728,23 @@ static ssize_t ctx_completed_write(void *data, const char __user *buf,
 	return count;
 }
 
+static int ctx_completed_remote_show(void *data, struct seq_file *m)
+{
+	struct blk_mq_ctx *ctx = data;
+
+	seq_printf(m, "%lu\n", ctx->rq_completed_remote);
+	return 0;
+}
+
+static ssize_t ctx_completed_remote_write(void *data, const char __user *buf,
+					  size_t count, loff_t *ppos)
+{
+	struct blk_mq_ctx *ctx = data;
+
+	ctx->rq_completed_remote = 0;
+	return count;
+}
+
 struct mq_seq_file_param {
 	const struct blk_mq_debugfs_attr *attr;
 	const struct file *file;
@@ -684,6 +828,7 @@ const struct file_operations blk_mq_debugfs_fops = {
 };
 
 static const struct blk_mq_debugfs_attr blk_mq_debugfs_queue_attrs[] = {
+	{"poll_stat", 0400, queue_poll_stat_show},
 	{"state", 0600, queue_state_show, queue_state_write},
 	{"requeue_list", 0400, .seq_ops = &queue_requeue_list_seq_ops},
 	{},
@@ -700,10 +845,12 @@ static const struct blk_mq_debugfs_attr blk_mq_debugfs_hctx_attrs[] = {
 	{"sched_tags", 0400, hctx_sched_tags_show},
 	{"sched_tags_bitmap", 0400, hctx_sched_tags_bitmap_show},
 	{"dispatched", 0600, hctx_dispatched_show, hctx_dispatched_write},
+	{"io_poll", 0600, hctx_io_poll_show, hctx_io_poll_write},
 	{"queued", 0600, hctx_queued_show, hctx_queued_write},
 	{"run", 0600, hctx_run_show, hctx_run_write},
 	{"active", 0400, hctx_active_show},
 	{"dispatch_busy", 0400, hctx_dispatch_busy_show},
+	{"lat_hist", 0600, hctx_lat_hist_show, hctx_lat_hist_write},
 	{},
 };
 
@@ -711,7 +858,10 @@ static const struct blk_mq_debugfs_attr blk_mq_debugfs_ctx_attrs[] = {
 	{"rq_list", 0400, .seq_ops = &ctx_rq_list_seq_ops},
 	{"dispatched", 0600, ctx_dispatched_show, ctx_dispatched_write},
 	{"merged", 0600, ctx_merged_show, ctx_merged_write},
+	{"merge_miss", 0600, ctx_merge_miss_show, ctx_merge_miss_write},
 	{"completed", 0600, ctx_completed_show, ctx_completed_write},
+	{"completed_remote", 0600, ctx_completed_remote_show,
+	 ctx_completed_remote_write},
 	{},
 };
 
@@ -12,6 +12,7 @@
 #include <linux/blk-mq.h>
 #include "blk-mq.h"
 #include "blk-mq-tag.h"
+#include "blk-stat.h"
 
 static void blk_mq_sysfs_release(struct kobject *kobj)
 {
@@ -186,6 +187,52 @@ static ssize_t blk_mq_hw_sysfs_active_show(struct blk_mq_hw_ctx *hctx, char *pag
 	return sprintf(page, "%u\n", atomic_read(&hctx->nr_active));
 }
 
+/*
+ * "<op> <samples> <p50> <p90> <p99> <p99.9>" per operation with samples,
+ * latencies in usecs, when the queue's lat_hist attribute is set.
+ */
+static ssize_t blk_mq_hw_sysfs_latency_show(struct blk_mq_hw_ctx *hctx,
+					    char *page)
+{
+	static const unsigned int permille[] = { 500, 900, 990, 999 };
+	unsigned long buckets[BLK_STAT_HIST_BUCKETS];
+	struct blk_rq_hist *hist;
+	ssize_t ret = 0;
+	int op, size, i;
+
+	hist = kmalloc(sizeof(*hist), GFP_KERNEL);
+	if (!hist)
+		return -ENOMEM;
+
+	if (!blk_stat_hist_sum(hctx, hist))
+		goto out;
+
+	for (op = 0; op < BLK_STAT_HIST_OPS; op++) {
+		unsigned long nr = 0;
+
+		memset(buckets, 0, sizeof(buckets));
+		for (size = 0; size < BLK_STAT_HIST_SIZES; size++) {
+			for (i = 0; i < BLK_STAT_HIST_BUCKETS; i++) {
+				buckets[i] += hist->buckets[op][size][i];
+				nr += hist->buckets[op][size][i];
+			}
+		}
+		if (!nr)
+			continue;
+
+		ret += sprintf(page + ret, "%s %lu", blk_stat_hist_op_name[op],
+			       nr);
+		for (i = 0; i < ARRAY_SIZE(permille); i++)
+			ret += sprintf(page + ret, " %llu", div_u64(
+				blk_stat_hist_percentile(buckets, nr,
+							 permille[i]), 1000));
+		ret += sprintf(page + ret, "\n");
+	}
+out:
+	kfree(hist);
+	return ret;
+}
+
 static ssize_t blk_mq_hw_sysfs_cpus_show(struct blk_mq_hw_ctx *hctx, char *page)
 {
 	unsigned int i, first = 1;
@@ -253,6 +300,11 @@ static struct blk_mq_hw_ctx_sysfs_entry blk_mq_hw_sysfs_cpus = {
 	.show = blk_mq_hw_sysfs_cpus_show,
 };
 
+static struct blk_mq_hw_ctx_sysfs_entry blk_mq_hw_sysfs_latency = {
+	.attr = {.name = "latency", .mode = S_IRUGO },
+	.show = blk_mq_hw_sysfs_latency_show,
+};
+
 static struct attribute *default_hw_ctx_attrs[] = {
 	&blk_mq_hw_sysfs_queued.attr,
 	&blk_mq_hw_sysfs_run.attr,
@@ -261,6 +313,7 @@ static struct attribute *default_hw_ctx_attrs[] = {
 	&blk_mq_hw_sysfs_nr_reserved_tags.attr,
 	&blk_mq_hw_sysfs_cpus.attr,
 	&blk_mq_hw_sysfs_active.attr,
+	&blk_mq_hw_sysfs_latency.attr,
 	NULL,
 };
 
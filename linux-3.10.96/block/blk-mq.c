@@ -22,6 +22,7 @@
 #include <linux/sched/sysctl.h>
 #include <linux/delay.h>
 #include <linux/crash_dump.h>
+#include <linux/hrtimer.h>
 
 #include <trace/events/block.h>
 
@@ -32,6 +33,7 @@
 #include "blk-mq-tag.h"
 #include "blk-mq-sched.h"
 #include "blk-stat.h"
+#include "blk-wbt.h"
 
 static DEFINE_MUTEX(all_q_mutex);
 static LIST_HEAD(all_q_list);
@@ -66,64 +68,25 @@ static void blk_mq_hctx_clear_pending(struct blk_mq_hw_ctx *hctx,
 	sbitmap_clear_bit(&hctx->ctx_map, ctx->index_hw);
 }
 
-struct mq_inflight {
-	struct hd_struct *part;
-	unsigned int *inflight;
-};
-
-static void blk_mq_check_inflight(struct blk_mq_hw_ctx *hctx,
-				  struct request *rq, void *priv,
-				  bool reserved)
-{
-	struct mq_inflight *mi = priv;
-
-    //957.27 ںжϣ957ںûжϣrq->atomic_flagsȡֵ123
-    //rq->atomic_flagsΪ10ifʱʾreqûùstart״̬
-	if (!blk_mq_request_started(rq))
-		return;
-
-	/*
-	 * index[0] counts the specific partition that was asked
-	 * for. index[1] counts the ones that are active on the
-	 * whole device, so increment that if mi->part is indeed
-	 * a partition, and not a whole device.
-	 */
-	//part_round_stats->part_in_flight->blk_mq_in_flightinflight[0]inflight[1]part_round_stats()ľֲ
-	if (rq->part == mi->part)
-		mi->inflight[0]++;
-	if (mi->part->partno)
-		mi->inflight[1]++;
-}
-
+/*
+ * In-flight counts come from the per-cpu partition counters which request
+ * accounting maintains anyway, so stats readers no longer walk every tag
+ * of the queue.
+ */
 void blk_mq_in_flight(struct request_queue *q, struct hd_struct *part,
 		      unsigned int inflight[2])
 {
-	struct mq_inflight mi = { .part = part, .inflight = inflight, };
-
-	inflight[0] = inflight[1] = 0;
-	blk_mq_queue_tag_busy_iter(q, blk_mq_check_inflight, &mi);
-}
-
-static void blk_mq_check_inflight_rw(struct blk_mq_hw_ctx *hctx,
-				     struct request *rq, void *priv,
-				     bool reserved)
-{
-	struct mq_inflight *mi = priv;
-
-	if (!blk_mq_request_started(rq))
-		return;
-
-	if (rq->part == mi->part)
-		mi->inflight[rq_data_dir(rq)]++;
+	inflight[0] = part_in_flight(part);
+	inflight[1] = 0;
+	if (part->partno)
+		inflight[1] = part_in_flight(&part_to_disk(part)->part0);
 }
 
 void blk_mq_in_flight_rw(struct request_queue *q, struct hd_struct *part,
 			 unsigned int inflight[2])
 {
-	struct mq_inflight mi = { .part = part, .inflight = inflight, };
-
-	inflight[0] = inflight[1] = 0;
-	blk_mq_queue_tag_busy_iter(q, blk_mq_check_inflight_rw, &mi);
+	inflight[0] = part_in_flight_rw(part, READ);
+	inflight[1] = part_in_flight_rw(part, WRITE);
 }
 
 void blk_freeze_queue_start(struct request_queue *q)
@@ -450,31 +413,60 @@ blk_mq_sched_completed_request(struct request *rq)
 		e->aux->ops.mq.completed_request(rq);
 }
 
-void __blk_mq_finish_request(struct blk_mq_hw_ctx *hctx, struct blk_mq_ctx *ctx,
-			     struct request *rq)
+/*
+ * Give back the tags of @rq. The caller restarts @hctx and drops the
+ * queue reference, see __blk_mq_finish_request().
+ */
+static void __blk_mq_put_request_tags(struct blk_mq_hw_ctx *hctx,
+				      struct blk_mq_ctx *ctx,
+				      struct request *rq)
 {
 	const int sched_tag = rq_aux(rq)->internal_tag;
 	struct request_queue *q = rq->q;
 
+	wbt_done(q->rq_wb, rq);
+	blk_iolatency_done(rq);
+
 	if (rq->cmd_flags & REQ_MQ_INFLIGHT)
 		atomic_dec(&hctx->nr_active);
 	rq->cmd_flags = 0;
 
 	clear_bit(REQ_ATOM_STARTED, &rq->atomic_flags);
+	clear_bit(REQ_ATOM_POLL_SLEPT, &rq->atomic_flags);
 	if (rq->tag != -1)
 		blk_mq_put_tag(hctx, hctx->tags, ctx, rq->tag);
 	if (sched_tag != -1)
 		blk_mq_put_tag(hctx, hctx->sched_tags, ctx, sched_tag);
+}
+
+void __blk_mq_finish_request(struct blk_mq_hw_ctx *hctx, struct blk_mq_ctx *ctx,
+			     struct request *rq)
+{
+	struct request_queue *q = rq->q;
+
+	__blk_mq_put_request_tags(hctx, ctx, rq);
 	blk_mq_sched_restart(hctx);
 	blk_queue_exit(q);
 }
 
+/*
+ * Count a completion against the submitting ctx, and note it when the
+ * request is finished on another node than the one it was issued from.
+ */
+static inline void blk_mq_account_completion(struct blk_mq_ctx *ctx,
+					     struct request *rq)
+{
+	ctx->rq_completed[rq_is_sync(rq)]++;
+	if (cpu_to_node(raw_smp_processor_id()) != cpu_to_node(ctx->cpu))
+		ctx->rq_completed_remote++;
+}
+
 static void blk_mq_finish_hctx_request(struct blk_mq_hw_ctx *hctx,
 				       struct request *rq)
 {
 	struct blk_mq_ctx *ctx = rq->mq_ctx;
 
-	ctx->rq_completed[rq_is_sync(rq)]++;
+	blk_mq_account_completion(ctx, rq);
 	__blk_mq_finish_request(hctx, ctx, rq);
 }
 EXPORT_SYMBOL_GPL(blk_mq_finish_request);
@@ -554,7 +546,7 @@ static void blk_mq_stat_add(struct request *rq)
 {
 	if (rq->cmd_flags & REQ_STATS) {
 		blk_mq_poll_stats_start(rq->q);
-		blk_stat_add(rq);
+		blk_stat_add(rq, ktime_to_ns(ktime_get()));
 	}
 }
 
@@ -625,6 +617,119 @@ void blk_mq_complete_request_sync(struct request *rq, int error)
 }
 EXPORT_SYMBOL_GPL(blk_mq_complete_request_sync);
 
+/**
+ * blk_mq_add_to_batch - queue a completed request for batched completion
+ * @rq:		the request being processed
+ * @batch:	batch to add @rq to
+ * @error:	completion status of @rq
+ *
+ * Description:
+ *	Drivers call this from their completion or poll loop instead of
+ *	blk_mq_complete_request().  Requests that can't be batched (errors,
+ *	own end_io, bidi, queues that force completion on the submitting
+ *	cpu) are left alone and %false is returned; the driver completes
+ *	those the usual way.  Batched requests bypass ->softirq_done_fn and
+ *	are ended on the current cpu, so the driver must be done with them
+ *	before calling blk_mq_end_request_batch().
+ **/
+bool blk_mq_add_to_batch(struct request *rq, struct blk_mq_batch *batch,
+			 int error)
+{
+	struct request_queue *q = rq->q;
+
+	if (error || rq->end_io || blk_bidi_rq(rq) ||
+	    test_bit(QUEUE_FLAG_SAME_FORCE, &q->queue_flags))
+		return false;
+
+	/* either way, the request is not the driver's any more */
+	if (unlikely(blk_should_fake_timeout(q)))
+		return true;
+	if (blk_mark_rq_complete(rq))
+		return true;
+
+	rq->errors = 0;
+	list_add_tail(&rq->queuelist, &batch->list);
+	batch->nr++;
+	return true;
+}
+EXPORT_SYMBOL_GPL(blk_mq_add_to_batch);
+
+/*
+ * Restart @hctx once for the run of requests it owned, then drop the
+ * queue reference each of them held; q_usage_counter has no way to put
+ * several references at once, so that is still one put per request.
+ */
+static void blk_mq_batch_restart(struct blk_mq_hw_ctx *hctx,
+				 unsigned int nr_exit)
+{
+	blk_mq_sched_restart(hctx);
+	while (nr_exit--)
+		blk_queue_exit(hctx->queue);
+}
+
+/**
+ * blk_mq_end_request_batch - end all requests gathered in a batch
+ * @batch:	batch filled by blk_mq_add_to_batch()
+ *
+ * Description:
+ *	Like blk_mq_end_request() on each request, but the clock is read
+ *	once for the whole batch and a hardware queue is restarted once per
+ *	run of requests it owns rather than once per request.  Tags and
+ *	queue references are still released per request.  Requests of
+ *	queues with an I/O scheduler are freed back through the scheduler.
+ *	This is meant for blk-mq drivers; none in this tree uses it yet.
+ **/
+void blk_mq_end_request_batch(struct blk_mq_batch *batch)
+{
+	struct blk_mq_hw_ctx *hctx, *last_hctx = NULL;
+	struct request *rq, *next;
+	unsigned int nr_exit = 0;
+	u64 now = 0;
+
+	list_for_each_entry_safe(rq, next, &batch->list, queuelist) {
+		struct request_queue *q = rq->q;
+		struct blk_mq_ctx *ctx = rq->mq_ctx;
+
+		list_del_init(&rq->queuelist);
+
+		if (rq_aux(rq)->internal_tag != -1)
+			blk_mq_sched_completed_request(rq);
+
+		if (rq->cmd_flags & REQ_STATS) {
+			if (!now)
+				now = ktime_to_ns(ktime_get());
+			blk_mq_poll_stats_start(q);
+			blk_stat_add(rq, now);
+		}
+
+		if (blk_update_request(rq, 0, blk_rq_bytes(rq)))
+			BUG();
+		blk_account_io_done(rq);
+
+		if (q->elevator) {
+			blk_mq_free_request(rq);
+			continue;
+		}
+
+		hctx = blk_mq_map_queue(q, ctx->cpu);
+		if (hctx != last_hctx) {
+			if (last_hctx)
+				blk_mq_batch_restart(last_hctx, nr_exit);
+			last_hctx = hctx;
+			nr_exit = 0;
+		}
+
+		blk_mq_account_completion(ctx, rq);
+		__blk_mq_put_request_tags(hctx, ctx, rq);
+		nr_exit++;
+	}
+
+	if (last_hctx)
+		blk_mq_batch_restart(last_hctx, nr_exit);
+	batch->nr = 0;
+}
+EXPORT_SYMBOL_GPL(blk_mq_end_request_batch);
+
 int blk_mq_request_started(struct request *rq)
 {
 	return test_bit(REQ_ATOM_STARTED, &rq->atomic_flags);
@@ -646,6 +751,7 @@ void blk_mq_start_request(struct request *rq)
 	if (test_bit(QUEUE_FLAG_STATS, &q->queue_flags)) {
 		blk_stat_set_issue_time(&rq_aux(rq)->issue_stat);
 		rq->cmd_flags |= REQ_STATS;
+		wbt_issue(q->rq_wb, rq);
 	}
     //reqӵq->timeout_listq->timeout
 	blk_add_timer(rq);
@@ -667,6 +773,9 @@ void blk_mq_start_request(struct request *rq)
 	if (test_bit(REQ_ATOM_COMPLETE, &rq->atomic_flags))
 		clear_bit(REQ_ATOM_COMPLETE, &rq->atomic_flags);
 
+	/* only now, a bucket scan drops tags it finds not started */
+	blk_mq_add_timer(rq);
+
 	if (q->dma_drain_size && blk_rq_bytes(rq)) {
 		/*
 		 * Make sure space for the drain appears.  We know we can do
@@ -694,6 +803,7 @@ static void __blk_mq_requeue_request(struct request *rq)
 	blk_mq_put_driver_tag(rq);
 
 	trace_block_rq_requeue(q, rq);
+	wbt_requeue(q->rq_wb, rq);
 
 	if (test_and_clear_bit(REQ_ATOM_STARTED, &rq->atomic_flags)) {
 		if (q->dma_drain_size && blk_rq_bytes(rq))
@@ -823,6 +933,7 @@ void blk_mq_rq_timed_out(struct request *req, bool reserved)
 		break;
 	case BLK_EH_RESET_TIMER:
 		blk_add_timer(req);
+		blk_mq_add_timer(req);
 		blk_clear_rq_complete(req);
 		break;
 	case BLK_EH_NOT_HANDLED:
@@ -833,35 +944,126 @@ void blk_mq_rq_timed_out(struct request *req, bool reserved)
 	}
 }
 
+static unsigned long *blk_mq_timeout_bucket(struct blk_mq_hw_ctx *hctx,
+					    unsigned long slot)
+{
+	return hctx->timeout_map + (slot & (BLK_MQ_TIMEOUT_BUCKETS - 1)) *
+		BITS_TO_LONGS(hctx->timeout_map_bits);
+}
+
+/**
+ * blk_mq_add_timer - queue a started request for timeout checking
+ * @rq:	request whose ->deadline was just set
+ *
+ * Description:
+ *    Every hctx keeps BLK_MQ_TIMEOUT_BUCKETS bitmaps of driver tags, one
+ *    per slot of 1 << BLK_MQ_TIMEOUT_SHIFT jiffies, used as a wheel.  The
+ *    request's tag is set in the bucket of its deadline; it must already
+ *    be marked REQ_ATOM_STARTED, or a concurrent scan of the bucket could
+ *    clear the bit and skip it for good.  Nothing clears
+ *    it when the request completes: blk_mq_check_expired() only visits
+ *    buckets which are due and drops the tags it finds no longer started,
+ *    or started again with a deadline in another slot.
+ */
+void blk_mq_add_timer(struct request *rq)
+{
+	struct blk_mq_hw_ctx *hctx = blk_mq_map_queue(rq->q, rq->mq_ctx->cpu);
+
+	if (unlikely(rq->tag < 0 || rq->tag >= hctx->timeout_map_bits))
+		return;
+
+	/* order ->deadline against the bit, see blk_mq_check_expired() */
+	smp_mb__before_atomic();
+	set_bit(rq->tag, blk_mq_timeout_bucket(hctx,
+			rq->deadline >> BLK_MQ_TIMEOUT_SHIFT));
+}
+
+static void blk_mq_check_expired_bucket(struct blk_mq_hw_ctx *hctx,
+		unsigned long slot, struct blk_mq_timeout_data *data)
+{
+	unsigned long *map = blk_mq_timeout_bucket(hctx, slot);
+	unsigned long mask = BLK_MQ_TIMEOUT_BUCKETS - 1;
+	struct request *rq;
+	unsigned int tag;
+
+	for_each_set_bit(tag, map, hctx->timeout_map_bits) {
+		if (!test_and_clear_bit(tag, map))
+			continue;
+
+		rq = blk_mq_tag_to_rq(hctx->tags, tag);
+		if (!rq || rq->q != hctx->queue ||
+		    !test_bit(REQ_ATOM_STARTED, &rq->atomic_flags))
+			continue;
+
+		/* restarted since, it is in the bucket of its new deadline */
+		if (((rq->deadline >> BLK_MQ_TIMEOUT_SHIFT) & mask) !=
+		    (slot & mask))
+			continue;
+
+		/*
+		 * The rq being checked may have been freed and reallocated
+		 * out already here, we avoid this race by checking rq->deadline
+		 * and REQ_ATOM_COMPLETE flag together:
+		 *
+		 * - if rq->deadline is observed as new value because of
+		 *   reusing, the rq won't be timed out because of timing.
+		 * - if rq->deadline is observed as previous value,
+		 *   REQ_ATOM_COMPLETE flag won't be cleared in reuse path
+		 *   because we put a barrier between setting rq->deadline
+		 *   and clearing the flag in blk_mq_start_request(), so
+		 *   this rq won't be timed out too.
+		 */
+		if (time_after_eq(jiffies, rq->deadline)) {
+			if (!blk_mark_rq_complete(rq))
+				blk_mq_rq_timed_out(rq,
+					blk_mq_tag_is_reserved(hctx->tags, tag));
+			continue;
+		}
+
+		/* not due yet, or a wrap of the wheel away */
+		set_bit(tag, map);
+		if (!data->next_set || time_after(data->next, rq->deadline)) {
+			data->next = rq->deadline;
+			data->next_set = 1;
+		}
+	}
+}
+
+/*
+ * Check the buckets of all slots which came due since the last run, up to
+ * and including the current one, and find out when the next one is.
+ */
 static void blk_mq_check_expired(struct blk_mq_hw_ctx *hctx,
-		struct request *rq, void *priv, bool reserved)
+		struct blk_mq_timeout_data *data)
 {
-	struct blk_mq_timeout_data *data = priv;
+	unsigned long now = jiffies >> BLK_MQ_TIMEOUT_SHIFT;
+	unsigned long slot = hctx->timeout_slot;
+	unsigned long next;
+	unsigned int i;
 
-	if (!test_bit(REQ_ATOM_STARTED, &rq->atomic_flags))
+	if (!hctx->timeout_map)
 		return;
 
-	/*
-	 * The rq being checked may have been freed and reallocated
-	 * out already here, we avoid this race by checking rq->deadline
-	 * and REQ_ATOM_COMPLETE flag together:
-	 *
-	 * - if rq->deadline is observed as new value because of
-	 *   reusing, the rq won't be timed out because of timing.
-	 * - if rq->deadline is observed as previous value,
-	 *   REQ_ATOM_COMPLETE flag won't be cleared in reuse path
-	 *   because we put a barrier between setting rq->deadline
-	 *   and clearing the flag in blk_mq_start_request(), so
-	 *   this rq won't be timed out too.
-	 */
-	if (time_after_eq(jiffies, rq->deadline)) {
-		if (!blk_mark_rq_complete(rq))
-			blk_mq_rq_timed_out(rq, reserved);
-	} else if (!data->next_set || time_after(data->next, rq->deadline)) {
-		data->next = rq->deadline;
-		data->next_set = 1;
+	if ((long)(now - slot) >= BLK_MQ_TIMEOUT_BUCKETS)
+		slot = now - (BLK_MQ_TIMEOUT_BUCKETS - 1);
+	for (; (long)(now - slot) >= 0; slot++)
+		blk_mq_check_expired_bucket(hctx, slot, data);
+	hctx->timeout_slot = now;
+
+	for (i = 1; i < BLK_MQ_TIMEOUT_BUCKETS; i++) {
+		if (bitmap_empty(blk_mq_timeout_bucket(hctx, now + i),
+				 hctx->timeout_map_bits))
+			continue;
+
+		next = (now + i) << BLK_MQ_TIMEOUT_SHIFT;
+		if (!data->next_set || time_after(data->next, next)) {
+			data->next = next;
+			data->next_set = 1;
+		}
+		break;
 	}
 }
+
 //blk_mq_init_allocated_queueʼ
 static void blk_mq_timeout_work(struct work_struct *work)
 {
@@ -871,6 +1073,7 @@ static void blk_mq_timeout_work(struct work_struct *work)
 		.next		= 0,
 		.next_set	= 0,
 	};
+	struct blk_mq_hw_ctx *hctx;
 	int i;
 
 	/* A deadlock might occur if a request is stuck requiring a
@@ -889,14 +1092,15 @@ static void blk_mq_timeout_work(struct work_struct *work)
 	if (!percpu_ref_tryget(&q->q_usage_counter))
 		return;
 
-	blk_mq_queue_tag_busy_iter(q, blk_mq_check_expired, &data);
+	queue_for_each_hw_ctx(q, hctx, i) {
+		/* the hctx may be unmapped, so check it here */
+		if (blk_mq_hw_queue_mapped(hctx))
+			blk_mq_check_expired(hctx, &data);
+	}
 
 	if (data.next_set) {
-		data.next = blk_rq_timeout(round_jiffies_up(data.next));
-		mod_timer(&q->timeout, data.next);
+		mod_timer(&q->timeout, round_jiffies_up(data.next));
 	} else {
-		struct blk_mq_hw_ctx *hctx;
-
 		queue_for_each_hw_ctx(q, hctx, i) {
 			/* the hctx may be unmapped, so check it here */
 			if (blk_mq_hw_queue_mapped(hctx))
@@ -906,52 +1110,90 @@ static void blk_mq_timeout_work(struct work_struct *work)
 	blk_queue_exit(q);
 }
 
+#define ctx_back_key(rq)	(blk_rq_pos(rq) + blk_rq_sectors(rq))
+#define ctx_front_key(rq)	blk_rq_pos(rq)
+
+/* Inverse of rq_aux() */
+static inline struct request *ctx_front_to_rq(struct request_queue *q,
+					      struct request_aux *aux)
+{
+	return (void *) aux - q->tag_set->cmd_size - sizeof(struct request);
+}
+
 /*
- * Reverse check our software queue for entries that we could potentially
- * merge with. Currently includes a hand-wavy stop count of 8, to not spend
- * too much time checking for merges.
+ * Requests on ctx->rq_list are hashed by both ends, so that
+ * blk_mq_attempt_merge() finds its candidate in O(1) however many
+ * streams are interleaved on this cpu. Called with ctx->lock held.
+ */
+static void blk_mq_ctx_hash_rq(struct blk_mq_ctx *ctx, struct request *rq)
+{
+	hash_add(ctx->back_hash, &rq->hash, ctx_back_key(rq));
+	hash_add(ctx->front_hash, &rq_aux(rq)->ctx_front_hash,
+		 ctx_front_key(rq));
+}
+
+static void blk_mq_ctx_unhash_rq(struct request *rq)
+{
+	hash_del(&rq->hash);
+	hash_del(&rq_aux(rq)->ctx_front_hash);
+}
+
+/* Every request leaving ctx->rq_list must go through here */
+static void blk_mq_ctx_unhash_list(struct list_head *list)
+{
+	struct request *rq;
+
+	list_for_each_entry(rq, list, queuelist)
+		blk_mq_ctx_unhash_rq(rq);
+}
+
+/*
+ * Look up our software queue for a request that ends where @bio starts,
+ * or starts where @bio ends.
  */
-//Ųѽαctx->rq_listϵreqȻreqܷbioǰߺϲ
 static bool blk_mq_attempt_merge(struct request_queue *q,
 				 struct blk_mq_ctx *ctx, struct bio *bio)
 {
+	sector_t end = bio_end_sector(bio);
+	struct request_aux *aux;
 	struct request *rq;
-	int checked = 8;
-    //αctx->rq_listϵreq
-	list_for_each_entry_reverse(rq, &ctx->rq_list, queuelist) {
-		int el_ret;
 
-		if (!checked--)
+	hash_for_each_possible(ctx->back_hash, rq, hash, bio->bi_sector) {
+		if (ctx_back_key(rq) != bio->bi_sector ||
+		    !blk_rq_merge_ok(rq, bio))
+			continue;
+
+		if (!blk_mq_sched_allow_merge(q, rq, bio))
 			break;
 
-		if (!blk_rq_merge_ok(rq, bio))
-			continue;
-        
-        //bioreqĴ̷ΧǷţԺϲ
-		el_ret = blk_try_merge(rq, bio);
-		if (el_ret == ELEVATOR_NO_MERGE)
+		if (bio_attempt_back_merge(q, rq, bio)) {
+			hash_del(&rq->hash);
+			hash_add(ctx->back_hash, &rq->hash, ctx_back_key(rq));
+			ctx->rq_merged++;
+			return true;
+		}
+		break;
+	}
+
+	hash_for_each_possible(ctx->front_hash, aux, ctx_front_hash, end) {
+		rq = ctx_front_to_rq(q, aux);
+		if (ctx_front_key(rq) != end || !blk_rq_merge_ok(rq, bio))
 			continue;
 
 		if (!blk_mq_sched_allow_merge(q, rq, bio))
 			break;
 
-        //ǰϲ
-		if (el_ret == ELEVATOR_BACK_MERGE) {
-			if (bio_attempt_back_merge(q, rq, bio)) {
-				ctx->rq_merged++;
-				return true;
-			}
-			break;
-        //ǰϲ
-		} else if (el_ret == ELEVATOR_FRONT_MERGE) {
-			if (bio_attempt_front_merge(q, rq, bio)) {
-				ctx->rq_merged++;
-				return true;
-			}
-			break;
+		if (bio_attempt_front_merge(q, rq, bio)) {
+			hash_del(&aux->ctx_front_hash);
+			hash_add(ctx->front_hash, &aux->ctx_front_hash,
+				 ctx_front_key(rq));
+			ctx->rq_merged++;
+			return true;
 		}
+		break;
 	}
 
+	ctx->rq_merge_miss++;
 	return false;
 }
 
@@ -968,6 +1210,7 @@ static bool flush_busy_ctx(struct sbitmap *sb, unsigned int bitnr, void *data)
 
 	spin_lock(&ctx->lock);
     //hctx->ctxs[[bitnr]]ϵctx->rq_listreqתƵflush_data->listβȻctx->rq_list
+	blk_mq_ctx_unhash_list(&ctx->rq_list);
 	list_splice_tail_init(&ctx->rq_list, flush_data->list);
 	sbitmap_clear_bit(sb, bitnr);
 	spin_unlock(&ctx->lock);
@@ -1009,6 +1252,7 @@ static bool dispatch_rq_from_ctx(struct sbitmap *sb, unsigned int bitnr,
 		dispatch_data->rq = list_entry_rq(ctx->rq_list.next);
         //޳req
 		list_del_init(&dispatch_data->rq->queuelist);
+		blk_mq_ctx_unhash_rq(dispatch_data->rq);
         //hctx->ctx_mapжӦı־λ
 		if (list_empty(&ctx->rq_list))
 			sbitmap_clear_bit(sb, bitnr);
@@ -1643,6 +1887,7 @@ static inline void __blk_mq_insert_req_list(struct blk_mq_hw_ctx *hctx,
 		list_add(&rq->queuelist, &ctx->rq_list);
 	else
 		list_add_tail(&rq->queuelist, &ctx->rq_list);
+	blk_mq_ctx_hash_rq(ctx, rq);
 }
 //req뵽ctx->rq_list,ӦӲhctx->ctx_mapbitλ1ʾ
 void __blk_mq_insert_request(struct blk_mq_hw_ctx *hctx, struct request *rq,
@@ -1692,6 +1937,8 @@ void blk_mq_insert_requests(struct blk_mq_hw_ctx *hctx, struct blk_mq_ctx *ctx,
 
 	spin_lock(&ctx->lock);
     //listĳԱ뵽ctx->rq_listߣȻlist0listԴԵǰ̵plug
+	list_for_each_entry(rq, list, queuelist)
+		blk_mq_ctx_hash_rq(ctx, rq);
 	list_splice_tail_init(list, &ctx->rq_list);
     //reqˣӦӲhctx->ctx_mapbitλ1ʾ
 	blk_mq_hctx_mark_pending(hctx, ctx);
@@ -2007,6 +2254,96 @@ void blk_mq_try_issue_list_directly(struct blk_mq_hw_ctx *hctx,
 		}
 	}
 }
+/*
+ * Take a request off the plug's cache for @bio. Only requests of this
+ * queue and software queue will do, the rest stays for later or is freed
+ * with the plug.
+ */
+static struct request *blk_mq_plug_cached_rq(struct blk_plug *plug,
+					     struct request_queue *q,
+					     struct blk_mq_ctx *ctx,
+					     struct bio *bio)
+{
+	struct request *rq;
+
+	list_for_each_entry(rq, &plug->cached_rqs, queuelist) {
+		if (rq->q != q || rq->mq_ctx != ctx)
+			continue;
+
+		list_del_init(&rq->queuelist);
+
+		/* redo the init done at fill time, with this bio's flags */
+		ctx->rq_dispatched[rw_is_sync(rq->cmd_flags)]--;
+		rq->cmd_flags &= REQ_MQ_INFLIGHT;
+		blk_mq_rq_ctx_init(q, ctx, rq, bio->bi_rw);
+		return rq;
+	}
+
+	return NULL;
+}
+
+/*
+ * First allocation under a plug that expects more I/O: grab requests for
+ * the rest of the batch right away, as long as there are free tags.
+ */
+static void blk_mq_fill_plug_cache(struct blk_plug *plug,
+				   struct request_queue *q, struct bio *bio,
+				   struct blk_mq_alloc_data *data)
+{
+	struct blk_mq_alloc_data alloc_data = {
+		.flags	= BLK_MQ_REQ_NOWAIT,
+		.ctx	= data->ctx,
+		.hctx	= data->hctx,
+	};
+	unsigned short nr = plug->nr_ios - 1;
+	struct request *rq;
+
+	plug->nr_ios = 1;
+	while (nr--) {
+		rq = blk_mq_sched_get_request(q, bio, bio->bi_rw, &alloc_data);
+		if (!rq)
+			break;
+		list_add_tail(&rq->queuelist, &plug->cached_rqs);
+	}
+}
+
+/* Called when the plug is finished, or its task goes to sleep */
+void blk_mq_free_plug_rqs(struct blk_plug *plug)
+{
+	struct request *rq;
+
+	while (!list_empty(&plug->cached_rqs)) {
+		rq = list_first_entry(&plug->cached_rqs, struct request,
+				      queuelist);
+		list_del_init(&rq->queuelist);
+		blk_mq_free_request(rq);
+	}
+}
+
+static struct request *blk_mq_get_plug_request(struct request_queue *q,
+					       struct bio *bio,
+					       struct blk_mq_alloc_data *data)
+{
+	struct blk_plug *plug = current->plug;
+	struct request *rq;
+
+	/* elevators hand out requests by their own rules */
+	if (!plug || q->elevator || (bio->bi_rw & (REQ_FLUSH | REQ_FUA)))
+		return blk_mq_sched_get_request(q, bio, bio->bi_rw, data);
+
+	data->ctx = blk_mq_get_ctx(q);
+	data->hctx = blk_mq_map_queue(q, data->ctx->cpu);
+
+	rq = blk_mq_plug_cached_rq(plug, q, data->ctx, bio);
+	if (rq)
+		return rq;
+
+	rq = blk_mq_sched_get_request(q, bio, bio->bi_rw, data);
+	if (rq && plug->nr_ios > 1)
+		blk_mq_fill_plug_cache(plug, q, bio, data);
+	return rq;
+}
+
 /*
 submit_bio->generic_make_request->blk_mq_make_request->blk_mq_bio_to_request->blk_account_io_start->part_round_stats->part_round_stats_single
 handle_irq_event_percpu->nvme_irq->nvme_process_cq->blk_mq_end_request->blk_account_io_done->part_round_stats->part_round_stats_single*/
@@ -2019,6 +2356,8 @@ static void blk_mq_make_request(struct request_queue *q, struct bio *bio)
 	unsigned int request_count = 0;
 	struct blk_plug *plug;
 	struct request *same_queue_rq = NULL;
+	enum wbt_flags wb_acct;
+	struct blkcg_gq *iolat_blkg;
 
 	blk_queue_bounce(q, &bio);
 
@@ -2043,13 +2382,24 @@ static void blk_mq_make_request(struct request_queue *q, struct bio *bio)
 	if (blk_mq_merge_bio(q, bio))
 		return;
 
+	wb_acct = wbt_wait(q->rq_wb, bio, NULL);
+	iolat_blkg = blk_iolatency_throttle(q, bio);
+
 	trace_block_getrq(q, bio, bio->bi_rw);
     
     /*Ӳصblk_mq_tagsṹstatic_rqs[]õеrequestȡʧӲIOɷ
       ֮ٳԴblk_mq_tagsṹstatic_rqs[]õеrequest*/
-	rq = blk_mq_sched_get_request(q, bio, bio->bi_rw, &data);//еûеȡreq
-	if (unlikely(!rq))
+	rq = blk_mq_get_plug_request(q, bio, &data);//еûеȡreq
+	if (unlikely(!rq)) {
+		__wbt_done(q->rq_wb, wb_acct);
+		blk_iolatency_cancel(q, iolat_blkg);
 		return;
+	}
+
+	wbt_track(rq, wb_acct);
+	blk_iolatency_track(rq, iolat_blkg);
+
+	bio->bi_cookie = request_to_qc_t(data.hctx, rq);
     
     //ǰ̵blk_plug
 	plug = current->plug;
@@ -2200,9 +2550,14 @@ struct blk_mq_tags *blk_mq_alloc_rq_map(struct blk_mq_tag_set *set,
 					unsigned int reserved_tags)
 {
 	struct blk_mq_tags *tags;
+	int node;
+
+	node = blk_mq_hw_queue_to_node(set->mq_map, hctx_idx);
+	if (node == NUMA_NO_NODE)
+		node = set->numa_node;
     //һÿӲнṹеblk_mq_tagsṹԱnr_reserved_tagsnr_tagsblk_mq_tagsbitmap_tagsbreserved_tagsṹ
 	tags = blk_mq_init_tags(nr_tags, reserved_tags,
-				set->numa_node,
+				node,
 				BLK_MQ_FLAG_TO_ALLOC_POLICY(set->flags));
 	if (!tags)
 		return NULL;
@@ -2210,7 +2565,7 @@ struct blk_mq_tags *blk_mq_alloc_rq_map(struct blk_mq_tag_set *set,
     //nr_tagsӦþnvmeֵ֧ӲɣǵģӦreq
 	tags->rqs = kzalloc_node(nr_tags * sizeof(struct request *),
 				 GFP_NOIO | __GFP_NOWARN | __GFP_NORETRY,
-				 set->numa_node);
+				 node);
 	if (!tags->rqs) {
 		blk_mq_free_tags(tags);
 		return NULL;
@@ -2218,7 +2573,7 @@ struct blk_mq_tags *blk_mq_alloc_rq_map(struct blk_mq_tag_set *set,
     //nr_tagsstruct request *ָ븳static_rqs
 	tags->static_rqs = kzalloc_node(nr_tags * sizeof(struct request *),
 				 GFP_NOIO | __GFP_NOWARN | __GFP_NORETRY,
-				 set->numa_node);
+				 node);
 	if (!tags->static_rqs) {
 		kfree(tags->rqs);
 		blk_mq_free_tags(tags);
@@ -2239,6 +2594,12 @@ int blk_mq_alloc_rqs(struct blk_mq_tag_set *set, struct blk_mq_tags *tags,//tags
 {
 	unsigned int i, j, entries_per_page, max_order = 4;
 	size_t rq_size, left;
+	int node;
+
+	/* requests and driver pdus live where the hw queue's cpus are */
+	node = blk_mq_hw_queue_to_node(set->mq_map, hctx_idx);
+	if (node == NUMA_NO_NODE)
+		node = set->numa_node;
 
 	INIT_LIST_HEAD(&tags->page_list);
 
@@ -2263,7 +2624,7 @@ int blk_mq_alloc_rqs(struct blk_mq_tag_set *set, struct blk_mq_tags *tags,//tags
 			this_order--;
         //this_order=4page2^4page
 		do {
-			page = alloc_pages_node(set->numa_node,
+			page = alloc_pages_node(node,
 				GFP_NOIO | __GFP_NOWARN | __GFP_NORETRY | __GFP_ZERO,
 				this_order);
             //ɹֱ
@@ -2303,7 +2664,7 @@ int blk_mq_alloc_rqs(struct blk_mq_tag_set *set, struct blk_mq_tags *tags,//tags
 			tags->static_rqs[i] = rq;
 			if (set->ops->init_request) {//nvme_init_request
 				if (set->ops->init_request(set, rq, hctx_idx,
-						set->numa_node)) {
+						node)) {
 					tags->static_rqs[i] = NULL;
 					goto fail;
 				}
@@ -2335,6 +2696,7 @@ static int blk_mq_hctx_cpu_offline(struct blk_mq_hw_ctx *hctx, int cpu)
 
 	spin_lock(&ctx->lock);
 	if (!list_empty(&ctx->rq_list)) {
+		blk_mq_ctx_unhash_list(&ctx->rq_list);
 		list_splice_init(&ctx->rq_list, &tmp);
 		blk_mq_hctx_clear_pending(hctx, ctx);
 	}
@@ -2391,6 +2753,8 @@ static void blk_mq_exit_hctx(struct request_queue *q,
 	blk_mq_unregister_cpu_notifier(&hctx->cpu_notifier);
 	blk_free_flush_queue(hctx->fq);
 	sbitmap_free(&hctx->ctx_map);
+	kfree(hctx->timeout_map);
+	blk_stat_hist_exit_hctx(hctx);
 }
 
 static void blk_mq_exit_hw_queues(struct request_queue *q,
@@ -2462,6 +2826,17 @@ static int blk_mq_init_hctx(struct request_queue *q,
 
 	hctx->nr_ctx = 0;
 
+	hctx->timeout_map_bits = set->queue_depth;
+	hctx->timeout_map = kzalloc_node(BLK_MQ_TIMEOUT_BUCKETS *
+			BITS_TO_LONGS(set->queue_depth) * sizeof(unsigned long),
+			GFP_KERNEL, node);
+	if (!hctx->timeout_map)
+		goto free_bitmap;
+	hctx->timeout_slot = jiffies >> BLK_MQ_TIMEOUT_SHIFT;
+
+	if (blk_stat_hist_init_hctx(q, hctx))
+		goto free_bitmap;
+
 	init_waitqueue_func_entry(&hctx->dispatch_wait, blk_mq_dispatch_wake);
 	INIT_LIST_HEAD(&hctx->dispatch_wait.task_list);
 
@@ -2499,6 +2874,8 @@ static int blk_mq_init_hctx(struct request_queue *q,
 	if (set->ops->exit_hctx)
 		set->ops->exit_hctx(hctx, hctx_idx);
  free_bitmap:
+	blk_stat_hist_exit_hctx(hctx);
+	kfree(hctx->timeout_map);
 	sbitmap_free(&hctx->ctx_map);
  free_ctxs:
 	kfree(hctx->ctxs);
@@ -2524,6 +2901,8 @@ static void blk_mq_init_cpu_queues(struct request_queue *q,
 		__ctx->cpu = i;
 		spin_lock_init(&__ctx->lock);
 		INIT_LIST_HEAD(&__ctx->rq_list);
+		hash_init(__ctx->back_hash);
+		hash_init(__ctx->front_hash);
         //нṹblk_mq_ctxֵж
 		__ctx->queue = q;
 
@@ -2875,6 +3254,7 @@ struct request_queue *blk_mq_init_allocated_queue(struct blk_mq_tag_set *set,
 					     blk_stat_rq_ddir, 2, q);
 	if (!q->poll_cb)
 		goto err_exit;
+	q->poll_nsec = -1;
     //ΪÿCPUһstruct blk_mq_ctx
 	q->queue_ctx = alloc_percpu(struct blk_mq_ctx);
 	if (!q->queue_ctx)
@@ -3396,6 +3776,187 @@ static void blk_mq_poll_stats_fn(struct blk_stat_callback *cb)
 		q->poll_stat[WRITE] = cb->stat[WRITE];
 }
 
+/*
+ * Enable polling stats and return whether they were already enabled.
+ */
+static bool blk_poll_stats_enable(struct request_queue *q)
+{
+	if (test_bit(QUEUE_FLAG_POLL_STATS, &q->queue_flags) ||
+	    test_and_set_bit(QUEUE_FLAG_POLL_STATS, &q->queue_flags))
+		return true;
+	blk_stat_add_callback(q, q->poll_cb);
+	return false;
+}
+
+static unsigned long blk_mq_poll_nsecs(struct request_queue *q,
+				       struct blk_mq_hw_ctx *hctx,
+				       struct request *rq)
+{
+	unsigned long ret = 0;
+	int bucket;
+
+	/*
+	 * If stats collection isn't on, don't sleep but turn it on for
+	 * future users
+	 */
+	if (!blk_poll_stats_enable(q))
+		return 0;
+
+	/*
+	 * As an optimistic guess, use half of the mean service time
+	 * for this type of request. We can (and should) make this smarter.
+	 * For instance, if the completion latencies are tight, we can
+	 * get closer than just half the mean. This is especially
+	 * important on devices where the completion latencies are longer
+	 * than ~10 usec.
+	 */
+	bucket = blk_stat_rq_ddir(rq);
+	if (q->poll_stat[bucket].nr_samples)
+		ret = (q->poll_stat[bucket].mean + 1) / 2;
+
+	return ret;
+}
+
+static bool blk_mq_poll_hybrid_sleep(struct request_queue *q,
+				     struct blk_mq_hw_ctx *hctx,
+				     struct request *rq)
+{
+	struct hrtimer_sleeper hs;
+	enum hrtimer_mode mode;
+	unsigned int nsecs;
+	ktime_t kt;
+
+	if (test_bit(REQ_ATOM_POLL_SLEPT, &rq->atomic_flags))
+		return false;
+
+	/*
+	 * poll_nsec can be:
+	 *
+	 * -1:	don't ever hybrid sleep
+	 *  0:	use half of prev avg
+	 * >0:	use this specific value
+	 */
+	if (q->poll_nsec == -1)
+		return false;
+	else if (q->poll_nsec > 0)
+		nsecs = q->poll_nsec;
+	else
+		nsecs = blk_mq_poll_nsecs(q, hctx, rq);
+
+	if (!nsecs)
+		return false;
+
+	set_bit(REQ_ATOM_POLL_SLEPT, &rq->atomic_flags);
+
+	kt = ktime_set(0, nsecs);
+
+	mode = HRTIMER_MODE_REL;
+	hrtimer_init_on_stack(&hs.timer, CLOCK_MONOTONIC, mode);
+	hrtimer_set_expires(&hs.timer, kt);
+
+	hrtimer_init_sleeper(&hs, current);
+	do {
+		if (test_bit(REQ_ATOM_COMPLETE, &rq->atomic_flags))
+			break;
+		set_current_state(TASK_UNINTERRUPTIBLE);
+		hrtimer_start_expires(&hs.timer, mode);
+		if (hs.task)
+			io_schedule();
+		hrtimer_cancel(&hs.timer);
+		mode = HRTIMER_MODE_ABS;
+	} while (hs.task && !signal_pending(current));
+
+	__set_current_state(TASK_RUNNING);
+	destroy_hrtimer_on_stack(&hs.timer);
+	return true;
+}
+
+static bool __blk_mq_poll(struct blk_mq_hw_ctx *hctx, struct request *rq)
+{
+	struct request_queue *q = hctx->queue;
+	long state;
+
+	/*
+	 * If we sleep, have the caller restart the poll loop to reset
+	 * the state. Like for the other success return cases, the
+	 * caller is responsible for checking if the IO completed. If
+	 * the IO isn't complete, we'll get called again and will go
+	 * straight to the busy poll loop.
+	 */
+	if (blk_mq_poll_hybrid_sleep(q, hctx, rq))
+		return true;
+
+	hctx->poll_considered++;
+
+	state = current->state;
+	while (!need_resched()) {
+		int ret;
+
+		hctx->poll_invoked++;
+
+		ret = q->mq_ops->aux_ops->poll(hctx, rq->tag);
+		if (ret > 0) {
+			hctx->poll_success++;
+			set_current_state(TASK_RUNNING);
+			return true;
+		}
+
+		if (signal_pending_state(state, current))
+			set_current_state(TASK_RUNNING);
+
+		if (current->state == TASK_RUNNING)
+			return true;
+		if (ret < 0)
+			break;
+		cpu_relax();
+	}
+
+	return false;
+}
+
+/**
+ * blk_poll - poll for completion of a blk-mq request
+ * @q:		the queue the request was submitted to
+ * @cookie:	bio->bi_cookie of the submitted bio
+ *
+ * Description:
+ *    Called by a synchronous submitter in place of io_schedule(). Returns
+ *    true if the caller should re-check its completion condition, false
+ *    if polling is not possible and the caller should sleep as usual.
+ */
+bool blk_poll(struct request_queue *q, blk_qc_t cookie)
+{
+	struct blk_mq_hw_ctx *hctx;
+	struct blk_plug *plug;
+	struct request *rq;
+
+	if (!q->mq_ops || !q->mq_ops->aux_ops || !q->mq_ops->aux_ops->poll ||
+	    !blk_qc_t_valid(cookie) || !blk_queue_poll(q))
+		return false;
+
+	plug = current->plug;
+	if (plug)
+		blk_flush_plug_list(plug, false);
+
+	hctx = q->queue_hw_ctx[blk_qc_t_to_queue_num(cookie)];
+	if (!blk_qc_t_is_internal(cookie))
+		rq = blk_mq_tag_to_rq(hctx->tags, blk_qc_t_to_tag(cookie));
+	else {
+		rq = blk_mq_tag_to_rq(hctx->sched_tags, blk_qc_t_to_tag(cookie));
+		/*
+		 * With scheduling, if the request has completed, we'll
+		 * get a NULL return here, as we clear the sched tag when
+		 * that happens. The request still remains valid, like always,
+		 * so we should be safe with just the NULL check.
+		 */
+		if (!rq)
+			return false;
+	}
+
+	return __blk_mq_poll(hctx, rq);
+}
+EXPORT_SYMBOL_GPL(blk_poll);
+
 void blk_mq_disable_hotplug(void)
 {
 	mutex_lock(&all_q_mutex);
@@ -2,12 +2,16 @@
 #define INT_BLK_MQ_H
 
 #include <linux/rh_kabi.h>
+#include <linux/hashtable.h>
 
 #include "blk-stat.h"
 #include "blk-mq-tag.h"
 
 struct blk_mq_tag_set;
 
+/* buckets per ctx merge hash, see blk_mq_attempt_merge() */
+#define BLK_MQ_CTX_HASH_BITS	4
+
 //УÿCPUһ
 struct blk_mq_ctx {
 	//struct {----ӰĶע͵
@@ -19,6 +23,14 @@ struct blk_mq_ctx {
         struct list_head	rq_list;//дreq
 	//}  ____cacheline_aligned_in_smp;
 
+	/*
+	 * rq_list requests hashed by end sector (rq->hash) for back merges
+	 * and by start sector (rq_aux(rq)->ctx_front_hash) for front merges,
+	 * protected by ->lock.
+	 */
+	DECLARE_HASHTABLE(back_hash, BLK_MQ_CTX_HASH_BITS);
+	DECLARE_HASHTABLE(front_hash, BLK_MQ_CTX_HASH_BITS);
+
     //жӦCPUţCPUȥѰӲнṹ壬blk_mq_make_request->blk_mq_sched_bio_merge->__blk_mq_sched_bio_merge->blk_mq_map_queue
     //blk_mq_init_cpu_queuesҲиֵ
     unsigned int		cpu;
@@ -33,9 +45,11 @@ struct blk_mq_ctx {
 	/* incremented at dispatch time */
 	unsigned long		rq_dispatched[2];
 	unsigned long		rq_merged;
+	unsigned long		rq_merge_miss;
 
 	/* incremented at completion time */
 	unsigned long		____cacheline_aligned_in_smp rq_completed[2];
+	unsigned long		rq_completed_remote;	/* off the ctx's node */
 
 	struct request_queue	*queue;//ӲΨһĶУblk_mq_init_cpu_queuesиֵ
 	struct kobject		kobj;
@@ -45,6 +59,7 @@ void blk_mq_freeze_queue(struct request_queue *q);
 void blk_mq_free_queue(struct request_queue *q);
 int blk_mq_update_nr_requests(struct request_queue *q, unsigned int nr);
 void blk_mq_wake_waiters(struct request_queue *q);
+void blk_mq_free_plug_rqs(struct blk_plug *plug);
 bool blk_mq_dispatch_rq_list(struct request_queue *, struct list_head *, bool);
 void blk_mq_flush_busy_ctxs(struct blk_mq_hw_ctx *hctx, struct list_head *list);
 bool blk_mq_get_driver_tag(struct request *rq, struct blk_mq_hw_ctx **hctx,
@@ -96,6 +111,18 @@ void blk_mq_try_issue_list_directly(struct blk_mq_hw_ctx *hctx,
  */
 int blk_mq_map_queues(struct blk_mq_tag_set *set);
 extern int blk_mq_hw_queue_to_node(unsigned int *map, unsigned int);
+
+/*
+ * Request timeouts are kept in per-hctx buckets of 1 << BLK_MQ_TIMEOUT_SHIFT
+ * jiffies, so expiry checks only visit the buckets due.  ilog2() rounds
+ * down, so a slot is between half a second and a second long depending on
+ * HZ (512 jiffies, about 0.5s, at HZ=1000).
+ */
+#define BLK_MQ_TIMEOUT_SHIFT	ilog2(HZ)
+#define BLK_MQ_TIMEOUT_BUCKETS	32
+
+void blk_mq_add_timer(struct request *rq);
+
 //CPUȴq->mq_map[cpu]ҵӲбţq->queue_hw_ctx[Ӳб]ӲΨһblk_mq_hw_ctxṹ
 //ӲֻһǷ0Ӳеblk_mq_hw_ctxÿCPUΨһӦӲУڳʼʱѾȷˣ
 //blk_mq_update_queue_map()ôCPUӲе
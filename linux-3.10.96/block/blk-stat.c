@@ -15,6 +15,8 @@
 struct blk_queue_stats {
 	struct list_head callbacks;
 	spinlock_t lock;
+	bool enable_accounting;
+	bool hist;
 };
 
 int blk_stat_rq_ddir(const struct request *rq)
@@ -82,20 +84,86 @@ static void __blk_stat_add(struct blk_rq_stat *stat, u64 value)
 	stat->nr_batch++;
 }
 
-void blk_stat_add(struct request *rq)
+const char *const blk_stat_hist_op_name[BLK_STAT_HIST_OPS] = {
+	[BLK_STAT_HIST_READ]	= "read",
+	[BLK_STAT_HIST_WRITE]	= "write",
+	[BLK_STAT_HIST_DISCARD]	= "discard",
+	[BLK_STAT_HIST_FLUSH]	= "flush",
+};
+
+const char *const blk_stat_hist_size_name[BLK_STAT_HIST_SIZES] = {
+	"4k", "32k", "128k", "large",
+};
+
+static unsigned int blk_stat_hist_bucket(u64 nsec)
+{
+	u64 v = nsec >> BLK_STAT_HIST_SHIFT;
+	unsigned int msb, bucket;
+
+	if (v < BLK_STAT_HIST_SUBS)
+		return v;
+
+	msb = fls64(v) - 1;
+	bucket = ((msb - BLK_STAT_HIST_SUB_BITS + 1) << BLK_STAT_HIST_SUB_BITS) +
+		 ((v >> (msb - BLK_STAT_HIST_SUB_BITS)) &
+		  (BLK_STAT_HIST_SUBS - 1));
+
+	return min_t(unsigned int, bucket, BLK_STAT_HIST_BUCKETS - 1);
+}
+
+static void blk_stat_hist_add(struct request *rq, u64 value)
+{
+	struct blk_mq_hw_ctx *hctx;
+	unsigned int bytes = blk_rq_bytes(rq);
+	int op, size;
+
+	hctx = blk_mq_map_queue(rq->q, rq->mq_ctx->cpu);
+	if (!hctx->lat_hist)
+		return;
+
+	if (rq->cmd_flags & REQ_DISCARD)
+		op = BLK_STAT_HIST_DISCARD;
+	else if ((rq->cmd_flags & REQ_FLUSH) && !bytes)
+		op = BLK_STAT_HIST_FLUSH;
+	else if (rq_data_dir(rq) == WRITE)
+		op = BLK_STAT_HIST_WRITE;
+	else
+		op = BLK_STAT_HIST_READ;
+
+	if (bytes <= 4096)
+		size = 0;
+	else if (bytes <= 32768)
+		size = 1;
+	else if (bytes <= 131072)
+		size = 2;
+	else
+		size = 3;
+
+	this_cpu_inc(hctx->lat_hist->buckets[op][size]
+					    [blk_stat_hist_bucket(value)]);
+}
+
+/*
+ * @now is ktime_get() in nsecs, taken once by the caller so a batch of
+ * completions doesn't read the clock for every request.
+ */
+void blk_stat_add(struct request *rq, u64 now)
 {
 	struct request_queue *q = rq->q;
 	struct blk_stat_callback *cb;
 	struct blk_rq_stat *stat;
 	int bucket;
-	s64 now, value;
+	s64 value;
 
-	now = __blk_stat_time(ktime_to_ns(ktime_get()));
+	now = __blk_stat_time(now);
 	if (now < blk_stat_time(&rq_aux(rq)->issue_stat))
 		return;
 
 	value = now - blk_stat_time(&rq_aux(rq)->issue_stat);
 
+	if (q->mq_ops)
+		blk_stat_hist_add(rq, value);
+
 	rcu_read_lock();
 	list_for_each_entry_rcu(cb, &q->stats->callbacks, list) {
 		if (blk_stat_is_active(cb)) {
@@ -192,7 +260,7 @@ void blk_stat_remove_callback(struct request_queue *q,
 {
 	spin_lock(&q->stats->lock);
 	list_del_rcu(&cb->list);
-	if (list_empty(&q->stats->callbacks))
+	if (list_empty(&q->stats->callbacks) && !q->stats->enable_accounting)
 		clear_bit(QUEUE_FLAG_STATS, &q->queue_flags);
 	spin_unlock(&q->stats->lock);
 
@@ -217,6 +285,144 @@ void blk_stat_free_callback(struct blk_stat_callback *cb)
 }
 EXPORT_SYMBOL_GPL(blk_stat_free_callback);
 
+/*
+ * Keep issue time stamping on for consumers that aren't a callback.
+ */
+void blk_stat_enable_accounting(struct request_queue *q)
+{
+	spin_lock(&q->stats->lock);
+	q->stats->enable_accounting = true;
+	set_bit(QUEUE_FLAG_STATS, &q->queue_flags);
+	spin_unlock(&q->stats->lock);
+}
+EXPORT_SYMBOL_GPL(blk_stat_enable_accounting);
+
+void blk_stat_disable_accounting(struct request_queue *q)
+{
+	spin_lock(&q->stats->lock);
+	q->stats->enable_accounting = false;
+	if (list_empty(&q->stats->callbacks))
+		clear_bit(QUEUE_FLAG_STATS, &q->queue_flags);
+	spin_unlock(&q->stats->lock);
+}
+EXPORT_SYMBOL_GPL(blk_stat_disable_accounting);
+
+int blk_stat_hist_init_hctx(struct request_queue *q,
+			    struct blk_mq_hw_ctx *hctx)
+{
+	if (!q->stats || !q->stats->hist || hctx->lat_hist)
+		return 0;
+
+	hctx->lat_hist = alloc_percpu(struct blk_rq_hist);
+	return hctx->lat_hist ? 0 : -ENOMEM;
+}
+
+void blk_stat_hist_exit_hctx(struct blk_mq_hw_ctx *hctx)
+{
+	free_percpu(hctx->lat_hist);
+	hctx->lat_hist = NULL;
+}
+
+bool blk_stat_hist_enabled(struct request_queue *q)
+{
+	return q->stats->hist;
+}
+
+/*
+ * Called with q->sysfs_lock held.  Completions look at hctx->lat_hist
+ * without any lock, so it only changes while the queue is frozen.
+ */
+int blk_stat_hist_enable(struct request_queue *q, bool enable)
+{
+	struct blk_mq_hw_ctx *hctx;
+	unsigned int i;
+	int ret = 0;
+
+	if (q->stats->hist == enable)
+		return 0;
+
+	blk_mq_freeze_queue(q);
+	q->stats->hist = enable;
+	queue_for_each_hw_ctx(q, hctx, i) {
+		if (enable)
+			ret = blk_stat_hist_init_hctx(q, hctx);
+		else
+			blk_stat_hist_exit_hctx(hctx);
+		if (ret)
+			break;
+	}
+	if (ret) {
+		q->stats->hist = false;
+		queue_for_each_hw_ctx(q, hctx, i)
+			blk_stat_hist_exit_hctx(hctx);
+	}
+	blk_mq_unfreeze_queue(q);
+
+	if (q->stats->hist)
+		blk_stat_enable_accounting(q);
+	else
+		blk_stat_disable_accounting(q);
+
+	return ret;
+}
+
+bool blk_stat_hist_sum(struct blk_mq_hw_ctx *hctx, struct blk_rq_hist *sum)
+{
+	unsigned long *dst = &sum->buckets[0][0][0];
+	unsigned int i;
+	int cpu;
+
+	memset(sum, 0, sizeof(*sum));
+	if (!hctx->lat_hist)
+		return false;
+
+	for_each_possible_cpu(cpu) {
+		struct blk_rq_hist *hist = per_cpu_ptr(hctx->lat_hist, cpu);
+		unsigned long *src = &hist->buckets[0][0][0];
+
+		for (i = 0; i < sizeof(*sum) / sizeof(*dst); i++)
+			dst[i] += src[i];
+	}
+
+	return true;
+}
+
+/*
+ * Racy against concurrent completions, a few samples may survive.
+ */
+void blk_stat_hist_reset(struct blk_mq_hw_ctx *hctx)
+{
+	int cpu;
+
+	if (!hctx->lat_hist)
+		return;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(hctx->lat_hist, cpu), 0,
+		       sizeof(struct blk_rq_hist));
+}
+
+u64 blk_stat_hist_percentile(const unsigned long *buckets, unsigned long nr,
+			     unsigned int permille)
+{
+	unsigned long target, seen = 0;
+	unsigned int i;
+
+	if (!nr)
+		return 0;
+
+	/* rank of the wanted sample, rounded up */
+	target = nr - div_u64((u64) nr * (1000 - permille), 1000);
+
+	for (i = 0; i < BLK_STAT_HIST_BUCKETS - 1; i++) {
+		seen += buckets[i];
+		if (seen >= target)
+			break;
+	}
+
+	return blk_stat_hist_bucket_nsec(i);
+}
+
 struct blk_queue_stats *blk_alloc_queue_stats(void)
 {
 	struct blk_queue_stats *stats;
@@ -227,6 +433,8 @@ struct blk_queue_stats *blk_alloc_queue_stats(void)
 
 	INIT_LIST_HEAD(&stats->callbacks);
 	spin_lock_init(&stats->lock);
+	stats->enable_accounting = false;
+	stats->hist = false;
 
 	return stats;
 }
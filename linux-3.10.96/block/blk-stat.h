@@ -69,10 +69,93 @@ struct blk_stat_callback {
 	struct rcu_head rcu;
 };
 
+/*
+ * Per hardware queue completion latency histograms, kept per cpu and split
+ * by operation and request size.  Buckets are log-linear over units of
+ * 1 << BLK_STAT_HIST_SHIFT nsecs (~1us): the first BLK_STAT_HIST_SUBS
+ * buckets are one unit wide, after that each power of two is divided into
+ * BLK_STAT_HIST_SUBS equal buckets, which bounds the error of a percentile
+ * read from the histogram to 25%.  The last bucket also takes everything
+ * above its lower bound (~117ms).
+ */
+#define BLK_STAT_HIST_SHIFT	10
+#define BLK_STAT_HIST_SUB_BITS	2
+#define BLK_STAT_HIST_SUBS	(1 << BLK_STAT_HIST_SUB_BITS)
+#define BLK_STAT_HIST_BUCKETS	64
+
+enum {
+	BLK_STAT_HIST_READ,
+	BLK_STAT_HIST_WRITE,
+	BLK_STAT_HIST_DISCARD,
+	BLK_STAT_HIST_FLUSH,
+	BLK_STAT_HIST_OPS,
+};
+
+/* size classes: <= 4k, <= 32k, <= 128k, larger */
+#define BLK_STAT_HIST_SIZES	4
+
+extern const char *const blk_stat_hist_op_name[BLK_STAT_HIST_OPS];
+extern const char *const blk_stat_hist_size_name[BLK_STAT_HIST_SIZES];
+
+struct blk_mq_hw_ctx;
+
+struct blk_rq_hist {
+	unsigned long buckets[BLK_STAT_HIST_OPS][BLK_STAT_HIST_SIZES]
+			     [BLK_STAT_HIST_BUCKETS];
+};
+
 struct blk_queue_stats *blk_alloc_queue_stats(void);
 void blk_free_queue_stats(struct blk_queue_stats *);
 
-void blk_stat_add(struct request *);
+void blk_stat_add(struct request *, u64);
+
+void blk_stat_enable_accounting(struct request_queue *q);
+void blk_stat_disable_accounting(struct request_queue *q);
+
+/**
+ * blk_stat_hist_enable() - Start or stop collecting latency histograms on
+ * every hardware queue of a request queue.
+ * @q: The request queue, must be blk-mq.
+ * @enable: Whether to collect.
+ *
+ * Freezes the queue while the per-cpu histograms are allocated or freed.
+ * Starting discards nothing, stopping discards the collected samples.
+ *
+ * Return: 0 on success or -ENOMEM.
+ */
+int blk_stat_hist_enable(struct request_queue *q, bool enable);
+bool blk_stat_hist_enabled(struct request_queue *q);
+int blk_stat_hist_init_hctx(struct request_queue *q,
+			    struct blk_mq_hw_ctx *hctx);
+void blk_stat_hist_exit_hctx(struct blk_mq_hw_ctx *hctx);
+
+/*
+ * blk_stat_hist_sum() - Fold the per-cpu histograms of @hctx into @sum.
+ * Return: false if @hctx isn't collecting histograms.
+ */
+bool blk_stat_hist_sum(struct blk_mq_hw_ctx *hctx, struct blk_rq_hist *sum);
+void blk_stat_hist_reset(struct blk_mq_hw_ctx *hctx);
+
+/*
+ * blk_stat_hist_percentile() - Latency below which @permille thousandths
+ * of the @nr samples in @buckets fall, as the upper bound of the bucket
+ * holding that sample, in nsecs.
+ */
+u64 blk_stat_hist_percentile(const unsigned long *buckets, unsigned long nr,
+			     unsigned int permille);
+
+/* Upper bound of histogram bucket @bucket, in nsecs. */
+static inline u64 blk_stat_hist_bucket_nsec(unsigned int bucket)
+{
+	unsigned int group = bucket >> BLK_STAT_HIST_SUB_BITS;
+	unsigned int sub = bucket & (BLK_STAT_HIST_SUBS - 1);
+
+	if (bucket < BLK_STAT_HIST_SUBS)
+		return (u64) (bucket + 1) << BLK_STAT_HIST_SHIFT;
+
+	return (u64) (BLK_STAT_HIST_SUBS + sub + 1) <<
+		(group - 1 + BLK_STAT_HIST_SHIFT);
+}
 
 static inline void blk_stat_set_issue_time(struct blk_issue_stat *stat)
 {
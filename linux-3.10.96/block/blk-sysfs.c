@@ -10,6 +10,8 @@
 
 #include "blk.h"
 #include "blk-cgroup.h"
+#include "blk-stat.h"
+#include "blk-wbt.h"
 
 struct queue_sysfs_entry {
 	struct attribute attr;
@@ -310,6 +312,199 @@ queue_rq_affinity_store(struct request_queue *q, const char *page, size_t count)
 	return ret;
 }
 
+static bool queue_can_poll(struct request_queue *q)
+{
+	return q->mq_ops && q->mq_ops->aux_ops && q->mq_ops->aux_ops->poll;
+}
+
+static ssize_t queue_poll_show(struct request_queue *q, char *page)
+{
+	return queue_var_show(blk_queue_poll(q), page);
+}
+
+static ssize_t queue_poll_store(struct request_queue *q, const char *page,
+				size_t count)
+{
+	unsigned long poll_on;
+	ssize_t ret;
+
+	if (!queue_can_poll(q))
+		return -EINVAL;
+
+	ret = queue_var_store(&poll_on, page, count);
+	if (ret < 0)
+		return ret;
+
+	spin_lock_irq(q->queue_lock);
+	if (poll_on)
+		queue_flag_set(QUEUE_FLAG_POLL, q);
+	else
+		queue_flag_clear(QUEUE_FLAG_POLL, q);
+	spin_unlock_irq(q->queue_lock);
+
+	return ret;
+}
+
+static ssize_t queue_poll_delay_show(struct request_queue *q, char *page)
+{
+	int val;
+
+	if (q->poll_nsec == -1)
+		val = -1;
+	else
+		val = q->poll_nsec / 1000;
+
+	return sprintf(page, "%d\n", val);
+}
+
+static ssize_t queue_poll_delay_store(struct request_queue *q, const char *page,
+				size_t count)
+{
+	int err, val;
+
+	if (!queue_can_poll(q))
+		return -EINVAL;
+
+	err = kstrtoint(page, 10, &val);
+	if (err < 0)
+		return err;
+
+	if (val == -1)
+		q->poll_nsec = -1;
+	else if (val >= 0 && val <= INT_MAX / 1000)
+		q->poll_nsec = val * 1000;
+	else
+		return -EINVAL;
+
+	return count;
+}
+
+static ssize_t queue_wb_lat_show(struct request_queue *q, char *page)
+{
+	if (!q->rq_wb)
+		return -EINVAL;
+
+	return sprintf(page, "%llu\n", div_u64(q->rq_wb->min_lat_nsec, 1000));
+}
+
+static ssize_t queue_wb_lat_store(struct request_queue *q, const char *page,
+				  size_t count)
+{
+	struct rq_wb *rwb;
+	ssize_t ret;
+	s64 val;
+
+	if (!q->mq_ops)
+		return -EINVAL;
+
+	ret = kstrtos64(page, 10, &val);
+	if (ret < 0)
+		return ret;
+	if (val < -1)
+		return -EINVAL;
+
+	rwb = q->rq_wb;
+	if (!rwb) {
+		ret = wbt_init(q);
+		if (ret)
+			return ret;
+
+		rwb = q->rq_wb;
+	}
+
+	/* -1 restores the default target, 0 disables throttling */
+	if (val == -1)
+		rwb->min_lat_nsec = wbt_default_latency_nsec(q);
+	else
+		rwb->min_lat_nsec = val * 1000ULL;
+
+	if (rwb->enable_state == WBT_STATE_ON_DEFAULT)
+		rwb->enable_state = WBT_STATE_ON_MANUAL;
+
+	wbt_update_limits(rwb);
+	return count;
+}
+
+static ssize_t queue_lat_hist_show(struct request_queue *q, char *page)
+{
+	if (!q->mq_ops)
+		return -EINVAL;
+
+	return queue_var_show(blk_stat_hist_enabled(q), page);
+}
+
+static ssize_t queue_lat_hist_store(struct request_queue *q, const char *page,
+				    size_t count)
+{
+	unsigned long val;
+	ssize_t ret;
+	int err;
+
+	if (!q->mq_ops)
+		return -EINVAL;
+
+	ret = queue_var_store(&val, page, count);
+	if (ret < 0)
+		return ret;
+
+	err = blk_stat_hist_enable(q, val);
+	if (err)
+		return err;
+
+	return ret;
+}
+
+static ssize_t queue_discard_batch_mbps_show(struct request_queue *q,
+					     char *page)
+{
+	return queue_var_show(q->discard_batch_mbps, page);
+}
+
+static ssize_t queue_discard_batch_mbps_store(struct request_queue *q,
+					      const char *page, size_t count)
+{
+	unsigned long val;
+	ssize_t ret;
+
+	ret = queue_var_store(&val, page, count);
+	if (ret < 0)
+		return ret;
+	if (val > UINT_MAX)
+		return -EINVAL;
+
+	q->discard_batch_mbps = val;
+	return ret;
+}
+
+static ssize_t queue_flush_coalesce_show(struct request_queue *q, char *page)
+{
+	return queue_var_show(q->flush_coalesce_usec, page);
+}
+
+static ssize_t queue_flush_coalesce_store(struct request_queue *q,
+					  const char *page, size_t count)
+{
+	unsigned long usec;
+	ssize_t ret;
+
+	ret = queue_var_store(&usec, page, count);
+	if (ret < 0)
+		return ret;
+	if (usec > USEC_PER_SEC)
+		return -EINVAL;
+
+	spin_lock_irq(q->queue_lock);
+	q->flush_coalesce_usec = usec;
+	spin_unlock_irq(q->queue_lock);
+
+	return ret;
+}
+
+static ssize_t queue_flush_stats_show(struct request_queue *q, char *page)
+{
+	return sprintf(page, "%lu %lu\n", q->flush_requested, q->flush_issued);
+}
+
 static struct queue_sysfs_entry queue_requests_entry = {
 	.attr = {.name = "nr_requests", .mode = S_IRUGO | S_IWUSR },
 	.show = queue_requests_show,
@@ -394,6 +589,12 @@ static struct queue_sysfs_entry queue_discard_zeroes_data_entry = {
 	.show = queue_discard_zeroes_data_show,
 };
 
+static struct queue_sysfs_entry queue_discard_batch_mbps_entry = {
+	.attr = {.name = "discard_batch_mbps", .mode = S_IRUGO | S_IWUSR },
+	.show = queue_discard_batch_mbps_show,
+	.store = queue_discard_batch_mbps_store,
+};
+
 static struct queue_sysfs_entry queue_write_same_max_entry = {
 	.attr = {.name = "write_same_max_bytes", .mode = S_IRUGO },
 	.show = queue_write_same_max_show,
@@ -429,6 +630,41 @@ static struct queue_sysfs_entry queue_random_entry = {
 	.store = queue_store_random,
 };
 
+static struct queue_sysfs_entry queue_poll_entry = {
+	.attr = {.name = "io_poll", .mode = S_IRUGO | S_IWUSR },
+	.show = queue_poll_show,
+	.store = queue_poll_store,
+};
+
+static struct queue_sysfs_entry queue_poll_delay_entry = {
+	.attr = {.name = "io_poll_delay", .mode = S_IRUGO | S_IWUSR },
+	.show = queue_poll_delay_show,
+	.store = queue_poll_delay_store,
+};
+
+static struct queue_sysfs_entry queue_wb_lat_entry = {
+	.attr = {.name = "wbt_lat_usec", .mode = S_IRUGO | S_IWUSR },
+	.show = queue_wb_lat_show,
+	.store = queue_wb_lat_store,
+};
+
+static struct queue_sysfs_entry queue_lat_hist_entry = {
+	.attr = {.name = "lat_hist", .mode = S_IRUGO | S_IWUSR },
+	.show = queue_lat_hist_show,
+	.store = queue_lat_hist_store,
+};
+
+static struct queue_sysfs_entry queue_flush_coalesce_entry = {
+	.attr = {.name = "flush_coalesce_usec", .mode = S_IRUGO | S_IWUSR },
+	.show = queue_flush_coalesce_show,
+	.store = queue_flush_coalesce_store,
+};
+
+static struct queue_sysfs_entry queue_flush_stats_entry = {
+	.attr = {.name = "flush_stats", .mode = S_IRUGO },
+	.show = queue_flush_stats_show,
+};
+
 static struct attribute *default_attrs[] = {
 	&queue_requests_entry.attr,
 	&queue_ra_entry.attr,
@@ -446,12 +682,19 @@ static struct attribute *default_attrs[] = {
 	&queue_discard_granularity_entry.attr,
 	&queue_discard_max_entry.attr,
 	&queue_discard_zeroes_data_entry.attr,
+	&queue_discard_batch_mbps_entry.attr,
 	&queue_write_same_max_entry.attr,
 	&queue_nonrot_entry.attr,
 	&queue_nomerges_entry.attr,
 	&queue_rq_affinity_entry.attr,
 	&queue_iostats_entry.attr,
 	&queue_random_entry.attr,
+	&queue_poll_entry.attr,
+	&queue_poll_delay_entry.attr,
+	&queue_wb_lat_entry.attr,
+	&queue_lat_hist_entry.attr,
+	&queue_flush_coalesce_entry.attr,
+	&queue_flush_stats_entry.attr,
 	NULL,
 };
 
@@ -528,6 +771,14 @@ static void blk_release_queue(struct kobject *kobj)
 
 	blk_sync_queue(q);
 
+	if (q->mq_ops) {
+		if (test_bit(QUEUE_FLAG_POLL_STATS, &q->queue_flags))
+			blk_stat_remove_callback(q, q->poll_cb);
+		blk_stat_free_callback(q->poll_cb);
+		wbt_exit(q);
+	}
+
+	blk_discard_batch_exit(q);
 	blkcg_exit_queue(q);
 
 	if (q->elevator) {
@@ -588,6 +839,8 @@ int blk_register_queue(struct gendisk *disk)
 
 	kobject_uevent(&q->kobj, KOBJ_ADD);
 
+	wbt_enable_default(q);
+
 	if (!q->request_fn)
 		return 0;
 
@@ -40,12 +40,27 @@ struct throtl_rb_root {
 
 #define rb_entry_tg(node)	rb_entry((node), struct throtl_grp, rb_node)
 
-/* Per-cpu group stats */
+/*
+ * Each cpu gets handed at most this share of a slice's allowance at a
+ * time, divided by the number of online cpus.
+ */
+#define THROTL_BUDGET_SHARES	2
+
+/* Per-cpu group stats and dispatch budget */
 struct tg_stats_cpu {
 	/* total bytes transferred */
 	struct blkg_rwstat		service_bytes;
 	/* total IOs serviced, post merge */
 	struct blkg_rwstat		serviced;
+
+	/*
+	 * What this cpu may still dispatch without the queue lock, already
+	 * charged to the group.  -1 if the respective limit is not set.
+	 * Only valid while budget_gen matches the group's.
+	 */
+	u64				budget_bytes[2];
+	unsigned int			budget_ios[2];
+	unsigned int			budget_gen[2];
 };
 //blkio iopsƽṹ
 struct throtl_grp {
@@ -88,6 +103,9 @@ struct throtl_grp {
 	/* Some throttle limits got updated for the group */
 	int limits_changed;
 
+	/* Bumped to revoke all per cpu budgets, under queue lock */
+	unsigned int budget_gen[2];
+
 	/* Per cpu stats pointer */
 	struct tg_stats_cpu __percpu *stats_cpu;
 
@@ -429,6 +447,8 @@ throtl_start_new_slice(struct throtl_data *td, struct throtl_grp *tg, bool rw)
 {
 	tg->bytes_disp[rw] = 0;
 	tg->io_disp[rw] = 0;
+	/* budgets were charged to the old slice */
+	tg->budget_gen[rw]++;
 	tg->slice_start[rw] = jiffies;
 	tg->slice_end[rw] = jiffies + throtl_slice;
 	throtl_log_tg(td, tg, "[%c] new slice start=%lu end=%lu jiffies=%lu",
@@ -711,6 +731,121 @@ static void throtl_charge_bio(struct throtl_grp *tg, struct bio *bio)
 	throtl_update_dispatch_stats(tg_to_blkg(tg), bio->bi_size, bio->bi_rw);
 }
 
+/*
+ * Lockless fast path: dispatch @bio out of this cpu's budget if it still
+ * covers it.  Bios queued in the same direction go first, so don't bypass
+ * them.
+ */
+static bool tg_consume_budget(struct throtl_grp *tg, struct bio *bio)
+{
+	bool rw = bio_data_dir(bio);
+	struct tg_stats_cpu *sc;
+	unsigned long flags;
+	bool ret = false;
+
+	if (tg->stats_cpu == NULL || ACCESS_ONCE(tg->nr_queued[rw]))
+		return false;
+
+	/* see throtl_update_dispatch_stats() */
+	local_irq_save(flags);
+
+	sc = this_cpu_ptr(tg->stats_cpu);
+
+	if (sc->budget_gen[rw] == ACCESS_ONCE(tg->budget_gen[rw]) &&
+	    sc->budget_bytes[rw] >= bio->bi_size && sc->budget_ios[rw]) {
+		if (sc->budget_bytes[rw] != -1)
+			sc->budget_bytes[rw] -= bio->bi_size;
+		if (sc->budget_ios[rw] != -1)
+			sc->budget_ios[rw]--;
+
+		blkg_rwstat_add(&sc->serviced, bio->bi_rw, 1);
+		blkg_rwstat_add(&sc->service_bytes, bio->bi_rw, bio->bi_size);
+		ret = true;
+	}
+
+	local_irq_restore(flags);
+	return ret;
+}
+
+/*
+ * Hand this cpu a batch of what @tg may still dispatch in the current
+ * slice, so the following bios can take tg_consume_budget().  The batch is
+ * charged to the group up front and is capped so that all cpus together
+ * can't hold more than 1/THROTL_BUDGET_SHARES of a slice.  Called with the
+ * queue lock held, right after a bio was dispatched within limits.
+ */
+static void tg_refill_budget(struct throtl_data *td, struct throtl_grp *tg,
+			     bool rw)
+{
+	unsigned int shares = THROTL_BUDGET_SHARES * num_online_cpus();
+	unsigned long jiffy_elapsed_rnd;
+	unsigned int ios = -1;
+	u64 bytes = -1, tmp;
+	struct tg_stats_cpu *sc;
+
+	if (tg->stats_cpu == NULL)
+		return;
+
+	jiffy_elapsed_rnd = jiffies - tg->slice_start[rw];
+	if (!jiffy_elapsed_rnd)
+		jiffy_elapsed_rnd = throtl_slice;
+	jiffy_elapsed_rnd = roundup(jiffy_elapsed_rnd, throtl_slice);
+
+	if (tg->bps[rw] != -1) {
+		tmp = tg->bps[rw] * jiffy_elapsed_rnd;
+		do_div(tmp, HZ);
+		if (tmp <= tg->bytes_disp[rw])
+			return;
+		bytes = tmp - tg->bytes_disp[rw];
+
+		tmp = tg->bps[rw] * throtl_slice;
+		do_div(tmp, HZ * shares);
+		bytes = min(bytes, tmp);
+		if (!bytes)
+			return;
+	}
+
+	if (tg->iops[rw] != -1) {
+		tmp = (u64)tg->iops[rw] * jiffy_elapsed_rnd;
+		do_div(tmp, HZ);
+		if (tmp <= tg->io_disp[rw])
+			return;
+		tmp -= tg->io_disp[rw];
+		ios = min_t(u64, tmp, UINT_MAX - 1);
+
+		tmp = (u64)tg->iops[rw] * throtl_slice;
+		do_div(tmp, HZ * shares);
+		ios = min_t(u64, ios, tmp);
+		if (!ios)
+			return;
+	}
+
+	/* irqs are off under the queue lock, this cpu's budget is ours */
+	sc = this_cpu_ptr(tg->stats_cpu);
+
+	if (sc->budget_gen[rw] != tg->budget_gen[rw]) {
+		sc->budget_gen[rw] = tg->budget_gen[rw];
+		sc->budget_bytes[rw] = 0;
+		sc->budget_ios[rw] = 0;
+	}
+
+	if (bytes != -1) {
+		sc->budget_bytes[rw] += bytes;
+		tg->bytes_disp[rw] += bytes;
+	} else
+		sc->budget_bytes[rw] = -1;
+
+	if (ios != -1) {
+		sc->budget_ios[rw] += ios;
+		tg->io_disp[rw] += ios;
+	} else
+		sc->budget_ios[rw] = -1;
+
+	throtl_log_tg(td, tg, "[%c] budget cpu=%d bytes=%llu ios=%u",
+			rw == READ ? 'R' : 'W', smp_processor_id(),
+			sc->budget_bytes[rw], sc->budget_ios[rw]);
+}
+
 static void throtl_add_bio_tg(struct throtl_data *td, struct throtl_grp *tg,
 			struct bio *bio)
 {
@@ -1032,6 +1167,10 @@ static int tg_set_conf(struct cgroup *cgrp, struct cftype *cft, const char *buf,
 	else
 		*(unsigned int *)((void *)tg + cft->private) = ctx.v;
 
+	/* revoke budgets handed out under the old limits right away */
+	tg->budget_gen[READ]++;
+	tg->budget_gen[WRITE]++;
+
 	/* XXX: we don't need the following deferred processing */
 	xchg(&tg->limits_changed, true);
 	xchg(&td->limits_changed, true);
@@ -1141,6 +1280,10 @@ bool blk_throtl_bio(struct request_queue *q, struct bio *bio)
 						     bio->bi_size, bio->bi_rw);
 			goto out_unlock_rcu;
 		}
+
+		/* Within this cpu's prepaid budget, skip the queue lock */
+		if (tg_consume_budget(tg, bio))
+			goto out_unlock_rcu;
 	}
 
 	/*
@@ -1179,6 +1322,9 @@ bool blk_throtl_bio(struct request_queue *q, struct bio *bio)
 		 * So keep on trimming slice even if bio is not queued.
 		 */
 		throtl_trim_slice(td, tg, rw);
+
+		/* let the next bios from this cpu take the fast path */
+		tg_refill_budget(td, tg, rw);
 		goto out_unlock;
 	}
 
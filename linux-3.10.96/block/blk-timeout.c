@@ -7,6 +7,7 @@
 #include <linux/fault-inject.h>
 
 #include "blk.h"
+#include "blk-mq.h"
 
 #ifdef CONFIG_FAIL_IO_TIMEOUT
 
@@ -114,6 +115,12 @@ void blk_rq_timed_out_timer(unsigned long data)
 	struct request *rq, *tmp;
 	int next_set = 0;
 
+	/* blk-mq keeps its own timeout buckets, see blk_mq_add_timer() */
+	if (q->mq_ops) {
+		kblockd_schedule_work(q, &q->timeout_work);
+		return;
+	}
+
 	spin_lock_irqsave(q->queue_lock, flags);
 
 	list_for_each_entry_safe(rq, tmp, &q->timeout_list, timeout_list) {
@@ -170,10 +177,10 @@ void blk_add_timer(struct request *req)
 	struct request_queue *q = req->q;
 	unsigned long expiry;
 
-	if (!q->rq_timed_out_fn)
+	if (!q->mq_ops && !q->rq_timed_out_fn)
 		return;
 
-	BUG_ON(!list_empty(&req->timeout_list));
+	BUG_ON(!q->mq_ops && !list_empty(&req->timeout_list));
 
 	/*
 	 * Some LLDs, like scsi, peek at the timeout to prevent a
@@ -184,8 +191,13 @@ void blk_add_timer(struct request *req)
 		req->timeout = q->rq_timeout;
     //³ʱʱ
 	req->deadline = jiffies + req->timeout;
+	/*
+	 * blk-mq queues the tag with blk_mq_add_timer() once the request is
+	 * marked started, or the bucket scan would drop it.
+	 */
     //reqq->timeout_list
-	list_add_tail(&req->timeout_list, &q->timeout_list);
+	if (!q->mq_ops)
+		list_add_tail(&req->timeout_list, &q->timeout_list);
 
 	/*
 	 * If the timer isn't already pending or this timeout is earlier
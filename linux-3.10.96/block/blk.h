@@ -42,6 +42,8 @@ void blk_add_timer(struct request *);
  */
 enum rq_atomic_flags {
 	REQ_ATOM_COMPLETE = 0,
+	REQ_ATOM_STARTED,
+	REQ_ATOM_POLL_SLEPT,
 };
 
 /*
@@ -63,6 +65,8 @@ static inline void blk_clear_rq_complete(struct request *rq)
  */
 #define ELV_ON_HASH(rq) hash_hashed(&(rq)->hash)
 
+void blk_flush_init_queue(struct request_queue *q);
+void blk_discard_batch_exit(struct request_queue *q);
 void blk_insert_flush(struct request *rq);
 void blk_abort_flushes(struct request_queue *q);
 
@@ -215,6 +219,44 @@ static inline struct io_context *create_io_context(gfp_t gfp_mask, int node)
 	return current->io_context;
 }
 
+/*
+ * Inflight accounting shared by the queue depth throttlers (blk-wbt,
+ * blk-iolatency).
+ */
+struct rq_wait {
+	wait_queue_head_t wait;
+	atomic_t inflight;
+};
+
+static inline void rq_wait_init(struct rq_wait *rq_wait)
+{
+	atomic_set(&rq_wait->inflight, 0);
+	init_waitqueue_head(&rq_wait->wait);
+}
+
+/*
+ * Increment ->inflight if it is below @limit. Returns true if we succeeded,
+ * false if ->inflight + 1 would exceed @limit.
+ */
+static inline bool rq_wait_inc_below(struct rq_wait *rq_wait, int limit)
+{
+	atomic_t *v = &rq_wait->inflight;
+	int cur = atomic_read(v);
+
+	for (;;) {
+		int old;
+
+		if (cur >= limit)
+			return false;
+		old = atomic_cmpxchg(v, cur, cur + 1);
+		if (old == cur)
+			break;
+		cur = old;
+	}
+
+	return true;
+}
+
 /*
  * Internal throttling interface
  */
@@ -233,4 +275,31 @@ static inline int blk_throtl_init(struct request_queue *q) { return 0; }
 static inline void blk_throtl_exit(struct request_queue *q) { }
 #endif /* CONFIG_BLK_DEV_THROTTLING */
 
+/*
+ * Latency based cgroup protection, blk-mq only
+ */
+#ifdef CONFIG_BLK_CGROUP_IOLATENCY
+extern int blk_iolatency_init(struct request_queue *q);
+extern void blk_iolatency_exit(struct request_queue *q);
+extern struct blkcg_gq *blk_iolatency_throttle(struct request_queue *q,
+					       struct bio *bio);
+extern void blk_iolatency_track(struct request *rq, struct blkcg_gq *blkg);
+extern void blk_iolatency_cancel(struct request_queue *q,
+				 struct blkcg_gq *blkg);
+extern void blk_iolatency_done(struct request *rq);
+#else /* CONFIG_BLK_CGROUP_IOLATENCY */
+static inline int blk_iolatency_init(struct request_queue *q) { return 0; }
+static inline void blk_iolatency_exit(struct request_queue *q) { }
+static inline struct blkcg_gq *blk_iolatency_throttle(struct request_queue *q,
+						      struct bio *bio)
+{
+	return NULL;
+}
+static inline void blk_iolatency_track(struct request *rq,
+				       struct blkcg_gq *blkg) { }
+static inline void blk_iolatency_cancel(struct request_queue *q,
+					struct blkcg_gq *blkg) { }
+static inline void blk_iolatency_done(struct request *rq) { }
+#endif /* CONFIG_BLK_CGROUP_IOLATENCY */
+
 #endif /* BLK_INTERNAL_H */
@@ -21,6 +21,7 @@
 #include <linux/idr.h>
 #include <linux/bsg.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
 
 #include <scsi/scsi.h>
 #include <scsi/scsi_ioctl.h>
@@ -46,6 +47,30 @@ struct bsg_device {
 	char name[20];
 	int max_queue;
 	unsigned long flags;
+	/*
+	 * finished commands are kept here instead of going back to the
+	 * slab, so a steady stream of writes and reads doesn't allocate
+	 */
+	struct list_head free_list;
+	int free_cmds;
+	/*
+	 * registered buffers, see BSG_REGISTER_BUFFERS.  buf_users counts
+	 * the requests mapping one, they can't go away while it's non-zero
+	 */
+	struct bsg_reg_buf *bufs;
+	unsigned int nr_bufs;
+	int buf_users;
+	struct user_struct *bufs_user;	/* charged for the pinned pages */
+};
+
+/*
+ * a user buffer pinned for the lifetime of the registration
+ */
+struct bsg_reg_buf {
+	struct page **pages;
+	unsigned int nr_pages;
+	unsigned int offset;	/* of the data in pages[0] */
+	unsigned int len;
 };
 
 enum {
@@ -84,6 +109,7 @@ struct bsg_command {
 	struct bio *bio;
 	struct bio *bidi_bio;
 	int err;
+	bool reg_buf;
 	struct sg_io_v4 hdr;
 	char sense[SCSI_SENSE_BUFFERSIZE];
 };
@@ -93,15 +119,31 @@ static void bsg_free_command(struct bsg_command *bc)
 	struct bsg_device *bd = bc->bd;
 	unsigned long flags;
 
-	kmem_cache_free(bsg_cmd_cachep, bc);
-
 	spin_lock_irqsave(&bd->lock, flags);
 	bd->queued_cmds--;
+	if (bd->free_cmds < bd->max_queue) {
+		list_add(&bc->list, &bd->free_list);
+		bd->free_cmds++;
+		bc = NULL;
+	}
 	spin_unlock_irqrestore(&bd->lock, flags);
 
+	if (bc)
+		kmem_cache_free(bsg_cmd_cachep, bc);
+
 	wake_up(&bd->wq_free);
 }
 
+static void bsg_free_cached_commands(struct bsg_device *bd)
+{
+	struct bsg_command *bc, *tmp;
+
+	list_for_each_entry_safe(bc, tmp, &bd->free_list, list)
+		kmem_cache_free(bsg_cmd_cachep, bc);
+	INIT_LIST_HEAD(&bd->free_list);
+	bd->free_cmds = 0;
+}
+
 static struct bsg_command *bsg_alloc_command(struct bsg_device *bd)
 {
 	struct bsg_command *bc = ERR_PTR(-EINVAL);
@@ -112,6 +154,14 @@ static struct bsg_command *bsg_alloc_command(struct bsg_device *bd)
 		goto out;
 
 	bd->queued_cmds++;
+	if (bd->free_cmds) {
+		bc = list_first_entry(&bd->free_list, struct bsg_command, list);
+		list_del(&bc->list);
+		bd->free_cmds--;
+		spin_unlock_irq(&bd->lock);
+		memset(bc, 0, sizeof(*bc));
+		goto init;
+	}
 	spin_unlock_irq(&bd->lock);
 
 	bc = kmem_cache_zalloc(bsg_cmd_cachep, GFP_KERNEL);
@@ -121,7 +171,7 @@ static struct bsg_command *bsg_alloc_command(struct bsg_device *bd)
 		bc = ERR_PTR(-ENOMEM);
 		goto out;
 	}
-
+init:
 	bc->bd = bd;
 	INIT_LIST_HEAD(&bc->list);
 	dprintk("%s: returning free cmd %p\n", bd->name, bc);
@@ -238,6 +288,258 @@ bsg_validate_sgv4_hdr(struct request_queue *q, struct sg_io_v4 *hdr, int *rw)
 	return ret;
 }
 
+/*
+ * the pinned pages are charged to the registering user's locked_vm
+ * against RLIMIT_MEMLOCK, or every open bsg device could pin up to
+ * BSG_MAX_REG_BUFS times max_hw_sectors of memory for free
+ */
+static int bsg_account_locked(struct user_struct *user, unsigned long nr_pages)
+{
+	unsigned long limit = rlimit(RLIMIT_MEMLOCK) >> PAGE_SHIFT;
+
+	if (atomic_long_add_return(nr_pages, &user->locked_vm) > limit &&
+	    !capable(CAP_IPC_LOCK)) {
+		atomic_long_sub(nr_pages, &user->locked_vm);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static void bsg_release_buffers(struct user_struct *user,
+				struct bsg_reg_buf *bufs, unsigned int nr)
+{
+	unsigned long locked = 0;
+	unsigned int i, j;
+
+	for (i = 0; i < nr; i++) {
+		for (j = 0; j < bufs[i].nr_pages; j++) {
+			set_page_dirty_lock(bufs[i].pages[j]);
+			put_page(bufs[i].pages[j]);
+		}
+		locked += bufs[i].nr_pages;
+		kfree(bufs[i].pages);
+	}
+	kfree(bufs);
+
+	atomic_long_sub(locked, &user->locked_vm);
+	free_uid(user);
+}
+
+static int bsg_pin_buffer(struct request_queue *q, struct user_struct *user,
+			  struct bsg_reg_buf *buf, struct iovec *iov)
+{
+	unsigned long uaddr = (unsigned long) iov->iov_base;
+	unsigned long end = uaddr + iov->iov_len;
+	int nr_pages, pinned, ret;
+
+	if (!iov->iov_len || end < uaddr ||
+	    iov->iov_len > (queue_max_hw_sectors(q) << 9))
+		return -EINVAL;
+
+	nr_pages = (PAGE_ALIGN(end) - (uaddr & PAGE_MASK)) >> PAGE_SHIFT;
+	ret = bsg_account_locked(user, nr_pages);
+	if (ret)
+		return ret;
+
+	buf->pages = kcalloc(nr_pages, sizeof(struct page *), GFP_KERNEL);
+	if (!buf->pages) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	pinned = get_user_pages_fast(uaddr & PAGE_MASK, nr_pages, 1,
+				     buf->pages);
+	if (pinned < nr_pages) {
+		ret = pinned < 0 ? pinned : -EFAULT;
+		while (pinned > 0)
+			put_page(buf->pages[--pinned]);
+		kfree(buf->pages);
+		buf->pages = NULL;
+		goto out;
+	}
+
+	buf->nr_pages = nr_pages;
+	buf->offset = uaddr & ~PAGE_MASK;
+	buf->len = iov->iov_len;
+	return 0;
+out:
+	atomic_long_sub(nr_pages, &user->locked_vm);
+	return ret;
+}
+
+static int bsg_register_buffers(struct bsg_device *bd, void __user *arg)
+{
+	struct bsg_buf_reg reg;
+	struct bsg_reg_buf *bufs;
+	struct user_struct *user;
+	struct iovec iov;
+	unsigned int i;
+	int ret;
+
+	if (copy_from_user(&reg, arg, sizeof(reg)))
+		return -EFAULT;
+	if (reg.flags || !reg.nr || reg.nr > BSG_MAX_REG_BUFS)
+		return -EINVAL;
+
+	/*
+	 * the pages are handed to the driver as they are on every command,
+	 * a queue that needs them bounced can't take arbitrary user pages
+	 */
+	if (queue_bounce_pfn(bd->queue) < blk_max_pfn)
+		return -EOPNOTSUPP;
+
+	bufs = kcalloc(reg.nr, sizeof(*bufs), GFP_KERNEL);
+	if (!bufs)
+		return -ENOMEM;
+	user = get_uid(current_user());
+
+	for (i = 0; i < reg.nr; i++) {
+		void __user *uiov = (void __user *)(unsigned long)
+					(reg.iov + i * sizeof(iov));
+
+		if (copy_from_user(&iov, uiov, sizeof(iov))) {
+			ret = -EFAULT;
+			goto out;
+		}
+		ret = bsg_pin_buffer(bd->queue, user, &bufs[i], &iov);
+		if (ret)
+			goto out;
+	}
+
+	spin_lock_irq(&bd->lock);
+	if (bd->bufs) {
+		spin_unlock_irq(&bd->lock);
+		ret = -EBUSY;
+		goto out;
+	}
+	bd->bufs = bufs;
+	bd->nr_bufs = reg.nr;
+	bd->bufs_user = user;
+	spin_unlock_irq(&bd->lock);
+	return 0;
+out:
+	bsg_release_buffers(user, bufs, i);
+	return ret;
+}
+
+static int bsg_unregister_buffers(struct bsg_device *bd)
+{
+	struct bsg_reg_buf *bufs;
+	struct user_struct *user;
+	unsigned int nr;
+
+	spin_lock_irq(&bd->lock);
+	if (!bd->bufs) {
+		spin_unlock_irq(&bd->lock);
+		return -ENXIO;
+	}
+	if (bd->buf_users) {
+		spin_unlock_irq(&bd->lock);
+		return -EBUSY;
+	}
+	bufs = bd->bufs;
+	nr = bd->nr_bufs;
+	user = bd->bufs_user;
+	bd->bufs = NULL;
+	bd->nr_bufs = 0;
+	bd->bufs_user = NULL;
+	spin_unlock_irq(&bd->lock);
+
+	bsg_release_buffers(user, bufs, nr);
+	return 0;
+}
+
+static void bsg_put_reg_buf(struct bsg_device *bd)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&bd->lock, flags);
+	bd->buf_users--;
+	spin_unlock_irqrestore(&bd->lock, flags);
+}
+
+static inline bool bsg_uses_reg_buf(struct sg_io_v4 *hdr)
+{
+	return (hdr->flags & BSG_FLAG_REG_BUF) &&
+		(hdr->dout_xfer_len || hdr->din_xfer_len);
+}
+
+static void bsg_reg_buf_endio(struct bio *bio, int error)
+{
+	bio_put(bio);
+}
+
+/*
+ * map 'len' bytes at 'offset' into registered buffer 'idx' to rq.  The
+ * pages are already pinned, so this only builds the bio; it's released
+ * by the block layer on completion and there is nothing to unmap.  The
+ * bio still goes through blk_queue_bounce() like blk_rq_map_user() does,
+ * the queue limits may have changed since the buffers were registered.
+ */
+static int bsg_map_reg_buf(struct bsg_device *bd, struct request *rq,
+			   unsigned int idx, u64 offset, unsigned int len)
+{
+	struct request_queue *q = bd->queue;
+	struct bsg_reg_buf *buf;
+	struct bio *bio;
+	unsigned long start;
+	unsigned int i, off, nr_pages;
+	int ret;
+
+	spin_lock_irq(&bd->lock);
+	if (idx >= bd->nr_bufs || offset > bd->bufs[idx].len ||
+	    len > bd->bufs[idx].len - offset) {
+		spin_unlock_irq(&bd->lock);
+		return -EINVAL;
+	}
+	buf = &bd->bufs[idx];
+	bd->buf_users++;
+	spin_unlock_irq(&bd->lock);
+
+	start = buf->offset + offset;
+	if (!blk_rq_aligned(q, start, len)) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	off = start & ~PAGE_MASK;
+	nr_pages = DIV_ROUND_UP(off + len, PAGE_SIZE);
+	bio = bio_kmalloc(GFP_KERNEL, nr_pages);
+	if (!bio) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	if (rq_data_dir(rq) == WRITE)
+		bio->bi_rw |= REQ_WRITE;
+
+	for (i = start >> PAGE_SHIFT; len; i++) {
+		unsigned int bytes = min_t(unsigned int, len, PAGE_SIZE - off);
+
+		if (bio_add_pc_page(q, bio, buf->pages[i], bytes, off) < bytes) {
+			ret = -EINVAL;
+			goto out_bio;
+		}
+		len -= bytes;
+		off = 0;
+	}
+
+	bio->bi_end_io = bsg_reg_buf_endio;
+	blk_queue_bounce(q, &bio);
+
+	ret = blk_rq_append_bio(q, rq, bio);
+	if (ret) {
+		/* frees the bounce bio, if any, and then ours */
+		bio_endio(bio, 0);
+		goto out;
+	}
+	return 0;
+out_bio:
+	bio_put(bio);
+out:
+	bsg_put_reg_buf(bd);
+	return ret;
+}
+
 /*
  * map sg_io_v4 to a request.
  */
@@ -277,6 +579,24 @@ bsg_map_hdr(struct bsg_device *bd, struct sg_io_v4 *hdr, fmode_t has_write_perm,
 	if (ret)
 		goto out;
 
+	if (hdr->flags & BSG_FLAG_REG_BUF) {
+		if (rw == WRITE && hdr->din_xfer_len) {
+			ret = -EINVAL;
+			goto out;
+		}
+		if (hdr->dout_xfer_len)
+			ret = bsg_map_reg_buf(bd, rq, hdr->request_extra,
+					      hdr->dout_xferp,
+					      hdr->dout_xfer_len);
+		else if (hdr->din_xfer_len)
+			ret = bsg_map_reg_buf(bd, rq, hdr->request_extra,
+					      hdr->din_xferp,
+					      hdr->din_xfer_len);
+		if (ret)
+			goto out;
+		goto done;
+	}
+
 	if (rw == WRITE && hdr->din_xfer_len) {
 		if (!test_bit(QUEUE_FLAG_BIDI, &q->queue_flags)) {
 			ret = -EOPNOTSUPP;
@@ -313,7 +633,7 @@ bsg_map_hdr(struct bsg_device *bd, struct sg_io_v4 *hdr, fmode_t has_write_perm,
 		if (ret)
 			goto out;
 	}
-
+done:
 	rq->sense = sense;
 	rq->sense_len = 0;
 
@@ -365,7 +685,9 @@ static void bsg_add_command(struct bsg_device *bd, struct request_queue *q,
 	 * add bc command to busy queue and submit rq for io
 	 */
 	bc->rq = rq;
-	bc->bio = rq->bio;
+	bc->reg_buf = bsg_uses_reg_buf(&bc->hdr);
+	if (!bc->reg_buf)
+		bc->bio = rq->bio;
 	if (rq->next_rq)
 		bc->bidi_bio = rq->next_rq->bio;
 	bc->hdr.duration = jiffies;
@@ -480,6 +802,16 @@ static int blk_complete_sgv4_hdr_rq(struct request *rq, struct sg_io_v4 *hdr,
 	return ret;
 }
 
+static int bsg_complete_command(struct bsg_command *bc)
+{
+	int ret;
+
+	ret = blk_complete_sgv4_hdr_rq(bc->rq, &bc->hdr, bc->bio, bc->bidi_bio);
+	if (bc->reg_buf)
+		bsg_put_reg_buf(bc->bd);
+	return ret;
+}
+
 static int bsg_complete_all_commands(struct bsg_device *bd)
 {
 	struct bsg_command *bc;
@@ -518,8 +850,7 @@ static int bsg_complete_all_commands(struct bsg_device *bd)
 		if (IS_ERR(bc))
 			break;
 
-		tret = blk_complete_sgv4_hdr_rq(bc->rq, &bc->hdr, bc->bio,
-						bc->bidi_bio);
+		tret = bsg_complete_command(bc);
 		if (!ret)
 			ret = tret;
 
@@ -529,11 +860,48 @@ static int bsg_complete_all_commands(struct bsg_device *bd)
 	return ret;
 }
 
+/*
+ * Move up to 'max' finished commands to 'list' under a single lock
+ * round trip.  Waits for the first one like bsg_get_done_cmd().
+ */
+static int bsg_get_done_cmds(struct bsg_device *bd, struct list_head *list,
+			     int max)
+{
+	struct bsg_command *bc;
+	int nr = 0, ret;
+
+	do {
+		spin_lock_irq(&bd->lock);
+		while (nr < max && bd->done_cmds) {
+			bc = list_first_entry(&bd->done_list,
+					      struct bsg_command, list);
+			list_move_tail(&bc->list, list);
+			bd->done_cmds--;
+			nr++;
+		}
+		spin_unlock_irq(&bd->lock);
+		if (nr)
+			break;
+
+		if (!test_bit(BSG_F_BLOCK, &bd->flags))
+			return -EAGAIN;
+
+		ret = wait_event_interruptible(bd->wq_done, bd->done_cmds);
+		if (ret)
+			return -ERESTARTSYS;
+	} while (1);
+
+	dprintk("%s: returning %d done\n", bd->name, nr);
+
+	return nr;
+}
+
 static int
 __bsg_read(char __user *buf, size_t count, struct bsg_device *bd,
 	   const struct iovec *iov, ssize_t *bytes_read)
 {
 	struct bsg_command *bc;
+	LIST_HEAD(done);
 	int nr_commands, ret;
 
 	if (count % sizeof(struct sg_io_v4))
@@ -542,31 +910,51 @@ __bsg_read(char __user *buf, size_t count, struct bsg_device *bd,
 	ret = 0;
 	nr_commands = count / sizeof(struct sg_io_v4);
 	while (nr_commands) {
-		bc = bsg_get_done_cmd(bd);
-		if (IS_ERR(bc)) {
-			ret = PTR_ERR(bc);
+		ret = bsg_get_done_cmds(bd, &done, nr_commands);
+		if (ret < 0)
 			break;
-		}
+		ret = 0;
 
-		/*
-		 * this is the only case where we need to copy data back
-		 * after completing the request. so do that here,
-		 * bsg_complete_work() cannot do that for us
-		 */
-		ret = blk_complete_sgv4_hdr_rq(bc->rq, &bc->hdr, bc->bio,
-					       bc->bidi_bio);
+		while (!list_empty(&done)) {
+			bc = list_first_entry(&done, struct bsg_command, list);
+			list_del(&bc->list);
 
-		if (copy_to_user(buf, &bc->hdr, sizeof(bc->hdr)))
-			ret = -EFAULT;
+			/*
+			 * this is the only case where we need to copy data
+			 * back after completing the request. so do that here,
+			 * bsg_complete_work() cannot do that for us
+			 */
+			ret = bsg_complete_command(bc);
 
-		bsg_free_command(bc);
+			if (copy_to_user(buf, &bc->hdr, sizeof(bc->hdr)))
+				ret = -EFAULT;
+
+			bsg_free_command(bc);
+
+			if (ret)
+				break;
+
+			buf += sizeof(struct sg_io_v4);
+			*bytes_read += sizeof(struct sg_io_v4);
+			nr_commands--;
+		}
 
 		if (ret)
 			break;
+	}
 
-		buf += sizeof(struct sg_io_v4);
-		*bytes_read += sizeof(struct sg_io_v4);
-		nr_commands--;
+	/*
+	 * hand back whatever we took but couldn't return this time
+	 */
+	if (!list_empty(&done)) {
+		int nr = 0;
+
+		list_for_each_entry(bc, &done, list)
+			nr++;
+		spin_lock_irq(&bd->lock);
+		list_splice(&done, &bd->done_list);
+		bd->done_cmds += nr;
+		spin_unlock_irq(&bd->lock);
 	}
 
 	return ret;
@@ -707,6 +1095,7 @@ static struct bsg_device *bsg_alloc_device(void)
 
 	INIT_LIST_HEAD(&bd->busy_list);
 	INIT_LIST_HEAD(&bd->done_list);
+	INIT_LIST_HEAD(&bd->free_list);
 	INIT_HLIST_NODE(&bd->dev_list);
 
 	init_waitqueue_head(&bd->wq_free);
@@ -756,6 +1145,9 @@ static int bsg_put_device(struct bsg_device *bd)
 	 */
 	ret = bsg_complete_all_commands(bd);
 
+	bsg_free_cached_commands(bd);
+	if (bd->bufs)
+		bsg_release_buffers(bd->bufs_user, bd->bufs, bd->nr_bufs);
 	kfree(bd);
 out:
 	kref_put(&q->bsg_dev.ref, bsg_kref_release_function);
@@ -937,19 +1329,25 @@ static long bsg_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		if (IS_ERR(rq))
 			return PTR_ERR(rq);
 
-		bio = rq->bio;
+		bio = bsg_uses_reg_buf(&hdr) ? NULL : rq->bio;
 		if (rq->next_rq)
 			bidi_bio = rq->next_rq->bio;
 
 		at_head = (0 == (hdr.flags & BSG_FLAG_Q_AT_TAIL));
 		blk_execute_rq(bd->queue, NULL, rq, at_head);
 		ret = blk_complete_sgv4_hdr_rq(rq, &hdr, bio, bidi_bio);
+		if (bsg_uses_reg_buf(&hdr))
+			bsg_put_reg_buf(bd);
 
 		if (copy_to_user(uarg, &hdr, sizeof(hdr)))
 			return -EFAULT;
 
 		return ret;
 	}
+	case BSG_REGISTER_BUFFERS:
+		return bsg_register_buffers(bd, (void __user *) arg);
+	case BSG_UNREGISTER_BUFFERS:
+		return bsg_unregister_buffers(bd);
 	/*
 	 * block device ioctls
 	 */
@@ -19,6 +19,7 @@
 #include <linux/idr.h>
 #include <linux/log2.h>
 #include <linux/pm_runtime.h>
+#include <linux/async.h>
 
 #include "blk.h"
 
@@ -36,6 +37,8 @@ static DEFINE_IDR(ext_devt_idr);
 
 static struct device_type disk_type;
 
+static bool async_part_scan = true;
+
 static void disk_check_events(struct disk_events *ev,
 			      unsigned int *clearing_ptr);
 static void disk_alloc_events(struct gendisk *disk);
@@ -505,12 +508,9 @@ static int exact_lock(dev_t devt, void *data)
 	return 0;
 }
 //mmcblk0豸ڵ㣬block_device
-static void register_disk(struct gendisk *disk)
+static int register_disk(struct gendisk *disk)
 {
 	struct device *ddev = disk_to_dev(disk);
-	struct block_device *bdev;
-	struct disk_part_iter piter;
-	struct hd_struct *part;
 	int err;
 
 	ddev->parent = disk->driverfs_dev;
@@ -520,14 +520,15 @@ static void register_disk(struct gendisk *disk)
 	/* delay uevents, until we scanned partition table */
 	dev_set_uevent_suppress(ddev, 1);
     //disk->part0.devdevice/dev¿豸ڵ
-	if (device_add(ddev))
-		return;
+	err = device_add(ddev);
+	if (err)
+		return err;
 	if (!sysfs_deprecated) {
 		err = sysfs_create_link(block_depr, &ddev->kobj,
 					kobject_name(&ddev->kobj));
 		if (err) {
 			device_del(ddev);
-			return;
+			return err;
 		}
 	}
 
@@ -541,6 +542,22 @@ static void register_disk(struct gendisk *disk)
 	disk->part0.holder_dir = kobject_create_and_add("holders", &ddev->kobj);
 	disk->slave_dir = kobject_create_and_add("slaves", &ddev->kobj);
 
+	return 0;
+}
+
+/*
+ * Read the partition table of a freshly registered disk and announce the
+ * disk and its partitions to userspace, which is kept unaware of the disk
+ * until then.
+ */
+static void disk_scan_partitions(struct gendisk *disk)
+{
+	struct device *ddev = disk_to_dev(disk);
+	struct block_device *bdev;
+	struct disk_part_iter piter;
+	struct hd_struct *part;
+	int err;
+
 	/* No minors to use for partitions */
 	if (!disk_part_scan_enabled(disk))
 		goto exit;
@@ -580,6 +597,22 @@ exit:
 	disk_part_iter_exit(&piter);
 }
 
+/*
+ * Partition scans of different disks run in parallel, in a domain that
+ * async_synchronize_full() waits for, so the root device is scanned by
+ * the time it is looked up.
+ */
+static ASYNC_DOMAIN(disk_scan_domain);
+
+static void disk_scan_partitions_async(void *data, async_cookie_t cookie)
+{
+	struct gendisk *disk = data;
+
+	disk_scan_partitions(disk);
+	complete_all(&disk->scan_done);
+	put_device(disk_to_dev(disk));
+}
+
 /**
  * add_disk - add partitioning information to kernel list
  * @disk: per-device partitioning information
@@ -593,7 +626,7 @@ void add_disk(struct gendisk *disk)
 {
 	struct backing_dev_info *bdi;
 	dev_t devt;
-	int retval;
+	int retval, err;
 
 	/* minors == 0 indicates to use ext devt from part0 and should
 	 * be accompanied with EXT_DEVT flag.  Make sure all
@@ -607,6 +640,7 @@ void add_disk(struct gendisk *disk)
 	retval = blk_alloc_devt(&disk->part0, &devt);
 	if (retval) {
 		WARN_ON(1);
+		complete_all(&disk->scan_done);
 		return;
 	}
 	disk_to_dev(disk)->devt = devt;
@@ -628,7 +662,7 @@ void add_disk(struct gendisk *disk)
 	blk_register_region(disk_devt(disk), disk->minors, NULL,
 			    exact_match, exact_lock, disk);
     //mmcblk0豸ڵ㣬block_device
-	register_disk(disk);
+	err = register_disk(disk);
 	blk_register_queue(disk);
 
 	/*
@@ -642,6 +676,16 @@ void add_disk(struct gendisk *disk)
 	WARN_ON(retval);
 
 	disk_add_events(disk);
+
+	if (!err && async_part_scan) {
+		get_device(disk_to_dev(disk));
+		async_schedule_domain(disk_scan_partitions_async, disk,
+				      &disk_scan_domain);
+		return;
+	}
+	if (!err)
+		disk_scan_partitions(disk);
+	complete_all(&disk->scan_done);
 }
 EXPORT_SYMBOL(add_disk);
 
@@ -650,6 +694,12 @@ void del_gendisk(struct gendisk *disk)
 	struct disk_part_iter piter;
 	struct hd_struct *part;
 
+	/*
+	 * Don't tear down a disk whose partitions are still being read.
+	 * Only wait for this disk's scan, not for the other disks'.
+	 */
+	wait_for_completion(&disk->scan_done);
+
 	disk_del_events(disk);
 
 	/* invalidate stuff */
@@ -1306,6 +1356,7 @@ struct gendisk *alloc_disk_node(int minors, int node_id)
 		 */
 		seqcount_init(&disk->part0.nr_sects_seq);
 		hd_ref_init(&disk->part0);
+		init_completion(&disk->scan_done);
 
 		disk->minors = minors;
 		rand_initialize_disk(disk);
@@ -1791,6 +1842,8 @@ static const struct kernel_param_ops disk_events_dfl_poll_msecs_param_ops = {
 
 module_param_cb(events_dfl_poll_msecs, &disk_events_dfl_poll_msecs_param_ops,
 		&disk_events_dfl_poll_msecs, 0644);
+module_param(async_part_scan, bool, 0644);
+MODULE_PARM_DESC(async_part_scan, "Scan partitions of new disks asynchronously");
 
 /*
  * disk_{alloc|add|del|release}_events - initialize and destroy disk_events.
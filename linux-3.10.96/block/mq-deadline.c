@@ -16,6 +16,8 @@
 #include <linux/compiler.h>
 #include <linux/rbtree.h>
 #include <linux/sbitmap.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
 
 #include "blk.h"
 #include "blk-mq.h"
@@ -32,6 +34,16 @@ static const int writes_starved = 2;    /* max times reads can starve a write */
 static const int fifo_batch = 16;       /* # of sequential requests treated as one
 				     by the above parameters. For throughput. */
 
+/*
+ * Per software queue staging list. With staged_insert enabled, requests are
+ * parked here under a per-cpu lock on insert, and moved into the fifo and
+ * sort lists in one batch under dd->lock when the hardware queue is run.
+ */
+struct dd_stage {
+	spinlock_t lock;
+	struct list_head rqs;
+} ____cacheline_aligned_in_smp;
+
 struct deadline_data {//Ƕеģмdeadline-iosched.c
 	/*
 	 * run time data
@@ -58,9 +70,18 @@ struct deadline_data {//
 	int writes_starved;
 	int front_merges;//Ӧdeadline_init_queue()бֵ1
 
+	int staged_insert;
+
 	spinlock_t lock;
     //dd_insert_requestУreqӵdispatch 
 	struct list_head dispatch;
+
+	/*
+	 * staged requests, indexed by blk_mq_ctx->cpu. staged_mask has a bit
+	 * set for every cpu that may have requests waiting in its stage.
+	 */
+	struct dd_stage __percpu *stage;
+	cpumask_var_t staged_mask;
 };
 
 static inline struct rb_root *
@@ -314,6 +335,8 @@ done:
 	return rq;
 }
 
+static void dd_drain_staged(struct blk_mq_hw_ctx *hctx);
+
 static struct request *dd_dispatch_request(struct blk_mq_hw_ctx *hctx)
 {
 	struct deadline_data *dd = hctx->queue->elevator->elevator_data;
@@ -321,6 +344,9 @@ static struct request *dd_dispatch_request(struct blk_mq_hw_ctx *hctx)
 
 	spin_lock(&dd->lock);
 
+	if (!cpumask_empty(dd->staged_mask))
+		dd_drain_staged(hctx);
+
  //ִdeadline㷨ɷfifoߺѡɵreqءȻµnext_rqreqfifoкͺ޳
  //reqԴ:ϴɷõnext_rq;read reqɷѡwrite req;fifo ϳʱҪreqͳˣй̶
 	rq = __dd_dispatch_request(hctx);
@@ -336,6 +362,10 @@ static void dd_exit_queue(struct elevator_queue *e)
 	BUG_ON(!list_empty(&dd->fifo_list[READ]));
 	BUG_ON(!list_empty(&dd->fifo_list[WRITE]));
 
+	WARN_ON_ONCE(!cpumask_empty(dd->staged_mask));
+
+	free_cpumask_var(dd->staged_mask);
+	free_percpu(dd->stage);
 	kfree(dd);
 }
 
@@ -346,15 +376,26 @@ static int dd_init_queue(struct request_queue *q, struct elevator_type *e)
 {
 	struct deadline_data *dd;
 	struct elevator_queue *eq;
+	int cpu;
 
 	eq = elevator_alloc(q, e);
 	if (!eq)
 		return -ENOMEM;
 
 	dd = kzalloc_node(sizeof(*dd), GFP_KERNEL, q->node);
-	if (!dd) {
-		kobject_put(&eq->kobj);
-		return -ENOMEM;
+	if (!dd)
+		goto put_eq;
+
+	dd->stage = alloc_percpu(struct dd_stage);
+	if (!dd->stage)
+		goto free_dd;
+	if (!zalloc_cpumask_var(&dd->staged_mask, GFP_KERNEL))
+		goto free_stage;
+	for_each_possible_cpu(cpu) {
+		struct dd_stage *stage = per_cpu_ptr(dd->stage, cpu);
+
+		spin_lock_init(&stage->lock);
+		INIT_LIST_HEAD(&stage->rqs);
 	}
 	eq->elevator_data = dd;
 
@@ -372,6 +413,14 @@ static int dd_init_queue(struct request_queue *q, struct elevator_type *e)
 
 	q->elevator = eq;
 	return 0;
+
+free_stage:
+	free_percpu(dd->stage);
+free_dd:
+	kfree(dd);
+put_eq:
+	kobject_put(&eq->kobj);
+	return -ENOMEM;
 }
 
 static int dd_request_merge(struct request_queue *q, struct request **rq,
@@ -468,12 +517,70 @@ static void dd_insert_request(struct blk_mq_hw_ctx *hctx, struct request *rq,
 	}
 }
 
+/*
+ * Park the requests on the staging list of the software queue they came
+ * from. Only the per-cpu stage lock is taken here, the merge into the
+ * deadline lists is done by dd_drain_staged() at dispatch time.
+ */
+static void dd_stage_requests(struct deadline_data *dd, struct list_head *list)
+{
+	struct request *rq = list_first_entry(list, struct request, queuelist);
+	unsigned int cpu = rq->mq_ctx->cpu;
+	struct dd_stage *stage = per_cpu_ptr(dd->stage, cpu);
+
+	spin_lock(&stage->lock);
+	list_splice_tail_init(list, &stage->rqs);
+	spin_unlock(&stage->lock);
+
+	/*
+	 * Publish after the requests are visible on the stage, so a drainer
+	 * that clears the bit is guaranteed to find them.
+	 */
+	if (!cpumask_test_cpu(cpu, dd->staged_mask))
+		cpumask_set_cpu(cpu, dd->staged_mask);
+}
+
+/*
+ * Move everything parked on the staging lists into the fifo and sort lists.
+ * Called with dd->lock held.
+ */
+static void dd_drain_staged(struct blk_mq_hw_ctx *hctx)
+{
+	struct deadline_data *dd = hctx->queue->elevator->elevator_data;
+	LIST_HEAD(rq_list);
+	int cpu;
+
+	for_each_cpu(cpu, dd->staged_mask) {
+		struct dd_stage *stage = per_cpu_ptr(dd->stage, cpu);
+
+		if (!cpumask_test_and_clear_cpu(cpu, dd->staged_mask))
+			continue;
+
+		spin_lock(&stage->lock);
+		list_splice_tail_init(&stage->rqs, &rq_list);
+		spin_unlock(&stage->lock);
+	}
+
+	while (!list_empty(&rq_list)) {
+		struct request *rq;
+
+		rq = list_first_entry(&rq_list, struct request, queuelist);
+		list_del_init(&rq->queuelist);
+		dd_insert_request(hctx, rq, false);
+	}
+}
+
 static void dd_insert_requests(struct blk_mq_hw_ctx *hctx,
 			       struct list_head *list, bool at_head)//at_head:false
 {
 	struct request_queue *q = hctx->queue;
 	struct deadline_data *dd = q->elevator->elevator_data;
 
+	if (dd->staged_insert && !at_head) {
+		dd_stage_requests(dd, list);
+		return;
+	}
+
 	spin_lock(&dd->lock);
     //αǰplug->mq_listϵreq,
 	while (!list_empty(list)) {
@@ -495,7 +602,8 @@ static bool dd_has_work(struct blk_mq_hw_ctx *hctx)
     //reqҪʱ1
 	return !list_empty_careful(&dd->dispatch) ||
 		!list_empty_careful(&dd->fifo_list[0]) ||
-		!list_empty_careful(&dd->fifo_list[1]);
+		!list_empty_careful(&dd->fifo_list[1]) ||
+		!cpumask_empty(dd->staged_mask);
 }
 
 /*
@@ -530,6 +638,7 @@ SHOW_FUNCTION(deadline_write_expire_show, dd->fifo_expire[WRITE], 1);
 SHOW_FUNCTION(deadline_writes_starved_show, dd->writes_starved, 0);
 SHOW_FUNCTION(deadline_front_merges_show, dd->front_merges, 0);
 SHOW_FUNCTION(deadline_fifo_batch_show, dd->fifo_batch, 0);
+SHOW_FUNCTION(deadline_staged_insert_show, dd->staged_insert, 0);
 #undef SHOW_FUNCTION
 
 #define STORE_FUNCTION(__FUNC, __PTR, MIN, MAX, __CONV)			\
@@ -553,6 +662,7 @@ STORE_FUNCTION(deadline_write_expire_store, &dd->fifo_expire[WRITE], 0, INT_MAX,
 STORE_FUNCTION(deadline_writes_starved_store, &dd->writes_starved, INT_MIN, INT_MAX, 0);
 STORE_FUNCTION(deadline_front_merges_store, &dd->front_merges, 0, 1, 0);
 STORE_FUNCTION(deadline_fifo_batch_store, &dd->fifo_batch, 0, INT_MAX, 0);
+STORE_FUNCTION(deadline_staged_insert_store, &dd->staged_insert, 0, 1, 0);
 #undef STORE_FUNCTION
 
 #define DD_ATTR(name) \
@@ -565,6 +675,7 @@ static struct elv_fs_entry deadline_attrs[] = {
 	DD_ATTR(writes_starved),
 	DD_ATTR(front_merges),
 	DD_ATTR(fifo_batch),
+	DD_ATTR(staged_insert),
 	__ATTR_NULL
 };
 
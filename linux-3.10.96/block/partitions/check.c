@@ -17,6 +17,8 @@
 #include <linux/vmalloc.h>
 #include <linux/ctype.h>
 #include <linux/genhd.h>
+#include <linux/crc32.h>
+#include <linux/module.h>
 
 #include "check.h"
 
@@ -107,6 +109,105 @@ static int (*check_part[])(struct parsed_partitions *) = {
 	NULL
 };
 
+/*
+ * Layout cache.  Many of the disks found at boot are further paths to a
+ * LUN already scanned, and rescans mostly find the label unchanged.  For
+ * each disk signature, a CRC of the first PART_CACHE_SECTORS sectors plus
+ * the capacity and sector size, remember which parser recognized the
+ * disk.  A disk with a known signature tries that parser alone first and
+ * falls back to probing everything if it no longer matches.  Several
+ * parsers look beyond the signed area (ultrix around sector 31, the
+ * alternate GPT header and LDM at the end of the disk), so the signature
+ * can't tell that such a disk is still unpartitioned: negative results
+ * are never cached, a disk nobody recognized is always fully probed.
+ */
+#define PART_CACHE_SECTORS	16
+#define PART_CACHE_ENTRIES	64
+
+struct part_cache_entry {
+	u32		crc;
+	sector_t	capacity;
+	unsigned int	sector_size;
+	int		parser;		/* check_part[] index */
+};
+
+static struct part_cache_entry part_cache[PART_CACHE_ENTRIES];
+static unsigned int part_cache_nr, part_cache_next;
+static DEFINE_SPINLOCK(part_cache_lock);
+
+static bool part_scan_cache = true;
+#undef MODULE_PARAM_PREFIX
+#define MODULE_PARAM_PREFIX	"block."
+module_param(part_scan_cache, bool, 0644);
+MODULE_PARM_DESC(part_scan_cache, "Remember partition table layouts by disk signature");
+
+static bool part_cache_signature(struct parsed_partitions *state,
+				 struct part_cache_entry *sig)
+{
+	Sector sect;
+	sector_t n;
+	u32 crc = ~0;
+
+	if (get_capacity(state->bdev->bd_disk) < PART_CACHE_SECTORS)
+		return false;
+
+	for (n = 0; n < PART_CACHE_SECTORS; n++) {
+		unsigned char *data = read_part_sector(state, n, &sect);
+
+		if (!data)
+			return false;
+		crc = crc32_le(crc, data, 512);
+		put_dev_sector(sect);
+	}
+
+	sig->crc = crc;
+	sig->capacity = get_capacity(state->bdev->bd_disk);
+	sig->sector_size = bdev_logical_block_size(state->bdev);
+	return true;
+}
+
+static bool part_cache_lookup(struct part_cache_entry *sig)
+{
+	unsigned int i;
+	bool found = false;
+
+	spin_lock(&part_cache_lock);
+	for (i = 0; i < part_cache_nr; i++) {
+		struct part_cache_entry *e = &part_cache[i];
+
+		if (e->crc == sig->crc && e->capacity == sig->capacity &&
+		    e->sector_size == sig->sector_size) {
+			sig->parser = e->parser;
+			found = true;
+			break;
+		}
+	}
+	spin_unlock(&part_cache_lock);
+	return found;
+}
+
+static void part_cache_insert(struct part_cache_entry *sig)
+{
+	unsigned int i;
+
+	spin_lock(&part_cache_lock);
+	for (i = 0; i < part_cache_nr; i++) {
+		struct part_cache_entry *e = &part_cache[i];
+
+		if (e->crc == sig->crc && e->capacity == sig->capacity &&
+		    e->sector_size == sig->sector_size)
+			break;
+	}
+	if (i == part_cache_nr) {
+		if (part_cache_nr < PART_CACHE_ENTRIES)
+			part_cache_nr++;
+		else
+			i = part_cache_next++ % PART_CACHE_ENTRIES;
+	}
+	part_cache[i] = *sig;
+	spin_unlock(&part_cache_lock);
+}
+
 static struct parsed_partitions *allocate_partitions(struct gendisk *hd)
 {
 	struct parsed_partitions *state;
@@ -138,6 +239,8 @@ struct parsed_partitions *
 check_partition(struct gendisk *hd, struct block_device *bdev)
 {
 	struct parsed_partitions *state;
+	struct part_cache_entry sig;
+	bool cached;
 	int i, res, err;
 
 	state = allocate_partitions(hd);
@@ -157,6 +260,19 @@ check_partition(struct gendisk *hd, struct block_device *bdev)
 		sprintf(state->name, "p");
 
 	i = res = err = 0;
+
+	cached = part_scan_cache && part_cache_signature(state, &sig);
+	if (cached && part_cache_lookup(&sig)) {
+		size_t len = strlen(state->pp_buf);
+
+		res = check_part[sig.parser](state);
+		if (res > 0)
+			goto found;
+		/* the label beyond the signed area changed, probe everything */
+		state->pp_buf[len] = '\0';
+		res = 0;
+	}
+
 	while (!res && check_part[i]) {
 		memset(state->parts, 0, state->limit * sizeof(state->parts[0]));
 		res = check_part[i++](state);
@@ -169,7 +285,12 @@ check_partition(struct gendisk *hd, struct block_device *bdev)
 		}
 
 	}
+	if (cached && res > 0 && !err && !state->access_beyond_eod) {
+		sig.parser = i - 1;
+		part_cache_insert(&sig);
+	}
 	if (res > 0) {
+found:
 		printk(KERN_INFO "%s", state->pp_buf);
 
 		free_page((unsigned long)state->pp_buf);
@@ -35,6 +35,12 @@
 #include <linux/eventfd.h>
 #include <linux/blkdev.h>
 #include <linux/compat.h>
+#include <linux/kthread.h>
+#include <linux/fdtable.h>
+#include <linux/poll.h>
+#include <linux/log2.h>
+#include <linux/cred.h>
+#include <linux/pagemap.h>
 
 #include <asm/kmap_types.h>
 #include <asm/uaccess.h>
@@ -67,6 +73,12 @@ struct kioctx {
 	unsigned long		user_id;
 	struct hlist_node	list;
 
+	/*
+	 * Owner mm, mm_count reference only.  Work done on behalf of the
+	 * context outside the submitting task borrows it with use_mm().
+	 */
+	struct mm_struct	*mm;
+
 	/*
 	 * This is what userspace passed to io_setup(), it's not used for
 	 * anything but counting against the global max_reqs quota.
@@ -108,8 +120,70 @@ struct kioctx {
 	} ____cacheline_aligned_in_smp;
 
 	struct page		*internal_pages[AIO_RING_PAGES];
+
+	/*
+	 * Submission ring, only set up by io_ring_setup().  The completion
+	 * side is the regular aio_ring above.
+	 */
+	struct {
+		struct page	**sq_pages;
+		long		sq_nr_pages;
+		unsigned	sq_entries;	/* trusted copy, power of 2 */
+		unsigned	sq_head;	/* trusted copy */
+		unsigned long	sq_mmap_base;
+		unsigned long	sq_mmap_size;
+		struct mutex	sq_lock;
+		bool		sq_compat;
+
+		/*
+		 * Context the deferred work and the SQPOLL thread submit
+		 * from: the files of the creator (SQPOLL only) and its
+		 * credentials.
+		 */
+		struct files_struct	*sq_files;
+		const struct cred	*sq_creds;
+		struct task_struct	*sq_thread;
+		wait_queue_head_t	sq_wait;	/* SQPOLL thread sleeps here */
+		unsigned long		sq_idle;	/* jiffies */
+		unsigned long		sq_rlim_fsize;	/* the creator's */
+		atomic_t		sq_punted;	/* requests in aio_wq */
+	} ____cacheline_aligned_in_smp;
+
+	/*
+	 * Buffers and files registered with io_ring_register().  Submitters
+	 * hold reg_sem for read while looking them up, so the sets only
+	 * change with no submission in progress and no request counted in
+	 * reg_inflight.
+	 */
+	struct {
+		struct rw_semaphore	reg_sem;
+		atomic_t		reg_inflight;
+		struct aio_mapped_buf	*bufs;
+		unsigned		nr_bufs;
+		/* pinned pages charged to the registering user's locked_vm */
+		struct user_struct	*bufs_user;
+		unsigned long		bufs_locked;
+		struct file		**files;
+		unsigned		nr_files;
+	} ____cacheline_aligned_in_smp;
 };
 
+/*
+ * A user buffer pinned by IORING_REGISTER_BUFFERS.
+ */
+struct aio_mapped_buf {
+	unsigned long		ubuf;
+	size_t			len;
+	struct page		**pages;
+	unsigned		nr_pages;
+};
+
+#define IORING_MAX_ENTRIES	4096
+#define IORING_MAX_FIXED_BUFS	1024
+#define IORING_MAX_FIXED_FILES	1024
+#define IORING_MAX_FIXED_BUF_SIZE	(1UL << 30)
+#define IORING_MAX_PUNTED	16
+
 /*------ sysctl variables----*/
 static DEFINE_SPINLOCK(aio_nr_lock);
 unsigned long aio_nr;		/* current system wide number of aio requests */
@@ -119,6 +193,9 @@ unsigned long aio_max_nr = 0x10000; /* system wide maximum number of aio request
 static struct kmem_cache	*kiocb_cachep;
 static struct kmem_cache	*kioctx_cachep;
 
+/* buffered ring I/O and poll wakeups are processed here */
+static struct workqueue_struct	*aio_wq;
+
 /* aio_setup
  *	Creates the slab caches used by the aio routines, panic on
  *	failure as this is done early during the boot sequence.
@@ -127,6 +204,9 @@ static int __init aio_setup(void)
 {
 	kiocb_cachep = KMEM_CACHE(kiocb, SLAB_HWCACHE_ALIGN|SLAB_PANIC);
 	kioctx_cachep = KMEM_CACHE(kioctx,SLAB_HWCACHE_ALIGN|SLAB_PANIC);
+	aio_wq = alloc_workqueue("aio", WQ_UNBOUND, 0);
+	if (!aio_wq)
+		panic("aio: failed to create workqueue\n");
 
 	pr_debug("sizeof(struct page) = %zu\n", sizeof(struct page));
 
@@ -216,6 +296,138 @@ static int aio_setup_ring(struct kioctx *ctx)
 	return 0;
 }
 
+static void aio_release_buffers(struct aio_mapped_buf *bufs, unsigned nr)
+{
+	unsigned i, j;
+
+	for (i = 0; i < nr; i++) {
+		for (j = 0; j < bufs[i].nr_pages; j++) {
+			set_page_dirty_lock(bufs[i].pages[j]);
+			put_page(bufs[i].pages[j]);
+		}
+		kfree(bufs[i].pages);
+	}
+	kfree(bufs);
+}
+
+/*
+ * Charge pages pinned by IORING_REGISTER_BUFFERS to the user's
+ * locked_vm against RLIMIT_MEMLOCK, across all of the user's contexts.
+ */
+static int aio_account_locked(struct user_struct *user, unsigned long nr_pages)
+{
+	unsigned long limit = rlimit(RLIMIT_MEMLOCK) >> PAGE_SHIFT;
+
+	if (atomic_long_add_return(nr_pages, &user->locked_vm) > limit &&
+	    !capable(CAP_IPC_LOCK)) {
+		atomic_long_sub(nr_pages, &user->locked_vm);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static void aio_unregister_buffers(struct kioctx *ctx)
+{
+	aio_release_buffers(ctx->bufs, ctx->nr_bufs);
+	ctx->bufs = NULL;
+	ctx->nr_bufs = 0;
+
+	if (ctx->bufs_user) {
+		atomic_long_sub(ctx->bufs_locked, &ctx->bufs_user->locked_vm);
+		free_uid(ctx->bufs_user);
+		ctx->bufs_user = NULL;
+		ctx->bufs_locked = 0;
+	}
+}
+
+static void aio_release_files(struct file **files, unsigned nr)
+{
+	unsigned i;
+
+	for (i = 0; i < nr; i++)
+		if (files[i])
+			fput(files[i]);
+	kfree(files);
+}
+
+static void aio_free_sq_ring(struct kioctx *ctx)
+{
+	long i;
+
+	for (i = 0; i < ctx->sq_nr_pages; i++)
+		put_page(ctx->sq_pages[i]);
+	kfree(ctx->sq_pages);
+
+	if (ctx->sq_thread)
+		put_task_struct(ctx->sq_thread);
+	if (ctx->sq_files)
+		put_files_struct(ctx->sq_files);
+	if (ctx->sq_creds)
+		put_cred(ctx->sq_creds);
+}
+
+/*
+ * Map the submission ring the same way aio_setup_ring() maps the
+ * completion ring: anonymous memory in the caller's mm, pinned for the
+ * lifetime of the context so the kernel can read it from any context.
+ * The context isn't inherited across fork(), so neither is the ring:
+ * a private copy in the child would only take COW faults away from the
+ * pages the kernel reads.
+ */
+static int aio_setup_sq_ring(struct kioctx *ctx, unsigned entries)
+{
+	struct aio_sq_ring *ring;
+	struct mm_struct *mm = current->mm;
+	struct vm_area_struct *vma;
+	unsigned long size, populate;
+	int nr_pages;
+
+	size = sizeof(struct aio_sq_ring) + sizeof(struct iocb) * entries;
+	nr_pages = PFN_UP(size);
+
+	ctx->sq_pages = kcalloc(nr_pages, sizeof(struct page *), GFP_KERNEL);
+	if (!ctx->sq_pages)
+		return -ENOMEM;
+
+	ctx->sq_mmap_size = nr_pages * PAGE_SIZE;
+	down_write(&mm->mmap_sem);
+	ctx->sq_mmap_base = do_mmap_pgoff(NULL, 0, ctx->sq_mmap_size,
+					  PROT_READ|PROT_WRITE,
+					  MAP_ANONYMOUS|MAP_PRIVATE, 0,
+					  &populate);
+	if (IS_ERR((void *)ctx->sq_mmap_base)) {
+		up_write(&mm->mmap_sem);
+		ctx->sq_mmap_size = 0;
+		return -EAGAIN;
+	}
+	vma = find_vma(mm, ctx->sq_mmap_base);
+	if (vma)
+		vma->vm_flags |= VM_DONTCOPY;
+
+	ctx->sq_nr_pages = get_user_pages(current, mm, ctx->sq_mmap_base,
+					  nr_pages, 1, 0, ctx->sq_pages, NULL);
+	up_write(&mm->mmap_sem);
+
+	if (unlikely(ctx->sq_nr_pages != nr_pages))
+		return -EAGAIN;
+	if (populate)
+		mm_populate(ctx->sq_mmap_base, populate);
+
+	ctx->sq_entries = entries;
+	mutex_init(&ctx->sq_lock);
+
+	ring = kmap_atomic(ctx->sq_pages[0]);
+	memset(ring, 0, sizeof(*ring));
+	ring->mask = entries - 1;
+	ring->entries = entries;
+	ring->magic = AIO_SQ_RING_MAGIC;
+	ring->header_length = sizeof(struct aio_sq_ring);
+	kunmap_atomic(ring);
+	flush_dcache_page(ctx->sq_pages[0]);
+
+	return 0;
+}
+
 #define AIO_EVENTS_PER_PAGE	(PAGE_SIZE / sizeof(struct io_event))
 #define AIO_EVENTS_FIRST_PAGE	((PAGE_SIZE - sizeof(struct aio_ring)) / sizeof(struct io_event))
 #define AIO_EVENTS_OFFSET	(AIO_EVENTS_PER_PAGE - AIO_EVENTS_FIRST_PAGE)
@@ -317,6 +529,10 @@ static void free_ioctx(struct kioctx *ctx)
 	WARN_ON(atomic_read(&ctx->reqs_active) < 0);
 
 	aio_free_ring(ctx);
+	aio_free_sq_ring(ctx);
+	aio_unregister_buffers(ctx);
+	aio_release_files(ctx->files, ctx->nr_files);
+	mmdrop(ctx->mm);
 
 	pr_debug("freeing %p\n", ctx);
 
@@ -360,6 +576,8 @@ static struct kioctx *ioctx_alloc(unsigned nr_events)
 		return ERR_PTR(-ENOMEM);
 
 	ctx->max_reqs = nr_events;
+	ctx->mm = mm;
+	atomic_inc(&mm->mm_count);
 
 	atomic_set(&ctx->users, 2);
 	atomic_set(&ctx->dead, 0);
@@ -367,6 +585,8 @@ static struct kioctx *ioctx_alloc(unsigned nr_events)
 	spin_lock_init(&ctx->completion_lock);
 	mutex_init(&ctx->ring_lock);
 	init_waitqueue_head(&ctx->wait);
+	init_rwsem(&ctx->reg_sem);
+	atomic_set(&ctx->reg_inflight, 0);
 
 	INIT_LIST_HEAD(&ctx->active_reqs);
 
@@ -396,6 +616,7 @@ out_cleanup:
 	err = -EAGAIN;
 	aio_free_ring(ctx);
 out_freectx:
+	mmdrop(mm);
 	kmem_cache_free(kioctx_cachep, ctx);
 	pr_debug("error allocating ioctx %d\n", err);
 	return ERR_PTR(err);
@@ -443,6 +664,12 @@ static void kill_ioctx(struct mm_struct *mm, struct kioctx *ctx)
 
 		if (ctx->mmap_size)
 			vm_munmap(ctx->mmap_base, ctx->mmap_size);
+		if (ctx->sq_mmap_size)
+			vm_munmap(ctx->sq_mmap_base, ctx->sq_mmap_size);
+
+		/* the SQPOLL thread notices ->dead and drops its reference */
+		if (ctx->sq_thread)
+			wake_up(&ctx->sq_wait);
 
 		/* Between hlist_del_rcu() and dropping the initial ref */
 		call_rcu(&ctx->rcu_head, kill_ioctx_rcu);
@@ -494,6 +721,7 @@ void exit_aio(struct mm_struct *mm)
 		 * place that uses ->mmap_size, so it's safe.
 		 */
 		ctx->mmap_size = 0;
+		ctx->sq_mmap_size = 0;
 
 		kill_ioctx(mm, ctx);
 	}
@@ -534,7 +762,7 @@ out_put:
 
 static void kiocb_free(struct kiocb *req)
 {
-	if (req->ki_filp)
+	if (req->ki_filp && !(req->ki_flags & KIOCB_F_FIXED_FILE))
 		fput(req->ki_filp);
 	if (req->ki_eventfd != NULL)
 		eventfd_ctx_put(req->ki_eventfd);
@@ -597,6 +825,12 @@ void aio_complete(struct kiocb *iocb, long res, long res2)
 		return;
 	}
 
+	/* the registered buffer and file are not touched past this point */
+	if (iocb->ki_flags & KIOCB_F_FIXED_REF) {
+		iocb->ki_flags &= ~KIOCB_F_FIXED_REF;
+		atomic_dec(&ctx->reg_inflight);
+	}
+
 	/*
 	 * Take rcu_read_lock() in case the kioctx is being destroyed, as we
 	 * need to issue a wakeup after decrementing reqs_active.
@@ -977,7 +1211,9 @@ static ssize_t aio_setup_vectored_rw(int rw, struct kiocb *kiocb, bool compat)
 
 static ssize_t aio_setup_single_vector(int rw, struct kiocb *kiocb)
 {
-	if (unlikely(!access_ok(!rw, kiocb->ki_buf, kiocb->ki_nbytes)))
+	/* registered buffers were range checked in aio_prep_req() */
+	if (unlikely(!(kiocb->ki_flags & KIOCB_F_FIXED_BUF) &&
+		     !access_ok(!rw, kiocb->ki_buf, kiocb->ki_nbytes)))
 		return -EFAULT;
 
 	kiocb->ki_iovec = &kiocb->ki_inline_vec;
@@ -988,188 +1224,903 @@ static ssize_t aio_setup_single_vector(int rw, struct kiocb *kiocb)
 }
 
 /*
- * aio_setup_iocb:
- *	Performs the initial checks and aio retry method
- *	setup for the kiocb at the time of io submission.
+ * IOCB_CMD_POLL: one shot poll of a single file for the events in
+ * aio_buf, completing with the ready mask.  The wakeup callback runs
+ * under the waitqueue lock, so it only dequeues itself and leaves the
+ * re-poll and the completion to aio_wq.  The state hangs off ki_poll
+ * rather than ->private: the ring's nonblocking reads and writes are
+ * built on this too (see aio_rw_nowait()), and ->aio_read and
+ * ->aio_write may use ->private.
+ *
+ * At any time a single context owns the request, the one holding
+ * AIO_POLL_OWNED: the submitter while it arms it, then aio_wq.  Only
+ * the owner re-arms or completes it.  A wakeup or a cancel that takes
+ * the entry off the waitqueue hands the request to aio_wq if it can
+ * take the bit; if it can't, the owner is still arming and notices the
+ * entry is gone before it lets go of the bit under the waitqueue lock.
  */
-static ssize_t aio_run_iocb(struct kiocb *req, bool compat)
-{
-	struct file *file = req->ki_filp;
-	ssize_t ret;
-	int rw;
-	fmode_t mode;
-	aio_rw_op *rw_op;
-
-	switch (req->ki_opcode) {
-	case IOCB_CMD_PREAD:
-	case IOCB_CMD_PREADV:
-		mode	= FMODE_READ;
-		rw	= READ;
-		rw_op	= file->f_op->aio_read;
-		goto rw_common;
-
-	case IOCB_CMD_PWRITE:
-	case IOCB_CMD_PWRITEV:
-		mode	= FMODE_WRITE;
-		rw	= WRITE;
-		rw_op	= file->f_op->aio_write;
-		goto rw_common;
-rw_common:
-		if (unlikely(!(file->f_mode & mode)))
-			return -EBADF;
-
-		if (!rw_op)
-			return -EINVAL;
+#define AIO_POLL_OWNED		0
+
+struct aio_poll {
+	struct kiocb		*req;
+	wait_queue_head_t	*head;
+	wait_queue_t		wait;
+	unsigned		events;
+	unsigned long		flags;
+	/* aio_rw_nowait() only: the I/O to retry once ready */
+	aio_rw_op		*rw_op;
+	int			rw;
+};
 
-		ret = (req->ki_opcode == IOCB_CMD_PREADV ||
-		       req->ki_opcode == IOCB_CMD_PWRITEV)
-			? aio_setup_vectored_rw(rw, req, compat)
-			: aio_setup_single_vector(rw, req);
-		if (ret)
-			return ret;
+struct aio_poll_table {
+	struct poll_table_struct pt;
+	struct aio_poll		*apoll;
+	int			error;
+};
 
-		ret = rw_verify_area(rw, file, &req->ki_pos, req->ki_nbytes);
-		if (ret < 0)
-			return ret;
+static bool aio_poll_unqueue(struct aio_poll *apoll)
+{
+	wait_queue_head_t *head = ACCESS_ONCE(apoll->head);
+	unsigned long flags;
+	bool queued = false;
 
-		req->ki_nbytes = ret;
-		req->ki_left = ret;
+	if (head) {
+		spin_lock_irqsave(&head->lock, flags);
+		if (!list_empty(&apoll->wait.task_list)) {
+			list_del_init(&apoll->wait.task_list);
+			queued = true;
+		}
+		spin_unlock_irqrestore(&head->lock, flags);
+	}
+	return queued;
+}
 
-		ret = aio_rw_vect_retry(req, rw, rw_op);
-		break;
+/* Hand the request to aio_wq, unless its owner is still arming it */
+static void aio_poll_schedule(struct aio_poll *apoll)
+{
+	if (!test_and_set_bit(AIO_POLL_OWNED, &apoll->flags))
+		queue_work(aio_wq, &apoll->req->ki_work);
+}
 
-	case IOCB_CMD_FDSYNC:
-		if (!file->f_op->aio_fsync)
-			return -EINVAL;
+static int aio_poll_wake(wait_queue_t *wait, unsigned mode, int sync,
+			 void *key)
+{
+	struct aio_poll *apoll = container_of(wait, struct aio_poll, wait);
+	unsigned long mask = (unsigned long) key;
 
-		ret = file->f_op->aio_fsync(req, 1);
-		break;
+	if (mask && !(mask & apoll->events))
+		return 0;
 
-	case IOCB_CMD_FSYNC:
-		if (!file->f_op->aio_fsync)
-			return -EINVAL;
+	list_del_init(&wait->task_list);
+	aio_poll_schedule(apoll);
+	return 1;
+}
 
-		ret = file->f_op->aio_fsync(req, 0);
-		break;
+static void aio_poll_queue_proc(struct file *file, wait_queue_head_t *head,
+				poll_table *pt)
+{
+	struct aio_poll_table *apt = container_of(pt, struct aio_poll_table, pt);
+	struct aio_poll *apoll = apt->apoll;
 
-	default:
-		pr_debug("EINVAL: no operation provided\n");
-		return -EINVAL;
+	/* only a single waitqueue is supported */
+	if (apoll->head) {
+		apt->error = -EINVAL;
+		return;
 	}
+	apoll->head = head;
+	add_wait_queue(head, &apoll->wait);
+}
+
+/*
+ * Called by the owner of the request.  Returns -EIOCBQUEUED once armed,
+ * ownership given up, otherwise the result to complete the request with.
+ */
+static long aio_poll_arm(struct kiocb *req)
+{
+	struct aio_poll *apoll = req->ki_poll;
+	struct file *file = req->ki_filp;
+	struct aio_poll_table apt;
+	wait_queue_head_t *head;
+	unsigned mask;
+
+	for (;;) {
+		apoll->head = NULL;
+		init_waitqueue_func_entry(&apoll->wait, aio_poll_wake);
+		init_poll_funcptr(&apt.pt, aio_poll_queue_proc);
+		apt.apoll = apoll;
+		apt.error = 0;
+
+		mask = file->f_op->poll(file, &apt.pt) & apoll->events;
+		head = apoll->head;
+		if (!head)
+			return mask;
+		if (mask || apt.error)
+			break;
 
-	if (ret != -EIOCBQUEUED) {
 		/*
-		 * There's no easy way to restart the syscall since other AIO's
-		 * may be already running. Just fail this IO with EINTR.
+		 * Let go of the request if it is still queued and wasn't
+		 * cancelled.  Both checks and the release happen under the
+		 * waitqueue lock, so a wakeup can't slip in between; once
+		 * it is dropped the request mustn't be touched anymore.
 		 */
-		if (unlikely(ret == -ERESTARTSYS || ret == -ERESTARTNOINTR ||
-			     ret == -ERESTARTNOHAND ||
-			     ret == -ERESTART_RESTARTBLOCK))
-			ret = -EINTR;
-		aio_complete(req, ret, 0);
+		spin_lock_irq(&head->lock);
+		if (!list_empty(&apoll->wait.task_list) &&
+		    ACCESS_ONCE(req->ki_cancel) != KIOCB_CANCELLED) {
+			clear_bit_unlock(AIO_POLL_OWNED, &apoll->flags);
+			spin_unlock_irq(&head->lock);
+			return -EIOCBQUEUED;
+		}
+		spin_unlock_irq(&head->lock);
+
+		if (ACCESS_ONCE(req->ki_cancel) == KIOCB_CANCELLED)
+			break;
+		/* woken up while arming, poll again */
 	}
 
-	return 0;
+	aio_poll_unqueue(apoll);
+	if (apt.error)
+		return apt.error;
+	return mask ? mask : -ECANCELED;
 }
 
-static int io_submit_one(struct kioctx *ctx, struct iocb __user *user_iocb,
-			 struct iocb *iocb, bool compat)
+static void aio_poll_work(struct work_struct *work)
 {
-	struct kiocb *req;
-	ssize_t ret;
+	struct kiocb *req = container_of(work, struct kiocb, ki_work);
+	long ret;
 
-	/* enforce forwards compatibility on users */
-	if (unlikely(iocb->aio_reserved1 || iocb->aio_reserved2)) {
-		pr_debug("EINVAL: reserve field set\n");
-		return -EINVAL;
-	}
+	if (ACCESS_ONCE(req->ki_cancel) == KIOCB_CANCELLED) {
+		aio_poll_unqueue(req->ki_poll);
+		ret = -ECANCELED;
+	} else
+		ret = aio_poll_arm(req);
 
-	/* prevent overflows */
-	if (unlikely(
-	    (iocb->aio_buf != (unsigned long)iocb->aio_buf) ||
-	    (iocb->aio_nbytes != (size_t)iocb->aio_nbytes) ||
-	    ((ssize_t)iocb->aio_nbytes < 0)
-	   )) {
-		pr_debug("EINVAL: io_submit: overflow check\n");
-		return -EINVAL;
-	}
+	if (ret != -EIOCBQUEUED)
+		aio_complete(req, ret, 0);
+}
 
-	req = aio_get_req(ctx);
-	if (unlikely(!req))
-		return -EAGAIN;
+static int aio_poll_cancel(struct kiocb *req, struct io_event *res)
+{
+	struct aio_poll *apoll = req->ki_poll;
 
-	req->ki_filp = fget(iocb->aio_fildes);
-	if (unlikely(!req->ki_filp)) {
-		ret = -EBADF;
-		goto out_put_req;
-	}
+	/*
+	 * If the request is armed, take it off the waitqueue and let aio_wq
+	 * complete it.  Otherwise its owner sees KIOCB_CANCELLED.
+	 */
+	if (aio_poll_unqueue(apoll))
+		aio_poll_schedule(apoll);
 
-	if (iocb->aio_flags & IOCB_FLAG_RESFD) {
-		/*
-		 * If the IOCB_FLAG_RESFD flag of aio_flags is set, get an
-		 * instance of the file* now. The file descriptor must be
-		 * an eventfd() fd, and will be signaled for each completed
-		 * event using the eventfd_signal() function.
-		 */
-		req->ki_eventfd = eventfd_ctx_fdget((int) iocb->aio_resfd);
-		if (IS_ERR(req->ki_eventfd)) {
-			ret = PTR_ERR(req->ki_eventfd);
-			req->ki_eventfd = NULL;
-			goto out_put_req;
-		}
-	}
+	res->res = -ECANCELED;
+	return 0;
+}
 
-	ret = put_user(KIOCB_KEY, &user_iocb->aio_key);
-	if (unlikely(ret)) {
-		pr_debug("EFAULT: aio_key\n");
-		goto out_put_req;
-	}
+static void aio_private_dtor(struct kiocb *req)
+{
+	kfree(req->private);
+}
 
-	req->ki_obj.user = user_iocb;
-	req->ki_user_data = iocb->aio_data;
-	req->ki_pos = iocb->aio_offset;
+static void aio_poll_dtor(struct kiocb *req)
+{
+	kfree(req->ki_poll);
+}
 
-	req->ki_buf = (char __user *)(unsigned long)iocb->aio_buf;
-	req->ki_left = req->ki_nbytes = iocb->aio_nbytes;
-	req->ki_opcode = iocb->aio_lio_opcode;
+static struct aio_poll *aio_poll_alloc(struct kiocb *req, unsigned events,
+				       work_func_t func)
+{
+	struct aio_poll *apoll;
 
-	ret = aio_run_iocb(req, compat);
-	if (ret)
-		goto out_put_req;
+	apoll = kzalloc(sizeof(*apoll), GFP_KERNEL);
+	if (!apoll)
+		return NULL;
 
-	aio_put_req(req);	/* drop extra ref to req */
-	return 0;
-out_put_req:
-	atomic_dec(&ctx->reqs_active);
-	aio_put_req(req);	/* drop extra ref to req */
-	aio_put_req(req);	/* drop i/o ref to req */
-	return ret;
+	apoll->req = req;
+	apoll->events = events | POLLERR | POLLHUP;
+	/* the submitter owns the request until it is armed */
+	set_bit(AIO_POLL_OWNED, &apoll->flags);
+	req->ki_poll = apoll;
+	req->ki_dtor = aio_poll_dtor;
+	INIT_WORK(&req->ki_work, func);
+	kiocb_set_cancel_fn(req, aio_poll_cancel);
+	return apoll;
 }
 
-long do_io_submit(aio_context_t ctx_id, long nr,
-		  struct iocb __user *__user *iocbpp, bool compat)
+static ssize_t aio_poll(struct kiocb *req)
 {
-	struct kioctx *ctx;
-	long ret = 0;
-	int i = 0;
-	struct blk_plug plug;
+	if (!aio_poll_alloc(req, (unsigned long) req->ki_buf, aio_poll_work))
+		return -ENOMEM;
 
-	if (unlikely(nr < 0))
-		return -EINVAL;
+	return aio_poll_arm(req);
+}
 
-	if (unlikely(nr > LONG_MAX/sizeof(*iocbpp)))
-		nr = LONG_MAX/sizeof(*iocbpp);
+/*
+ * Ring reads and writes of anything but regular files and block devices
+ * (pipes, sockets, ttys...) can wait for the other end forever, which
+ * neither the SQPOLL thread nor aio_wq can afford.  They are only
+ * accepted on O_NONBLOCK descriptors, the only way to keep ->aio_read
+ * and ->aio_write from sleeping here, and an attempt that would block is
+ * retried from aio_wq when ->poll reports the file ready, like
+ * IOCB_CMD_POLL does.  Files without ->poll are always ready.
+ */
+static bool aio_ring_nowait(struct kiocb *req)
+{
+	umode_t mode = file_inode(req->ki_filp)->i_mode;
 
-	if (unlikely(!access_ok(VERIFY_READ, iocbpp, (nr*sizeof(*iocbpp)))))
-		return -EFAULT;
+	return (req->ki_flags & KIOCB_F_RING) &&
+		!S_ISREG(mode) && !S_ISBLK(mode);
+}
 
-	ctx = lookup_ioctx(ctx_id);
-	if (unlikely(!ctx)) {
-		pr_debug("EINVAL: invalid context id\n");
+/*
+ * Called by the owner of the request, returns -EIOCBQUEUED once it is
+ * armed again, otherwise the result to complete the request with.
+ */
+static long aio_rw_nowait_issue(struct kiocb *req)
+{
+	struct aio_poll *apoll = req->ki_poll;
+	long ret;
+
+	for (;;) {
+		ret = aio_rw_vect_retry(req, apoll->rw, apoll->rw_op);
+		if (ret != -EAGAIN)
+			return ret;
+
+		ret = aio_poll_arm(req);
+		/* no waitqueue to wait on, nothing will wake us up */
+		if (!ret)
+			return -EAGAIN;
+		if (ret < 0)
+			return ret;
+		/* ready already, try again */
+	}
+}
+
+static void aio_rw_nowait_work(struct work_struct *work)
+{
+	struct kiocb *req = container_of(work, struct kiocb, ki_work);
+	struct mm_struct *mm = req->ki_ctx->mm;
+	long ret;
+
+	if (ACCESS_ONCE(req->ki_cancel) == KIOCB_CANCELLED) {
+		aio_poll_unqueue(req->ki_poll);
+		ret = -ECANCELED;
+	} else if (!atomic_inc_not_zero(&mm->mm_users)) {
+		/* the owner is exiting */
+		aio_poll_unqueue(req->ki_poll);
+		ret = -EINTR;
+	} else {
+		use_mm(mm);
+		ret = aio_rw_nowait_issue(req);
+		unuse_mm(mm);
+		mmput(mm);
+	}
+
+	if (ret != -EIOCBQUEUED)
+		aio_complete(req, ret, 0);
+}
+
+static ssize_t aio_rw_nowait(struct kiocb *req, int rw, aio_rw_op *rw_op)
+{
+	struct file *file = req->ki_filp;
+	struct aio_poll *apoll;
+
+	if (!file->f_op->poll)
+		return aio_rw_vect_retry(req, rw, rw_op);
+	if (!(file->f_flags & O_NONBLOCK))
+		return -EOPNOTSUPP;
+
+	apoll = aio_poll_alloc(req, rw == READ ? POLLIN | POLLRDNORM :
+						 POLLOUT | POLLWRNORM,
+			       aio_rw_nowait_work);
+	if (!apoll)
+		return -ENOMEM;
+	apoll->rw = rw;
+	apoll->rw_op = rw_op;
+
+	return aio_rw_nowait_issue(req);
+}
+
+/*
+ * Ring writes can run in the SQPOLL thread or in aio_wq, kernel threads
+ * without a RLIMIT_FSIZE of their own, so generic_write_checks() doesn't
+ * enforce the submitter's.  Check against the limit recorded when the
+ * request was taken from the ring instead; unlike write(2), a write that
+ * would cross it fails with -EFBIG as a whole, and there's no SIGXFSZ.
+ */
+static int aio_ring_check_fsize(struct kiocb *req)
+{
+	struct inode *inode = file_inode(req->ki_filp);
+	unsigned long limit = req->ki_rlim_fsize;
+	loff_t pos = req->ki_pos;
+
+	if (limit == RLIM_INFINITY || !S_ISREG(inode->i_mode))
+		return 0;
+
+	if (req->ki_filp->f_flags & O_APPEND)
+		pos = i_size_read(inode);
+	if (pos >= limit || req->ki_nbytes > limit - pos)
+		return -EFBIG;
+	return 0;
+}
+
+/*
+ * O_DIRECT reads of a block device into a registered buffer: the pages
+ * are already pinned, so build the bios straight from them instead of
+ * going through the direct-io code and get_user_pages().  Writes take
+ * ->aio_write, which does the read-only, limit and O_SYNC handling.
+ */
+struct aio_fixed_io {
+	atomic_t		remaining;
+	int			error;
+};
+
+static void aio_fixed_end_io(struct bio *bio, int error)
+{
+	struct kiocb *req = bio->bi_private;
+	struct aio_fixed_io *fio = req->private;
+
+	if (error)
+		fio->error = error;
+	bio_put(bio);
+
+	if (atomic_dec_and_test(&fio->remaining))
+		aio_complete(req, fio->error ? fio->error : req->ki_nbytes, 0);
+}
+
+static bool aio_fixed_bdev(struct kiocb *req)
+{
+	struct file *file = req->ki_filp;
+
+	return (req->ki_flags & KIOCB_F_FIXED_BUF) &&
+		(file->f_flags & O_DIRECT) &&
+		S_ISBLK(file->f_mapping->host->i_mode);
+}
+
+static ssize_t aio_fixed_bdev_read(struct kiocb *req)
+{
+	struct address_space *mapping = req->ki_filp->f_mapping;
+	struct block_device *bdev = I_BDEV(mapping->host);
+	struct aio_mapped_buf *buf = req->ki_fixed;
+	unsigned long uaddr = (unsigned long) req->ki_buf;
+	unsigned blkmask = bdev_logical_block_size(bdev) - 1;
+	loff_t pos = req->ki_pos, size = i_size_read(mapping->host);
+	size_t left = req->ki_nbytes;
+	struct aio_fixed_io *fio;
+	struct bio *bio = NULL;
+	unsigned long idx, off;
+	int ret;
+
+	if ((pos | left | uaddr) & blkmask)
+		return -EINVAL;
+	if (pos >= size)
+		return 0;
+	left = min_t(loff_t, left, size - pos);
+	if (!left)
+		return 0;
+	req->ki_nbytes = left;
+
+	/* same coherency rules as generic O_DIRECT against the page cache */
+	if (mapping->nrpages) {
+		ret = filemap_write_and_wait_range(mapping, pos, pos + left - 1);
+		if (ret)
+			return ret;
+	}
+
+	fio = kmalloc(sizeof(*fio), GFP_KERNEL);
+	if (!fio)
+		return -ENOMEM;
+	atomic_set(&fio->remaining, 1);
+	fio->error = 0;
+	req->private = fio;
+	req->ki_dtor = aio_private_dtor;
+
+	off = uaddr - (buf->ubuf & PAGE_MASK);
+	idx = off >> PAGE_SHIFT;
+	off &= ~PAGE_MASK;
+	while (left) {
+		unsigned bytes = min_t(size_t, left, PAGE_SIZE - off);
+
+		if (!bio) {
+			bio = bio_alloc(GFP_KERNEL,
+					min_t(unsigned long, BIO_MAX_PAGES,
+					      buf->nr_pages - idx));
+			bio->bi_bdev = bdev;
+			bio->bi_sector = pos >> 9;
+			bio->bi_end_io = aio_fixed_end_io;
+			bio->bi_private = req;
+		}
+
+		if (bio_add_page(bio, buf->pages[idx], bytes, off) < bytes) {
+			if (!bio->bi_vcnt) {
+				bio_put(bio);
+				fio->error = -EIO;
+				break;
+			}
+			atomic_inc(&fio->remaining);
+			submit_bio(READ, bio);
+			bio = NULL;
+			continue;
+		}
+
+		pos += bytes;
+		left -= bytes;
+		off = 0;
+		idx++;
+	}
+	if (bio) {
+		atomic_inc(&fio->remaining);
+		submit_bio(READ, bio);
+	}
+
+	if (atomic_dec_and_test(&fio->remaining))
+		aio_complete(req, fio->error ? fio->error : req->ki_nbytes, 0);
+	return -EIOCBQUEUED;
+}
+
+/*
+ * Buffered reads.  ->aio_read of a buffered file sleeps until the data
+ * is read from disk, so don't call it until every page of the range is
+ * uptodate: start readahead for what is missing and have unlock_page()
+ * of the first page still under I/O kick aio_wq, which repeats the check
+ * and finally does the copy.  Ranges that are fully cached are copied
+ * inline by the submitter.
+ */
+struct aio_read_wait {
+	wait_queue_t		wait;
+	struct page		*page;
+};
+
+static bool aio_read_async_ok(struct kiocb *req)
+{
+	struct file *file = req->ki_filp;
+	struct address_space *mapping = file->f_mapping;
+
+	return !(file->f_flags & O_DIRECT) &&
+		S_ISREG(mapping->host->i_mode) &&
+		mapping->a_ops->readpage;
+}
+
+static int aio_read_page_wake(wait_queue_t *wait, unsigned mode, int sync,
+			      void *arg)
+{
+	struct aio_read_wait *rw = container_of(wait, struct aio_read_wait,
+						wait);
+	struct wait_bit_key *key = arg;
+	struct kiocb *req = wait->private;
+
+	/* the page wait queues are hashed and shared */
+	if (key->flags != &rw->page->flags || key->bit_nr != PG_locked)
+		return 0;
+
+	list_del_init(&wait->task_list);
+	queue_work(aio_wq, &req->ki_work);
+	return 1;
+}
+
+/*
+ * Returns 0 if the whole range is uptodate, -EIOCBQUEUED if a wakeup
+ * was armed on a page under I/O, or -EAGAIN if a page couldn't be read
+ * ahead (allocation failure, I/O error) and only the blocking path will
+ * tell what happened.
+ */
+static int aio_read_wait_pages(struct kiocb *req)
+{
+	struct file *file = req->ki_filp;
+	struct address_space *mapping = file->f_mapping;
+	struct aio_read_wait *rw = req->private;
+	loff_t isize = i_size_read(mapping->host);
+	pgoff_t index, last;
+	struct page *page;
+
+	if (req->ki_pos >= isize || !req->ki_left)
+		return 0;
+
+	index = req->ki_pos >> PAGE_CACHE_SHIFT;
+	last = (min_t(loff_t, req->ki_pos + req->ki_left, isize) - 1) >>
+		PAGE_CACHE_SHIFT;
+
+	for (; index <= last; index++) {
+		page = find_get_page(mapping, index);
+		if (!page) {
+			page_cache_sync_readahead(mapping, &file->f_ra, file,
+						  index, last - index + 1);
+			page = find_get_page(mapping, index);
+			if (!page)
+				return -EAGAIN;
+		}
+		if (PageReadahead(page))
+			page_cache_async_readahead(mapping, &file->f_ra, file,
+						   page, index,
+						   last - index + 1);
+		if (PageUptodate(page)) {
+			page_cache_release(page);
+			continue;
+		}
+		/* not uptodate and not under I/O: failed read */
+		if (!PageLocked(page)) {
+			page_cache_release(page);
+			return -EAGAIN;
+		}
+
+		if (!rw) {
+			rw = kmalloc(sizeof(*rw), GFP_KERNEL);
+			if (!rw) {
+				page_cache_release(page);
+				return -EAGAIN;
+			}
+			req->private = rw;
+			req->ki_dtor = aio_private_dtor;
+		}
+		init_waitqueue_func_entry(&rw->wait, aio_read_page_wake);
+		rw->wait.private = req;
+		rw->page = page;
+		if (!wait_on_page_locked_async(page, &rw->wait))
+			return -EIOCBQUEUED;
+
+		/* unlocked meanwhile, look at it again */
+		page_cache_release(page);
+		rw->page = NULL;
+		index--;
+	}
+
+	return 0;
+}
+
+static void aio_read_async_work(struct work_struct *work)
+{
+	struct kiocb *req = container_of(work, struct kiocb, ki_work);
+	struct aio_read_wait *rw = req->private;
+	struct mm_struct *mm = req->ki_ctx->mm;
+	ssize_t ret;
+
+	if (rw && rw->page) {
+		page_cache_release(rw->page);
+		rw->page = NULL;
+	}
+
+	if (aio_read_wait_pages(req) == -EIOCBQUEUED)
+		return;
+
+	/* ->aio_read may use ->private, it's ours no more */
+	kfree(req->private);
+	req->private = NULL;
+	req->ki_dtor = NULL;
+
+	if (!atomic_inc_not_zero(&mm->mm_users)) {
+		aio_complete(req, -EINTR, 0);
+		return;
+	}
+
+	use_mm(mm);
+	ret = aio_rw_vect_retry(req, READ, req->ki_filp->f_op->aio_read);
+	unuse_mm(mm);
+	mmput(mm);
+
+	if (ret != -EIOCBQUEUED) {
+		if (unlikely(ret == -ERESTARTSYS || ret == -ERESTARTNOINTR ||
+			     ret == -ERESTARTNOHAND ||
+			     ret == -ERESTART_RESTARTBLOCK))
+			ret = -EINTR;
+		aio_complete(req, ret, 0);
+	}
+}
+
+static ssize_t aio_read_async(struct kiocb *req, aio_rw_op *rw_op)
+{
+	int ret;
+
+	INIT_WORK(&req->ki_work, aio_read_async_work);
+	ret = aio_read_wait_pages(req);
+	if (!ret)
+		return aio_rw_vect_retry(req, READ, rw_op);
+
+	if (ret == -EAGAIN)
+		queue_work(aio_wq, &req->ki_work);
+	return -EIOCBQUEUED;
+}
+
+/*
+ * aio_setup_iocb:
+ *	Performs the initial checks and aio retry method
+ *	setup for the kiocb at the time of io submission.
+ */
+static ssize_t aio_run_iocb(struct kiocb *req, bool compat)
+{
+	struct file *file = req->ki_filp;
+	ssize_t ret;
+	int rw;
+	fmode_t mode;
+	aio_rw_op *rw_op;
+
+	switch (req->ki_opcode) {
+	case IOCB_CMD_PREAD:
+	case IOCB_CMD_PREADV:
+		mode	= FMODE_READ;
+		rw	= READ;
+		rw_op	= file->f_op->aio_read;
+		goto rw_common;
+
+	case IOCB_CMD_PWRITE:
+	case IOCB_CMD_PWRITEV:
+		mode	= FMODE_WRITE;
+		rw	= WRITE;
+		rw_op	= file->f_op->aio_write;
+		goto rw_common;
+rw_common:
+		if (unlikely(!(file->f_mode & mode)))
+			return -EBADF;
+
+		if (!rw_op)
+			return -EINVAL;
+
+		ret = (req->ki_opcode == IOCB_CMD_PREADV ||
+		       req->ki_opcode == IOCB_CMD_PWRITEV)
+			? aio_setup_vectored_rw(rw, req, compat)
+			: aio_setup_single_vector(rw, req);
+		if (ret)
+			return ret;
+
+		ret = rw_verify_area(rw, file, &req->ki_pos, req->ki_nbytes);
+		if (ret < 0)
+			return ret;
+
+		req->ki_nbytes = ret;
+		req->ki_left = ret;
+
+		if (rw == WRITE && (req->ki_flags & KIOCB_F_RING)) {
+			ret = aio_ring_check_fsize(req);
+			if (ret)
+				return ret;
+		}
+
+		if (aio_ring_nowait(req))
+			ret = aio_rw_nowait(req, rw, rw_op);
+		else if (rw == READ && aio_fixed_bdev(req))
+			ret = aio_fixed_bdev_read(req);
+		else if (rw == READ && aio_read_async_ok(req))
+			ret = aio_read_async(req, rw_op);
+		else
+			ret = aio_rw_vect_retry(req, rw, rw_op);
+		break;
+
+	case IOCB_CMD_FDSYNC:
+		if (!file->f_op->aio_fsync)
+			return -EINVAL;
+
+		ret = file->f_op->aio_fsync(req, 1);
+		break;
+
+	case IOCB_CMD_FSYNC:
+		if (!file->f_op->aio_fsync)
+			return -EINVAL;
+
+		ret = file->f_op->aio_fsync(req, 0);
+		break;
+
+	case IOCB_CMD_POLL:
+		if (!file->f_op->poll)
+			return -EINVAL;
+
+		ret = aio_poll(req);
+		break;
+
+	default:
+		pr_debug("EINVAL: no operation provided\n");
+		return -EINVAL;
+	}
+
+	if (ret != -EIOCBQUEUED) {
+		/*
+		 * There's no easy way to restart the syscall since other AIO's
+		 * may be already running. Just fail this IO with EINTR.
+		 */
+		if (unlikely(ret == -ERESTARTSYS || ret == -ERESTARTNOINTR ||
+			     ret == -ERESTARTNOHAND ||
+			     ret == -ERESTART_RESTARTBLOCK))
+			ret = -EINTR;
+		aio_complete(req, ret, 0);
+	}
+
+	return 0;
+}
+
+static int aio_check_iocb(struct iocb *iocb)
+{
+	/* enforce forwards compatibility on users */
+	if (unlikely(iocb->aio_reserved1 ||
+		     (iocb->aio_reserved2 &&
+		      !(iocb->aio_flags & IOCB_FLAG_FIXED_BUF)))) {
+		pr_debug("EINVAL: reserve field set\n");
+		return -EINVAL;
+	}
+
+	/* prevent overflows */
+	if (unlikely(
+	    (iocb->aio_buf != (unsigned long)iocb->aio_buf) ||
+	    (iocb->aio_nbytes != (size_t)iocb->aio_nbytes) ||
+	    ((ssize_t)iocb->aio_nbytes < 0)
+	   )) {
+		pr_debug("EINVAL: io_submit: overflow check\n");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Look up a file for a request.  Requests submitted by the SQPOLL thread
+ * resolve descriptors in the files of the task that set the ring up.
+ */
+static struct file *aio_fget(struct kioctx *ctx, unsigned int fd)
+{
+	struct file *file;
+
+	if (!ctx->sq_files)
+		return fget(fd);
+
+	rcu_read_lock();
+	file = fcheck_files(ctx->sq_files, fd);
+	if (file) {
+		/* File object ref couldn't be taken */
+		if (file->f_mode & FMODE_PATH ||
+		    !atomic_long_inc_not_zero(&file->f_count))
+			file = NULL;
+	}
+	rcu_read_unlock();
+
+	return file;
+}
+
+/*
+ * Resolve registered files and buffers.  Called with ctx->reg_sem held
+ * for read; the request pins both sets through reg_inflight until it
+ * completes.
+ */
+static int aio_prep_fixed(struct kioctx *ctx, struct kiocb *req,
+			  struct iocb *iocb)
+{
+	if (iocb->aio_flags & IOCB_FLAG_FIXED_BUF) {
+		struct aio_mapped_buf *buf;
+		unsigned long uaddr = (unsigned long) iocb->aio_buf;
+
+		if (iocb->aio_lio_opcode != IOCB_CMD_PREAD &&
+		    iocb->aio_lio_opcode != IOCB_CMD_PWRITE)
+			return -EINVAL;
+		if (iocb->aio_reserved2 >= ctx->nr_bufs)
+			return -EINVAL;
+
+		buf = &ctx->bufs[iocb->aio_reserved2];
+		if (uaddr < buf->ubuf || iocb->aio_nbytes > buf->len ||
+		    uaddr - buf->ubuf > buf->len - iocb->aio_nbytes)
+			return -EFAULT;
+
+		req->ki_fixed = buf;
+		req->ki_flags |= KIOCB_F_FIXED_BUF;
+	}
+
+	if (iocb->aio_flags & IOCB_FLAG_FIXED_FILE) {
+		if (iocb->aio_fildes >= ctx->nr_files ||
+		    !ctx->files[iocb->aio_fildes])
+			return -EBADF;
+
+		req->ki_filp = ctx->files[iocb->aio_fildes];
+		req->ki_flags |= KIOCB_F_FIXED_FILE;
+	}
+
+	req->ki_flags |= KIOCB_F_FIXED_REF;
+	atomic_inc(&ctx->reg_inflight);
+	return 0;
+}
+
+static int aio_prep_req(struct kioctx *ctx, struct kiocb *req,
+			struct iocb __user *user_iocb, struct iocb *iocb)
+{
+	req->ki_obj.user = user_iocb;
+	req->ki_user_data = iocb->aio_data;
+	req->ki_pos = iocb->aio_offset;
+
+	req->ki_buf = (char __user *)(unsigned long)iocb->aio_buf;
+	req->ki_left = req->ki_nbytes = iocb->aio_nbytes;
+	req->ki_opcode = iocb->aio_lio_opcode;
+
+	if (iocb->aio_flags & (IOCB_FLAG_FIXED_FILE | IOCB_FLAG_FIXED_BUF)) {
+		int ret = aio_prep_fixed(ctx, req, iocb);
+
+		if (ret)
+			return ret;
+	}
+
+	if (!req->ki_filp)
+		req->ki_filp = aio_fget(ctx, iocb->aio_fildes);
+	if (unlikely(!req->ki_filp))
+		return -EBADF;
+
+	if (iocb->aio_flags & IOCB_FLAG_RESFD) {
+		struct file *file;
+
+		/*
+		 * If the IOCB_FLAG_RESFD flag of aio_flags is set, get an
+		 * instance of the file* now. The file descriptor must be
+		 * an eventfd() fd, and will be signaled for each completed
+		 * event using the eventfd_signal() function.
+		 */
+		file = aio_fget(ctx, iocb->aio_resfd);
+		if (!file)
+			return -EBADF;
+		req->ki_eventfd = eventfd_ctx_fileget(file);
+		fput(file);
+		if (IS_ERR(req->ki_eventfd)) {
+			int ret = PTR_ERR(req->ki_eventfd);
+
+			req->ki_eventfd = NULL;
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+static int io_submit_one(struct kioctx *ctx, struct iocb __user *user_iocb,
+			 struct iocb *iocb, bool compat)
+{
+	struct kiocb *req;
+	ssize_t ret;
+
+	ret = aio_check_iocb(iocb);
+	if (unlikely(ret))
+		return ret;
+
+	req = aio_get_req(ctx);
+	if (unlikely(!req))
+		return -EAGAIN;
+
+	ret = aio_prep_req(ctx, req, user_iocb, iocb);
+	if (unlikely(ret))
+		goto out_put_req;
+
+	ret = put_user(KIOCB_KEY, &user_iocb->aio_key);
+	if (unlikely(ret)) {
+		pr_debug("EFAULT: aio_key\n");
+		goto out_put_req;
+	}
+
+	ret = aio_run_iocb(req, compat);
+	if (ret)
+		goto out_put_req;
+
+	aio_put_req(req);	/* drop extra ref to req */
+	return 0;
+out_put_req:
+	if (req->ki_flags & KIOCB_F_FIXED_REF)
+		atomic_dec(&ctx->reg_inflight);
+	atomic_dec(&ctx->reqs_active);
+	aio_put_req(req);	/* drop extra ref to req */
+	aio_put_req(req);	/* drop i/o ref to req */
+	return ret;
+}
+
+long do_io_submit(aio_context_t ctx_id, long nr,
+		  struct iocb __user *__user *iocbpp, bool compat)
+{
+	struct kioctx *ctx;
+	long ret = 0;
+	int i = 0;
+	struct blk_plug plug;
+
+	if (unlikely(nr < 0))
+		return -EINVAL;
+
+	if (unlikely(nr > LONG_MAX/sizeof(*iocbpp)))
+		nr = LONG_MAX/sizeof(*iocbpp);
+
+	if (unlikely(!access_ok(VERIFY_READ, iocbpp, (nr*sizeof(*iocbpp)))))
+		return -EFAULT;
+
+	ctx = lookup_ioctx(ctx_id);
+	if (unlikely(!ctx)) {
+		pr_debug("EINVAL: invalid context id\n");
 		return -EINVAL;
 	}
 
-	blk_start_plug(&plug);
+	blk_start_plug_nr_ios(&plug, min_t(long, nr, BLK_MAX_REQUEST_COUNT));
+	down_read(&ctx->reg_sem);
 
 	/*
 	 * AKPM: should this return a partial result if some of the IOs were
@@ -1193,6 +2144,7 @@ long do_io_submit(aio_context_t ctx_id, long nr,
 		if (ret)
 			break;
 	}
+	up_read(&ctx->reg_sem);
 	blk_finish_plug(&plug);
 
 	put_ioctx(ctx);
@@ -1217,6 +2169,602 @@ SYSCALL_DEFINE3(io_submit, aio_context_t, ctx_id, long, nr,
 	return do_io_submit(ctx_id, nr, iocbpp, 0);
 }
 
+/*
+ * Buffered writes and fsync would block the submitter (or the SQPOLL
+ * thread), so ring submissions punt them to aio_wq.  O_DIRECT I/O and
+ * poll are queued inline, and so are buffered reads of regular files,
+ * which wait for the page cache asynchronously by themselves.  Only
+ * regular files and block devices are punted, they make progress on
+ * their own; the rest goes through aio_rw_nowait().  A ring has at most
+ * IORING_MAX_PUNTED requests in aio_wq, further entries that would be
+ * punted stay in the ring until some of those complete.
+ */
+static bool aio_ring_punt(struct kiocb *req)
+{
+	umode_t mode = file_inode(req->ki_filp)->i_mode;
+
+	if (!S_ISREG(mode) && !S_ISBLK(mode))
+		return false;
+
+	switch (req->ki_opcode) {
+	case IOCB_CMD_PREAD:
+	case IOCB_CMD_PREADV:
+		return !(req->ki_filp->f_flags & O_DIRECT) &&
+			!aio_read_async_ok(req);
+	case IOCB_CMD_PWRITE:
+	case IOCB_CMD_PWRITEV:
+		return !(req->ki_filp->f_flags & O_DIRECT);
+	case IOCB_CMD_FSYNC:
+	case IOCB_CMD_FDSYNC:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static void aio_ring_work(struct work_struct *work)
+{
+	struct kiocb *req = container_of(work, struct kiocb, ki_work);
+	struct kioctx *ctx = req->ki_ctx;
+	struct mm_struct *mm = ctx->mm;
+	const struct cred *old_cred;
+	ssize_t ret;
+
+	/* the owner is exiting, exit_aio() is about to tear us down */
+	if (!atomic_inc_not_zero(&mm->mm_users)) {
+		aio_complete(req, -EINTR, 0);
+		goto out;
+	}
+
+	use_mm(mm);
+	old_cred = override_creds(ctx->sq_creds);
+
+	switch (req->ki_opcode) {
+	case IOCB_CMD_FSYNC:
+	case IOCB_CMD_FDSYNC:
+		/* most filesystems don't have ->aio_fsync, we're async here */
+		ret = vfs_fsync(req->ki_filp,
+				req->ki_opcode == IOCB_CMD_FDSYNC);
+		aio_complete(req, ret, 0);
+		break;
+	default:
+		ret = aio_run_iocb(req, ctx->sq_compat);
+		if (ret)
+			aio_complete(req, ret, 0);
+	}
+
+	revert_creds(old_cred);
+	unuse_mm(mm);
+	mmput(mm);
+out:
+	aio_put_req(req);	/* drop extra ref to req */
+	atomic_dec(&ctx->sq_punted);
+	put_ioctx(ctx);
+}
+
+/*
+ * Submit one iocb taken from the submission ring.  Returns -EAGAIN when
+ * the completion ring is full and the entry must stay in the ring, and
+ * -EINVAL for entries dropped without a completion; every other failure
+ * is reported through the completion ring.
+ */
+static int aio_ring_submit_one(struct kioctx *ctx, struct iocb *iocb,
+			       struct iocb __user *user_iocb)
+{
+	struct kiocb *req;
+	ssize_t ret;
+
+	ret = aio_check_iocb(iocb);
+	if (unlikely(ret))
+		return ret;
+
+	req = aio_get_req(ctx);
+	if (unlikely(!req))
+		return -EAGAIN;
+
+	req->ki_flags |= KIOCB_F_RING;
+	req->ki_rlim_fsize = current == ctx->sq_thread ? ctx->sq_rlim_fsize :
+			     rlimit(RLIMIT_FSIZE);
+
+	ret = aio_prep_req(ctx, req, user_iocb, iocb);
+	/* io_cancel() takes the ring slot, until the app reuses it */
+	if (likely(!ret))
+		ret = put_user(KIOCB_KEY, &user_iocb->aio_key);
+	if (likely(!ret)) {
+		if (aio_ring_punt(req)) {
+			if (atomic_inc_return(&ctx->sq_punted) >
+			    IORING_MAX_PUNTED) {
+				atomic_dec(&ctx->sq_punted);
+				goto out_put_req;
+			}
+			atomic_inc(&ctx->users);	/* for aio_ring_work() */
+			INIT_WORK(&req->ki_work, aio_ring_work);
+			queue_work(aio_wq, &req->ki_work);
+			return 0;
+		}
+		ret = aio_run_iocb(req, ctx->sq_compat);
+	}
+	if (ret)
+		aio_complete(req, ret, 0);
+
+	aio_put_req(req);	/* drop extra ref to req */
+	return 0;
+out_put_req:
+	/* not submitted, the entry stays in the ring */
+	if (req->ki_flags & KIOCB_F_FIXED_REF)
+		atomic_dec(&ctx->reg_inflight);
+	atomic_dec(&ctx->reqs_active);
+	aio_put_req(req);	/* drop extra ref to req */
+	aio_put_req(req);	/* drop i/o ref to req */
+	return -EAGAIN;
+}
+
+static unsigned aio_sq_tail(struct kioctx *ctx)
+{
+	struct aio_sq_ring *ring;
+	unsigned tail;
+
+	ring = kmap_atomic(ctx->sq_pages[0]);
+	tail = ACCESS_ONCE(ring->tail);
+	kunmap_atomic(ring);
+
+	/* read the entries only after seeing the tail that covers them */
+	smp_rmb();
+	return tail;
+}
+
+static void aio_sq_set_flags(struct kioctx *ctx, unsigned set, unsigned clear)
+{
+	struct aio_sq_ring *ring;
+
+	ring = kmap_atomic(ctx->sq_pages[0]);
+	ring->flags = (ring->flags & ~clear) | set;
+	kunmap_atomic(ring);
+	flush_dcache_page(ctx->sq_pages[0]);
+}
+
+/*
+ * Consume up to 'to_submit' entries from the submission ring.  Returns
+ * the number of requests submitted.
+ */
+static int aio_submit_sq(struct kioctx *ctx, unsigned to_submit)
+{
+	struct aio_sq_ring *ring;
+	struct blk_plug plug;
+	unsigned head, tail, dropped = 0;
+	int submitted = 0;
+
+	mutex_lock(&ctx->sq_lock);
+
+	head = ctx->sq_head;
+	tail = aio_sq_tail(ctx);
+	if (tail - head > ctx->sq_entries)
+		tail = head + ctx->sq_entries;
+	to_submit = min(to_submit, tail - head);
+
+	blk_start_plug_nr_ios(&plug, min_t(unsigned, to_submit,
+					   BLK_MAX_REQUEST_COUNT));
+	down_read(&ctx->reg_sem);
+	while (to_submit--) {
+		unsigned long off;
+		struct iocb iocb;
+		void *page;
+		int ret;
+
+		off = sizeof(struct aio_sq_ring) +
+		      (head & (ctx->sq_entries - 1)) * sizeof(struct iocb);
+		page = kmap_atomic(ctx->sq_pages[off >> PAGE_SHIFT]);
+		memcpy(&iocb, page + (off & ~PAGE_MASK), sizeof(iocb));
+		kunmap_atomic(page);
+
+		ret = aio_ring_submit_one(ctx, &iocb, (struct iocb __user *)
+					  (ctx->sq_mmap_base + off));
+		if (ret == -EAGAIN)
+			break;
+		if (ret)
+			dropped++;
+		else
+			submitted++;
+		head++;
+	}
+	up_read(&ctx->reg_sem);
+	blk_finish_plug(&plug);
+
+	ctx->sq_head = head;
+
+	/* we're done with the entries before the application reuses them */
+	smp_mb();
+
+	ring = kmap_atomic(ctx->sq_pages[0]);
+	ring->head = head;
+	ring->dropped += dropped;
+	kunmap_atomic(ring);
+	flush_dcache_page(ctx->sq_pages[0]);
+
+	mutex_unlock(&ctx->sq_lock);
+
+	return submitted;
+}
+
+static bool aio_sq_pending(struct kioctx *ctx)
+{
+	return aio_sq_tail(ctx) != ctx->sq_head || atomic_read(&ctx->dead);
+}
+
+static int aio_sq_thread(void *data)
+{
+	struct kioctx *ctx = data;
+	struct mm_struct *mm = ctx->mm;
+	const struct cred *old_cred;
+	unsigned long timeout = jiffies + ctx->sq_idle;
+	DEFINE_WAIT(wait);
+
+	old_cred = override_creds(ctx->sq_creds);
+
+	while (!atomic_read(&ctx->dead)) {
+		int submitted = 0;
+
+		/*
+		 * Only borrow the mm while submitting: holding mm_users
+		 * would keep exit_aio(), and so our own teardown, from ever
+		 * running.
+		 */
+		if (aio_sq_tail(ctx) != ctx->sq_head &&
+		    atomic_inc_not_zero(&mm->mm_users)) {
+			use_mm(mm);
+			submitted = aio_submit_sq(ctx, ctx->sq_entries);
+			unuse_mm(mm);
+			mmput(mm);
+		}
+
+		if (submitted) {
+			timeout = jiffies + ctx->sq_idle;
+			cond_resched();
+			continue;
+		}
+
+		/*
+		 * Within the idle period keep polling the ring, so that
+		 * the application never has to enter the kernel while it
+		 * keeps submitting.
+		 */
+		if (time_before(jiffies, timeout)) {
+			cond_resched();
+			continue;
+		}
+
+		/*
+		 * Idle: ask for a wakeup, then check the ring once more so an
+		 * entry queued before the flag became visible isn't missed.
+		 */
+		aio_sq_set_flags(ctx, IORING_SQ_NEED_WAKEUP, 0);
+		prepare_to_wait(&ctx->sq_wait, &wait, TASK_INTERRUPTIBLE);
+		smp_mb();
+		if (!aio_sq_pending(ctx))
+			schedule();
+		finish_wait(&ctx->sq_wait, &wait);
+		aio_sq_set_flags(ctx, 0, IORING_SQ_NEED_WAKEUP);
+		timeout = jiffies + ctx->sq_idle;
+	}
+
+	revert_creds(old_cred);
+	put_ioctx(ctx);
+	return 0;
+}
+
+static int aio_start_sq_thread(struct kioctx *ctx, unsigned idle_ms)
+{
+	struct task_struct *tsk;
+
+	ctx->sq_files = get_files_struct(current);
+	if (!ctx->sq_files)
+		return -EBADF;
+	ctx->sq_idle = msecs_to_jiffies(idle_ms ? idle_ms : 1000);
+	init_waitqueue_head(&ctx->sq_wait);
+
+	atomic_inc(&ctx->users);
+	tsk = kthread_create(aio_sq_thread, ctx, "aio-sq/%d",
+			     task_pid_nr(current));
+	if (IS_ERR(tsk)) {
+		atomic_dec(&ctx->users);
+		return PTR_ERR(tsk);
+	}
+
+	get_task_struct(tsk);
+	ctx->sq_thread = tsk;
+	wake_up_process(tsk);
+	return 0;
+}
+
+/* sys_io_ring_setup:
+ *	Create an aio_context with a submission ring of at least 'entries'
+ *	iocbs (rounded up to a power of 2) and a completion ring of twice
+ *	that.  The ring sizes and the address of the submission ring are
+ *	returned in *params, the context id, which is also the address of
+ *	the completion ring, in *ctxp.  With IORING_SETUP_SQPOLL, a kernel
+ *	thread consumes the submission ring; as it polls on the caller's
+ *	behalf this needs CAP_SYS_ADMIN.  Fails like io_setup(), with
+ *	-EINVAL for unknown flags and -EPERM for SQPOLL without privilege.
+ */
+SYSCALL_DEFINE3(io_ring_setup, unsigned, entries,
+		struct io_ring_params __user *, params,
+		aio_context_t __user *, ctxp)
+{
+	struct io_ring_params p;
+	struct kioctx *ctx;
+	long ret;
+
+	if (copy_from_user(&p, params, sizeof(p)))
+		return -EFAULT;
+	if (p.flags & ~IORING_SETUP_SQPOLL)
+		return -EINVAL;
+	if ((p.flags & IORING_SETUP_SQPOLL) && !capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (!entries || entries > IORING_MAX_ENTRIES)
+		return -EINVAL;
+	entries = roundup_pow_of_two(entries);
+
+	ctx = ioctx_alloc(entries * 2);
+	if (IS_ERR(ctx))
+		return PTR_ERR(ctx);
+
+	ctx->sq_creds = get_current_cred();
+	ctx->sq_compat = is_compat_task();
+	ctx->sq_rlim_fsize = rlimit(RLIMIT_FSIZE);
+
+	ret = aio_setup_sq_ring(ctx, entries);
+	if (!ret && (p.flags & IORING_SETUP_SQPOLL))
+		ret = aio_start_sq_thread(ctx, p.sq_thread_idle);
+	if (ret)
+		goto out_kill;
+
+	p.sq_entries = entries;
+	p.cq_entries = ctx->nr_events;
+	p.sq_ring = ctx->sq_mmap_base;
+	if (copy_to_user(params, &p, sizeof(p)) ||
+	    put_user(ctx->user_id, ctxp)) {
+		ret = -EFAULT;
+		goto out_kill;
+	}
+
+	put_ioctx(ctx);
+	return 0;
+
+out_kill:
+	kill_ioctx(current->mm, ctx);
+	put_ioctx(ctx);
+	return ret;
+}
+
+static int aio_register_buffers(struct kioctx *ctx, void __user *arg,
+				unsigned nr_args)
+{
+	struct user_struct *user = current_user();
+	unsigned long total = 0;
+	struct aio_mapped_buf *bufs;
+	unsigned i;
+	int ret;
+
+	if (ctx->bufs)
+		return -EBUSY;
+	if (!nr_args || nr_args > IORING_MAX_FIXED_BUFS)
+		return -EINVAL;
+
+	bufs = kcalloc(nr_args, sizeof(*bufs), GFP_KERNEL);
+	if (!bufs)
+		return -ENOMEM;
+
+	for (i = 0; i < nr_args; i++) {
+		struct aio_mapped_buf *buf = &bufs[i];
+		struct iovec iov;
+		unsigned long start, end;
+		int nr_pages, pinned;
+
+		ret = -EFAULT;
+		if (copy_from_user(&iov, arg + i * sizeof(iov), sizeof(iov)))
+			goto err;
+
+		ret = -EINVAL;
+		start = (unsigned long) iov.iov_base;
+		end = start + iov.iov_len;
+		if (!iov.iov_len || end < start ||
+		    iov.iov_len > IORING_MAX_FIXED_BUF_SIZE)
+			goto err;
+
+		nr_pages = (PAGE_ALIGN(end) - (start & PAGE_MASK)) >> PAGE_SHIFT;
+		ret = aio_account_locked(user, nr_pages);
+		if (ret)
+			goto err;
+		total += nr_pages;
+
+		ret = -ENOMEM;
+		buf->pages = kcalloc(nr_pages, sizeof(struct page *),
+				     GFP_KERNEL);
+		if (!buf->pages)
+			goto err;
+
+		/* buf->nr_pages only ever counts pinned pages */
+		pinned = get_user_pages_fast(start & PAGE_MASK, nr_pages, 1,
+					     buf->pages);
+		buf->nr_pages = max(pinned, 0);
+		if (pinned != nr_pages) {
+			ret = pinned < 0 ? pinned : -EFAULT;
+			goto err;
+		}
+
+		buf->ubuf = start;
+		buf->len = iov.iov_len;
+	}
+
+	ctx->bufs = bufs;
+	ctx->nr_bufs = nr_args;
+	ctx->bufs_user = get_uid(user);
+	ctx->bufs_locked = total;
+	return 0;
+err:
+	atomic_long_sub(total, &user->locked_vm);
+	aio_release_buffers(bufs, i + 1);
+	return ret;
+}
+
+static int aio_register_files(struct kioctx *ctx, void __user *arg,
+			      unsigned nr_args)
+{
+	struct file **files;
+	unsigned i;
+	__s32 fd;
+
+	if (ctx->files)
+		return -EBUSY;
+	if (!nr_args || nr_args > IORING_MAX_FIXED_FILES)
+		return -EINVAL;
+
+	files = kcalloc(nr_args, sizeof(struct file *), GFP_KERNEL);
+	if (!files)
+		return -ENOMEM;
+
+	for (i = 0; i < nr_args; i++) {
+		if (copy_from_user(&fd, arg + i * sizeof(fd), sizeof(fd))) {
+			aio_release_files(files, i);
+			return -EFAULT;
+		}
+		/* -1 leaves a hole to be used as a sparse table */
+		if (fd == -1)
+			continue;
+
+		files[i] = fget(fd);
+		if (!files[i]) {
+			aio_release_files(files, i);
+			return -EBADF;
+		}
+	}
+
+	ctx->files = files;
+	ctx->nr_files = nr_args;
+	return 0;
+}
+
+/* sys_io_ring_register:
+ *	Register or unregister a set of buffers or files with an aio
+ *	context, see IORING_REGISTER_*.  Submissions then refer to them by
+ *	index with IOCB_FLAG_FIXED_BUF and IOCB_FLAG_FIXED_FILE, saving the
+ *	per-request fget() and, for O_DIRECT on block devices, the page
+ *	pinning.  May fail with -EINVAL for an invalid context or opcode,
+ *	-EBUSY if a set is already registered or still in use, -EBADF for
+ *	an invalid fd, -ENOMEM if the buffers would take the user's locked
+ *	memory past RLIMIT_MEMLOCK.
+ */
+SYSCALL_DEFINE4(io_ring_register, aio_context_t, ctx_id, unsigned, opcode,
+		void __user *, arg, unsigned, nr_args)
+{
+	struct kioctx *ctx;
+	long ret;
+
+	ctx = lookup_ioctx(ctx_id);
+	if (unlikely(!ctx))
+		return -EINVAL;
+
+	down_write(&ctx->reg_sem);
+
+	ret = -EBUSY;
+	if ((opcode == IORING_UNREGISTER_BUFFERS ||
+	     opcode == IORING_UNREGISTER_FILES) &&
+	    atomic_read(&ctx->reg_inflight))
+		goto out;
+
+	switch (opcode) {
+	case IORING_REGISTER_BUFFERS:
+		ret = aio_register_buffers(ctx, arg, nr_args);
+		break;
+	case IORING_UNREGISTER_BUFFERS:
+		ret = -ENXIO;
+		if (!ctx->bufs)
+			break;
+		aio_unregister_buffers(ctx);
+		ret = 0;
+		break;
+	case IORING_REGISTER_FILES:
+		ret = aio_register_files(ctx, arg, nr_args);
+		break;
+	case IORING_UNREGISTER_FILES:
+		ret = -ENXIO;
+		if (!ctx->files)
+			break;
+		aio_release_files(ctx->files, ctx->nr_files);
+		ctx->files = NULL;
+		ctx->nr_files = 0;
+		ret = 0;
+		break;
+	default:
+		ret = -EINVAL;
+	}
+out:
+	up_write(&ctx->reg_sem);
+	put_ioctx(ctx);
+	return ret;
+}
+
+static unsigned aio_cq_ready(struct kioctx *ctx)
+{
+	struct aio_ring *ring;
+	unsigned head;
+
+	ring = kmap_atomic(ctx->ring_pages[0]);
+	head = ACCESS_ONCE(ring->head);
+	kunmap_atomic(ring);
+
+	return (ctx->tail + ctx->nr_events - head) % ctx->nr_events;
+}
+
+/* sys_io_ring_enter:
+ *	Submit up to to_submit iocbs from the submission ring of a context
+ *	created by io_ring_setup() and, with IORING_ENTER_GETEVENTS, wait
+ *	until at least min_complete events are in the completion ring.
+ *	For an IORING_SETUP_SQPOLL context nothing is submitted here, the
+ *	thread is woken up if IORING_ENTER_SQ_WAKEUP is set or there is
+ *	something to submit, and consumed entries only show up in the ring
+ *	head.  Returns the number of iocbs submitted by this call (always 0
+ *	for SQPOLL), -EINVAL for an invalid context or flags, or -EINTR if
+ *	interrupted while waiting.
+ */
+SYSCALL_DEFINE4(io_ring_enter, aio_context_t, ctx_id, unsigned, to_submit,
+		unsigned, min_complete, unsigned, flags)
+{
+	struct kioctx *ctx;
+	long ret = -EINVAL;
+	int submitted = 0;
+
+	ctx = lookup_ioctx(ctx_id);
+	if (unlikely(!ctx))
+		return -EINVAL;
+
+	if (!ctx->sq_pages ||
+	    (flags & ~(IORING_ENTER_GETEVENTS | IORING_ENTER_SQ_WAKEUP)))
+		goto out;
+
+	if (ctx->sq_thread) {
+		if (to_submit || (flags & IORING_ENTER_SQ_WAKEUP))
+			wake_up(&ctx->sq_wait);
+	} else if (to_submit) {
+		submitted = aio_submit_sq(ctx, to_submit);
+	}
+
+	ret = 0;
+	if (flags & IORING_ENTER_GETEVENTS) {
+		min_complete = min(min_complete, ctx->nr_events - 1);
+		ret = wait_event_interruptible(ctx->wait,
+				aio_cq_ready(ctx) >= min_complete ||
+				atomic_read(&ctx->dead));
+		if (ret)
+			ret = -EINTR;
+	}
+	if (submitted)
+		ret = submitted;
+out:
+	put_ioctx(ctx);
+	return ret;
+}
+
 /* lookup_kiocb
  *	Finds a given iocb for cancellation.
  */
@@ -164,14 +164,165 @@ blkdev_get_block(struct inode *inode, sector_t iblock,
 	return 0;
 }
 
+/*
+ * Synchronous O_DIRECT of at most this many pages skips the generic
+ * direct-io code and goes out as a single bio built on the stack.
+ */
+#define DIO_INLINE_BIO_VECS	4
+
+static void blkdev_bio_end_io_simple(struct bio *bio, int error)
+{
+	struct task_struct *waiter = bio->bi_private;
+
+	ACCESS_ONCE(bio->bi_private) = NULL;
+	wake_up_process(waiter);
+}
+
+/*
+ * Number of pages the fast path would need for @iov, or 0 if the request
+ * is misaligned or too big for it.  Misaligned requests are left to the
+ * generic code, which fails them with -EINVAL.  So are requests crossing
+ * the end of the device, which the generic code turns into short I/O.
+ */
+static int blkdev_dio_simple_pages(struct block_device *bdev,
+		const struct iovec *iov, loff_t offset, unsigned long nr_segs)
+{
+	unsigned int blkmask = bdev_logical_block_size(bdev) - 1;
+	unsigned long seg, addr, len;
+	loff_t end = offset;
+	int nr_pages = 0;
+
+	if (offset & blkmask)
+		return 0;
+
+	for (seg = 0; seg < nr_segs; seg++) {
+		addr = (unsigned long)iov[seg].iov_base;
+		len = iov[seg].iov_len;
+
+		if ((addr | len) & blkmask)
+			return 0;
+		if (!len)
+			continue;
+
+		nr_pages += ((addr + len + PAGE_SIZE - 1) >> PAGE_SHIFT) -
+			    (addr >> PAGE_SHIFT);
+		if (nr_pages > DIO_INLINE_BIO_VECS)
+			return 0;
+		end += len;
+	}
+
+	if (end > i_size_read(bdev->bd_inode))
+		return 0;
+
+	return nr_pages;
+}
+
+/*
+ * Small synchronous O_DIRECT on a block device: pin the user pages, map
+ * them into one bio on the stack and wait for it, polling if the queue
+ * has io_poll enabled.  There are no blocks to look up and no buffer
+ * heads to worry about, so none of the dio/dio_submit machinery is
+ * needed.  Returns -EAGAIN if the request has to take the generic path.
+ */
+static ssize_t
+__blkdev_direct_IO_simple(int rw, struct kiocb *iocb, struct block_device *bdev,
+		const struct iovec *iov, loff_t offset, unsigned long nr_segs)
+{
+	struct inode *inode = iocb->ki_filp->f_mapping->host;
+	struct page *pages[DIO_INLINE_BIO_VECS];
+	struct bio_vec vecs[DIO_INLINE_BIO_VECS];
+	struct bio_vec *bvec;
+	unsigned long seg, addr, len;
+	unsigned int poff, plen;
+	ssize_t ret;
+	struct bio bio;
+	int i, n, got = 0;
+
+	bio_init(&bio);
+	bio.bi_io_vec = vecs;
+	bio.bi_max_vecs = DIO_INLINE_BIO_VECS;
+	bio.bi_bdev = bdev;
+	bio.bi_sector = offset >> 9;
+	bio.bi_private = current;
+	bio.bi_end_io = blkdev_bio_end_io_simple;
+
+	for (seg = 0; seg < nr_segs; seg++) {
+		addr = (unsigned long)iov[seg].iov_base;
+		len = iov[seg].iov_len;
+		if (!len)
+			continue;
+
+		n = ((addr + len + PAGE_SIZE - 1) >> PAGE_SHIFT) -
+		    (addr >> PAGE_SHIFT);
+		ret = get_user_pages_fast(addr, n, rw == READ, pages + got);
+		if (ret > 0)
+			got += ret;
+		if (ret != n) {
+			ret = ret < 0 ? ret : -EFAULT;
+			goto out_put;
+		}
+
+		for (i = got - n; i < got; i++) {
+			poff = addr & (PAGE_SIZE - 1);
+			plen = min_t(unsigned long, PAGE_SIZE - poff, len);
+			if (bio_add_page(&bio, pages[i], plen, poff) != plen) {
+				ret = -EAGAIN;
+				goto out_put;
+			}
+			addr += plen;
+			len -= plen;
+		}
+	}
+
+	ret = bio.bi_size;
+	atomic_inc(&inode->i_dio_count);
+	submit_bio(rw == WRITE ? WRITE_ODIRECT : READ, &bio);
+
+	for (;;) {
+		set_current_state(TASK_UNINTERRUPTIBLE);
+		if (!ACCESS_ONCE(bio.bi_private))
+			break;
+		if (!blk_poll(bdev_get_queue(bdev), bio.bi_cookie))
+			io_schedule();
+	}
+	__set_current_state(TASK_RUNNING);
+	inode_dio_done(inode);
+
+	if (!test_bit(BIO_UPTODATE, &bio.bi_flags))
+		ret = -EIO;
+
+	bio_for_each_segment_all(bvec, &bio, i) {
+		if (rw == READ && !PageCompound(bvec->bv_page))
+			set_page_dirty_lock(bvec->bv_page);
+	}
+
+	/* drop the cgroup and integrity state submission attached */
+	bio_reset(&bio);
+
+out_put:
+	for (i = 0; i < got; i++)
+		page_cache_release(pages[i]);
+	return ret;
+}
+
 static ssize_t
 blkdev_direct_IO(int rw, struct kiocb *iocb, const struct iovec *iov,
 			loff_t offset, unsigned long nr_segs)
 {
 	struct file *file = iocb->ki_filp;
 	struct inode *inode = file->f_mapping->host;
+	struct block_device *bdev = I_BDEV(inode);
+	ssize_t ret;
+
+	if (is_sync_kiocb(iocb) &&
+	    blkdev_dio_simple_pages(bdev, iov, offset, nr_segs)) {
+		ret = __blkdev_direct_IO_simple(rw, iocb, bdev, iov, offset,
+						nr_segs);
+		if (ret != -EAGAIN)
+			return ret;
+	}
 
-	return __blockdev_direct_IO(rw, iocb, inode, I_BDEV(inode), iov, offset,
+	return __blockdev_direct_IO(rw, iocb, inode, bdev, iov, offset,
 				    nr_segs, blkdev_get_block, NULL, NULL, 0);
 }
 
@@ -1470,6 +1621,8 @@ static void __blkdev_put(struct block_device *bdev, fmode_t mode, int for_part)
 	if (!--bdev->bd_openers) {
 		WARN_ON_ONCE(bdev->bd_holders);
 		sync_blockdev(bdev);
+		if (bdev->bd_contains == bdev)
+			blkdev_flush_discards(bdev);
 		kill_bdev(bdev);
 		/* ->release can cause the old bdi to disappear,
 		 * so must switch it out first
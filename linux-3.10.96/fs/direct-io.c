@@ -131,6 +131,8 @@ struct dio {
 	unsigned long refcount;		/* direct_io_worker() and bios */
 	struct bio *bio_list;		/* singly linked via bi_private */
 	struct task_struct *waiter;	/* waiting task (NULL if none) */
+	struct block_device *bio_bdev;	/* bdev of the last submitted bio */
+	blk_qc_t bio_cookie;		/* poll cookie of the last bio */
 
 	/* AIO related stuff */
 	struct kiocb *iocb;		/* kiocb */
@@ -386,6 +388,15 @@ static inline void dio_bio_submit(struct dio *dio, struct dio_submit *sdio)
 	else
 		submit_bio(dio->rw, bio);
 
+	/*
+	 * Synchronous bios are only freed by dio_bio_complete() in this
+	 * context, so the cookie can be read back after submission.
+	 */
+	if (!dio->is_async) {
+		dio->bio_bdev = bio->bi_bdev;
+		dio->bio_cookie = bio->bi_cookie;
+	}
+
 	sdio->bio = NULL;
 	sdio->boundary = 0;
 	sdio->logical_offset_in_bio = 0;
@@ -400,6 +411,18 @@ static inline void dio_cleanup(struct dio *dio, struct dio_submit *sdio)
 		page_cache_release(dio_get_page(dio, sdio));
 }
 
+/*
+ * Synchronous reads on a queue with io_poll enabled spin (or hybrid sleep)
+ * on the last submitted request instead of sleeping on the completion irq.
+ */
+static bool dio_poll(struct dio *dio)
+{
+	if (dio->is_async || (dio->rw & WRITE) || !dio->bio_bdev)
+		return false;
+
+	return blk_poll(bdev_get_queue(dio->bio_bdev), dio->bio_cookie);
+}
+
 /*
  * Wait for the next BIO to complete.  Remove it and return it.  NULL is
  * returned once all BIOs have been completed.  This must only be called once
@@ -423,7 +446,8 @@ static struct bio *dio_await_one(struct dio *dio)
 		__set_current_state(TASK_UNINTERRUPTIBLE);
 		dio->waiter = current;
 		spin_unlock_irqrestore(&dio->bio_lock, flags);
-		io_schedule();
+		if (!dio_poll(dio))
+			io_schedule();
 		/* wake up sets us TASK_RUNNING */
 		spin_lock_irqsave(&dio->bio_lock, flags);
 		dio->waiter = NULL;
@@ -23,6 +23,7 @@
 #include <linux/poll.h>
 #include <linux/string.h>
 #include <linux/list.h>
+#include <linux/llist.h>
 #include <linux/hash.h>
 #include <linux/spinlock.h>
 #include <linux/syscalls.h>
@@ -34,6 +35,8 @@
 #include <linux/mutex.h>
 #include <linux/anon_inodes.h>
 #include <linux/device.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
 #include <asm/uaccess.h>
 #include <asm/io.h>
 #include <asm/mman.h>
@@ -48,14 +51,19 @@
  *
  * 1) epmutex (mutex)
  * 2) ep->mtx (mutex)
- * 3) ep->lock (spinlock)
+ * 3) ep->wq.lock (spinlock)
  *
  * The acquire order is the one listed above, from 1 to 3.
- * We need a spinlock (ep->lock) because we manipulate objects
- * from inside the poll callback, that might be triggered from
- * a wake_up() that in turn might be called from IRQ context.
- * So we can't sleep inside the poll callback and hence we need
- * a spinlock. During the event transfer loop (from kernel to
+ * The poll callback might be triggered from a wake_up() that in turn
+ * might be called from IRQ context, so it can't sleep. It doesn't take
+ * any epoll lock either: ready items are pushed on the lock-less
+ * ep->rdllq list, and an item is claimed for queueing with a cmpxchg()
+ * on its ->rdlnode, so every item sits at most once on that list.
+ * Consumers move the whole ep->rdllq to ep->rdllist in one go, under
+ * "ep->mtx", which is what protects ep->rdllist. The only spinlock left
+ * is the one of the ep->wq wait queue, held while adding and removing
+ * sleepers and while waking them up.
+ * During the event transfer loop (from kernel to
  * user space) we could end up sleeping due a copy_to_user(), so
  * we need a lock that will allow us to sleep. This lock is a
  * mutex (ep->mtx). It is acquired during the event transfer loop,
@@ -83,15 +91,21 @@
  * of epoll file descriptors, we use the current recursion depth as
  * the lockdep subkey.
  * It is possible to drop the "ep->mtx" and to use the global
- * mutex "epmutex" (together with "ep->lock") to have it working,
- * but having "ep->mtx" will make the interface more scalable.
+ * mutex "epmutex" to have it working, but having "ep->mtx" will
+ * make the interface more scalable.
  * Events that require holding "epmutex" are very rare, while for
  * normal operations the epoll private "ep->mtx" will guarantee
  * a better scalability.
  */
 
 /* Epoll private bits inside the event mask */
-#define EP_PRIVATE_BITS (EPOLLWAKEUP | EPOLLONESHOT | EPOLLET)
+#define EP_PRIVATE_BITS (EPOLLWAKEUP | EPOLLONESHOT | EPOLLET | EPOLLETKEY)
+
+/*
+ * Set inside epitem->revents when a wakeup came without a key, so the
+ * EPOLLETKEY delivery has to fall back to f_op->poll().
+ */
+#define EP_REVENTS_POLL (1U << 31)
 
 /* Maximum number of nesting allowed inside epoll sets */
 #define EP_MAX_NESTS 4
@@ -102,6 +116,12 @@
 
 #define EP_ITEM_COST (sizeof(struct epitem) + sizeof(struct eppoll_entry))
 
+/* Largest event ring that can be mapped on an epoll file */
+#define EP_RING_MAX_ENTRIES (1U << 16)
+
+/* Upper bound of the "busy_poll_usecs" sysctl */
+#define EP_BUSY_POLL_MAX_USECS 1000
+
 struct epoll_filefd {
 	struct file *file;
 	int fd;
@@ -140,10 +160,10 @@ struct epitem {
 	struct list_head rdllink;
 
 	/*
-	 * Works together "struct eventpoll"->ovflist in keeping the
-	 * single linked chain of items.
+	 * Links the item to "struct eventpoll"->rdllq. The node's next
+	 * pointer is EP_UNACTIVE_PTR while the item is not queued there.
 	 */
-	struct epitem *next;
+	struct llist_node rdlnode;
 
 	/* The file descriptor information this item refers to */
 	struct epoll_filefd ffd;
@@ -151,6 +171,9 @@ struct epitem {
 	/* Number of active wait queue attached to poll operations */
 	int nwait;
 
+	/* Wakeup keys collected for EPOLLETKEY, consumed on delivery */
+	unsigned int revents;
+
 	/* List containing poll wait queues */
 	struct list_head pwqlist;
 
@@ -173,9 +196,6 @@ struct epitem {
  * interface.
  */
 struct eventpoll {
-	/* Protect the access to this structure */
-	spinlock_t lock;
-
 	/*
 	 * This mutex is used to ensure that files are not removed
 	 * while epoll is using them. This is held during the event
@@ -184,28 +204,45 @@ struct eventpoll {
 	 */
 	struct mutex mtx;
 
-	/* Wait queue used by sys_epoll_wait() */
+	/* Wait queue used by sys_epoll_wait(), its lock is the "ep->wq.lock" */
 	wait_queue_head_t wq;
 
 	/* Wait queue used by file->poll() */
 	wait_queue_head_t poll_wait;
 
-	/* List of ready file descriptors */
+	/* List of ready file descriptors, protected by "mtx" */
 	struct list_head rdllist;
 
-	/* RB tree root used to store monitored fd structs */
-	struct rb_root rbr;
-
 	/*
-	 * This is a single linked list that chains all the "struct epitem" that
-	 * happened while transferring ready events to userspace w/out
-	 * holding ->lock.
+	 * Lock-less list the poll callback pushes ready items on. It is
+	 * drained into "rdllist" by whoever holds "mtx".
 	 */
-	struct epitem *ovflist;
+	struct llist_head rdllq;
+
+	/* RB tree root used to store monitored fd structs */
+	struct rb_root rbr;
 
 	/* wakeup_source used when ep_scan_ready_list is running */
 	struct wakeup_source *ws;
 
+	/*
+	 * Event ring shared with userspace, set up by the first mmap() of
+	 * the epoll file under "ring_mtx" and never changed after that. The
+	 * poll callback posts on it under "ring_lock", "ring_tail" is our
+	 * private copy of the producer index, the one in the ring can be
+	 * scribbled on. ->mmap() runs under mmap_sem, which the event
+	 * transfer loop can take faulting with "mtx" held, so the setup
+	 * mustn't take "mtx". "ring_items" records the item behind each
+	 * slot, out of reach of userspace.
+	 */
+	struct epoll_ring *ring;
+	struct epitem **ring_items;
+	unsigned long ring_size;
+	unsigned int ring_entries;
+	unsigned int ring_tail;
+	spinlock_t ring_lock;
+	struct mutex ring_mtx;
+
 	/* The user that created the eventpoll descriptor */
 	struct user_struct *user;
 
@@ -252,6 +289,9 @@ struct ep_send_events_data {
 /* Maximum number of epoll watched descriptors, per user */
 static long max_user_watches __read_mostly;
 
+/* Microseconds ep_poll() spins waiting for events before it sleeps */
+static long busy_poll_usecs __read_mostly;
+
 /*
  * This mutex is used to serialize ep_free() and eventpoll_release_file().
  */
@@ -287,6 +327,7 @@ static LIST_HEAD(tfile_check_list);
 
 static long zero;
 static long long_max = LONG_MAX;
+static long busy_poll_max = EP_BUSY_POLL_MAX_USECS;
 
 ctl_table epoll_table[] = {
 	{
@@ -298,6 +339,15 @@ ctl_table epoll_table[] = {
 		.extra1		= &zero,
 		.extra2		= &long_max,
 	},
+	{
+		.procname	= "busy_poll_usecs",
+		.data		= &busy_poll_usecs,
+		.maxlen		= sizeof(busy_poll_usecs),
+		.mode		= 0644,
+		.proc_handler	= proc_doulongvec_minmax,
+		.extra1		= &zero,
+		.extra2		= &busy_poll_max,
+	},
 	{ }
 };
 #endif /* CONFIG_SYSCTL */
@@ -361,6 +411,14 @@ static void ep_nested_calls_init(struct nested_calls *ncalls)
 	spin_lock_init(&ncalls->lock);
 }
 
+/* Tells if the event ring holds events userspace did not consume yet */
+static inline int ep_ring_ready(struct eventpoll *ep)
+{
+	struct epoll_ring *ring = ACCESS_ONCE(ep->ring);
+
+	return ring && ACCESS_ONCE(ring->head) != ACCESS_ONCE(ep->ring_tail);
+}
+
 /**
  * ep_events_available - Checks if ready events might be available.
  *
@@ -371,7 +429,43 @@ static void ep_nested_calls_init(struct nested_calls *ncalls)
  */
 static inline int ep_events_available(struct eventpoll *ep)
 {
-	return !list_empty(&ep->rdllist) || ep->ovflist != EP_UNACTIVE_PTR;
+	return !list_empty_careful(&ep->rdllist) || !llist_empty(&ep->rdllq) ||
+	       ep_ring_ready(ep);
+}
+
+/*
+ * Wake up a sys_epoll_wait() sleeper after something was added to
+ * ep->rdllist. The barrier pairs with set_current_state() in ep_poll(),
+ * which checks the lists without taking "mtx".
+ */
+static inline void ep_wake_up(struct eventpoll *ep)
+{
+	smp_mb();
+	if (waitqueue_active(&ep->wq))
+		wake_up(&ep->wq);
+}
+
+/* Tells if the item is currently queued on ep->rdllq */
+static inline int ep_is_queued(struct epitem *epi)
+{
+	return ACCESS_ONCE(epi->rdlnode.next) != EP_UNACTIVE_PTR;
+}
+
+/*
+ * Accumulate the wakeup key of an EPOLLETKEY item. This runs from the
+ * poll callback concurrently with other callbacks of the same item, and
+ * with the xchg() done on delivery.
+ */
+static inline void ep_add_revents(struct epitem *epi, unsigned int bits)
+{
+	unsigned int old, new;
+
+	do {
+		old = ACCESS_ONCE(epi->revents);
+		new = old | bits;
+		if (old == new)
+			return;
+	} while (cmpxchg(&epi->revents, old, new) != old);
 }
 
 /**
@@ -571,6 +665,147 @@ static inline void ep_pm_stay_awake_rcu(struct epitem *epi)
 	rcu_read_unlock();
 }
 
+/**
+ * ep_ring_post - Posts an event straight on the ring mapped by userspace.
+ *
+ * @ep: Pointer to the epoll private data structure.
+ * @epi: The item the wakeup is for.
+ * @revents: The events carried by the wakeup key.
+ *
+ * Only plain EPOLLETKEY items go through the ring: their events come with
+ * the wakeup, so nothing has to be polled or re-armed later. ONESHOT and
+ * WAKEUP items need "mtx" on delivery and keep using the ready list.
+ *
+ * Returns: true if the event is on the ring, false if the caller has to
+ *          queue the item on the ready list instead. That is also what
+ *          happens when the ring is full, ring->overflow counts those.
+ */
+static bool ep_ring_post(struct eventpoll *ep, struct epitem *epi,
+			 unsigned int revents)
+{
+	struct epoll_ring *ring = ACCESS_ONCE(ep->ring);
+	struct epoll_event *uevent;
+	unsigned long flags;
+	unsigned int tail;
+	bool posted = false;
+
+	if (!ring || (epi->event.events &
+		      (EPOLLETKEY | EPOLLONESHOT | EPOLLWAKEUP)) != EPOLLETKEY)
+		return false;
+
+	spin_lock_irqsave(&ep->ring_lock, flags);
+	tail = ep->ring_tail;
+	if (tail - ACCESS_ONCE(ring->head) < ep->ring_entries) {
+		uevent = &ring->events[tail & (ep->ring_entries - 1)];
+		uevent->events = revents;
+		uevent->data = epi->event.data;
+		ep->ring_items[tail & (ep->ring_entries - 1)] = epi;
+
+		/* Make the entry visible before the index that covers it */
+		smp_wmb();
+		ep->ring_tail = ++tail;
+		ring->tail = tail;
+		posted = true;
+	} else {
+		ring->overflow++;
+	}
+	spin_unlock_irqrestore(&ep->ring_lock, flags);
+
+	return posted;
+}
+
+/**
+ * ep_ring_scrub - Clears the ring entries of an item being removed.
+ *
+ * @ep: Pointer to the epoll private data structure.
+ * @epi: The item being removed, its poll callbacks already unregistered.
+ *
+ * Entries posted for the item but not consumed yet would hand userspace
+ * an epoll_data that may already point to freed memory, so they are
+ * turned into empty (zero events) entries. They are found through
+ * ep->ring_items, by item rather than by data: several items may carry
+ * the same data, and userspace can rewrite the entries.
+ */
+static void ep_ring_scrub(struct eventpoll *ep, struct epitem *epi)
+{
+	struct epoll_ring *ring;
+	unsigned long flags;
+	unsigned int idx, tail;
+
+	if (!ACCESS_ONCE(ep->ring))
+		return;
+
+	/* The ring may be set up concurrently, see it whole under the lock */
+	spin_lock_irqsave(&ep->ring_lock, flags);
+	ring = ep->ring;
+	tail = ep->ring_tail;
+	idx = ACCESS_ONCE(ring->head);
+	if (tail - idx > ep->ring_entries)
+		idx = tail - ep->ring_entries;
+	for (; idx != tail; idx++) {
+		unsigned int slot = idx & (ep->ring_entries - 1);
+
+		if (ep->ring_items[slot] == epi) {
+			ring->events[slot].events = 0;
+			ep->ring_items[slot] = NULL;
+		}
+	}
+	spin_unlock_irqrestore(&ep->ring_lock, flags);
+}
+
+/**
+ * ep_drain_ready - Moves the items queued by the poll callback on the
+ *                  lock-less ep->rdllq to the tail of ep->rdllist.
+ *
+ * @ep: Pointer to the epoll private data structure.
+ *
+ * The whole list is stolen with a single xchg(), so a consumer picks up
+ * every wakeup that happened since the previous drain at once. Must be
+ * called with "mtx" held.
+ */
+static void ep_drain_ready(struct eventpoll *ep)
+{
+	struct llist_node *node, *next;
+	struct epitem *epi;
+	LIST_HEAD(batch);
+
+	node = llist_del_all(&ep->rdllq);
+	while (node) {
+		epi = llist_entry(node, struct epitem, rdlnode);
+		next = node->next;
+
+		/*
+		 * The list comes out in LIFO order, adding each item at the
+		 * head of "batch" restores the order of the wakeups.
+		 */
+		if (!ep_is_linked(&epi->rdllink))
+			list_add(&epi->rdllink, &batch);
+		ep_pm_stay_awake(epi);
+
+		/*
+		 * Re-arm the item. From here on the poll callback can queue
+		 * it again, which rewrites node->next, hence the read above.
+		 */
+		smp_mb();
+		epi->rdlnode.next = EP_UNACTIVE_PTR;
+		node = next;
+	}
+	list_splice_tail(&batch, &ep->rdllist);
+}
+
+/*
+ * Take the item off both ready lists. Its poll wait queues must have been
+ * unregistered already, so no callback can queue it again. Must be called
+ * with "mtx" held.
+ */
+static void ep_unqueue(struct eventpoll *ep, struct epitem *epi)
+{
+	if (ep_is_queued(epi))
+		ep_drain_ready(ep);
+	if (ep_is_linked(&epi->rdllink))
+		list_del_init(&epi->rdllink);
+}
+
 /**
  * ep_scan_ready_list - Scans the ready list in a way that makes possible for
  *                      the scan code, to call f_op->poll(). Also allows for
@@ -590,8 +825,6 @@ static int ep_scan_ready_list(struct eventpoll *ep,
 			      int depth)
 {
 	int error, pwake = 0;
-	unsigned long flags;
-	struct epitem *epi, *nepi;
 	LIST_HEAD(txlist);
 
 	/*
@@ -601,66 +834,37 @@ static int ep_scan_ready_list(struct eventpoll *ep,
 	mutex_lock_nested(&ep->mtx, depth);
 
 	/*
-	 * Steal the ready list, and re-init the original one to the
-	 * empty list. Also, set ep->ovflist to NULL so that events
-	 * happening while looping w/out locks, are not lost. We cannot
-	 * have the poll callback to queue directly on ep->rdllist,
-	 * because we want the "sproc" callback to be able to do it
-	 * in a lockless way.
+	 * Collect everything the poll callback queued so far, and steal
+	 * the ready list. "rdllist" is only touched with "mtx" held, so
+	 * the "sproc" callback can re-queue items on it without any lock,
+	 * while wakeups happening meanwhile simply pile up on ep->rdllq.
 	 */
-	spin_lock_irqsave(&ep->lock, flags);
+	ep_drain_ready(ep);
 	list_splice_init(&ep->rdllist, &txlist);
-	ep->ovflist = NULL;
-	spin_unlock_irqrestore(&ep->lock, flags);
 
 	/*
 	 * Now call the callback function.
 	 */
 	error = (*sproc)(ep, &txlist, priv);
 
-	spin_lock_irqsave(&ep->lock, flags);
-	/*
-	 * During the time we spent inside the "sproc" callback, some
-	 * other events might have been queued by the poll callback.
-	 * We re-insert them inside the main ready-list here.
-	 */
-	for (nepi = ep->ovflist; (epi = nepi) != NULL;
-	     nepi = epi->next, epi->next = EP_UNACTIVE_PTR) {
-		/*
-		 * We need to check if the item is already in the list.
-		 * During the "sproc" callback execution time, items are
-		 * queued into ->ovflist but the "txlist" might already
-		 * contain them, and the list_splice() below takes care of them.
-		 */
-		if (!ep_is_linked(&epi->rdllink)) {
-			list_add_tail(&epi->rdllink, &ep->rdllist);
-			ep_pm_stay_awake(epi);
-		}
-	}
 	/*
-	 * We need to set back ep->ovflist to EP_UNACTIVE_PTR, so that after
-	 * releasing the lock, events will be queued in the normal way inside
-	 * ep->rdllist.
-	 */
-	ep->ovflist = EP_UNACTIVE_PTR;
-
-	/*
-	 * Quickly re-inject items left on "txlist".
+	 * Quickly re-inject items left on "txlist", and pick up the items
+	 * queued while "sproc" was running. The latter also re-activates
+	 * their wakeup sources before ep->ws is released.
 	 */
 	list_splice(&txlist, &ep->rdllist);
+	ep_drain_ready(ep);
 	__pm_relax(ep->ws);
 
 	if (!list_empty(&ep->rdllist)) {
 		/*
 		 * Wake up (if active) both the eventpoll wait list and
-		 * the ->poll() wait list (delayed after we release the lock).
+		 * the ->poll() wait list.
 		 */
-		if (waitqueue_active(&ep->wq))
-			wake_up_locked(&ep->wq);
+		ep_wake_up(ep);
 		if (waitqueue_active(&ep->poll_wait))
 			pwake++;
 	}
-	spin_unlock_irqrestore(&ep->lock, flags);
 
 	mutex_unlock(&ep->mtx);
 
@@ -677,19 +881,17 @@ static int ep_scan_ready_list(struct eventpoll *ep,
  */
 static int ep_remove(struct eventpoll *ep, struct epitem *epi)
 {
-	unsigned long flags;
 	struct file *file = epi->ffd.file;
 
 	/*
-	 * Removes poll wait queue hooks. We _have_ to do this without holding
-	 * the "ep->lock" otherwise a deadlock might occur. This because of the
-	 * sequence of the lock acquisition. Here we do "ep->lock" then the wait
-	 * queue head lock when unregistering the wait queue. The wakeup callback
-	 * will run by holding the wait queue head lock and will call our callback
-	 * that will try to get "ep->lock".
+	 * Removes poll wait queue hooks. Once this is done no poll callback
+	 * can run for the item anymore, so it can be taken off ep->rdllq
+	 * below without racing with a new wakeup.
 	 */
 	ep_unregister_pollwait(ep, epi);
 
+	ep_ring_scrub(ep, epi);
+
 	/* Remove the current item from the list of epoll hooks */
 	spin_lock(&file->f_lock);
 	if (ep_is_linked(&epi->fllink))
@@ -698,10 +900,7 @@ static int ep_remove(struct eventpoll *ep, struct epitem *epi)
 
 	rb_erase(&epi->rbn, &ep->rbr);
 
-	spin_lock_irqsave(&ep->lock, flags);
-	if (ep_is_linked(&epi->rdllink))
-		list_del_init(&epi->rdllink);
-	spin_unlock_irqrestore(&ep->lock, flags);
+	ep_unqueue(ep, epi);
 
 	wakeup_source_unregister(ep_wakeup_source(epi));
 
@@ -745,9 +944,8 @@ static void ep_free(struct eventpoll *ep)
 	 * Walks through the whole tree by freeing each "struct epitem". At this
 	 * point we are sure no poll callbacks will be lingering around, and also by
 	 * holding "epmutex" we can be sure that no file cleanup code will hit
-	 * us during this operation. So we can avoid the lock on "ep->lock".
-	 * We do not need to lock ep->mtx, either, we only do it to prevent
-	 * a lockdep warning.
+	 * us during this operation. We do not need to lock ep->mtx, either,
+	 * we only do it to prevent a lockdep warning.
 	 */
 	mutex_lock(&ep->mtx);
 	while ((rbp = rb_first(&ep->rbr)) != NULL) {
@@ -758,8 +956,14 @@ static void ep_free(struct eventpoll *ep)
 
 	mutex_unlock(&epmutex);
 	mutex_destroy(&ep->mtx);
+	mutex_destroy(&ep->ring_mtx);
+	if (ep->ring)
+		atomic_long_sub(ep->ring_size >> PAGE_SHIFT,
+				&ep->user->locked_vm);
 	free_uid(ep->user);
 	wakeup_source_unregister(ep->ws);
+	vfree(ep->ring_items);
+	vfree(ep->ring);
 	kfree(ep);
 }
 
@@ -818,6 +1022,10 @@ static unsigned int ep_eventpoll_poll(struct file *file, poll_table *wait)
 	/* Insert inside our poll wait queue */
 	poll_wait(file, &ep->poll_wait, wait);
 
+	/* Events waiting on the ring don't need the ready list walk */
+	if (ep_ring_ready(ep))
+		return POLLIN | POLLRDNORM;
+
 	/*
 	 * Proceed to find out if wanted events are really available inside
 	 * the ready list. This need to be done under ep_call_nested()
@@ -830,6 +1038,86 @@ static unsigned int ep_eventpoll_poll(struct file *file, poll_table *wait)
 	return pollflags != -1 ? pollflags : 0;
 }
 
+/*
+ * Set up the event ring with the first mmap() of the epoll file, sized
+ * after the mapping. Later mappings must have the same size and share
+ * the same ring. The ring stays in memory as long as the epoll file, so
+ * it is charged to the user's locked memory, like other pages userspace
+ * can pin through a mapping.
+ */
+static int ep_ring_alloc(struct eventpoll *ep, unsigned long size)
+{
+	unsigned long limit = rlimit(RLIMIT_MEMLOCK) >> PAGE_SHIFT;
+	unsigned long pages = size >> PAGE_SHIFT;
+	struct epoll_ring *ring;
+	struct epitem **items;
+	unsigned long entries;
+
+	if (size <= sizeof(struct epoll_ring) ||
+	    size > PAGE_ALIGN(sizeof(struct epoll_ring) +
+			      EP_RING_MAX_ENTRIES * sizeof(struct epoll_event)))
+		return -EINVAL;
+	entries = (size - sizeof(struct epoll_ring)) /
+		sizeof(struct epoll_event);
+	if (!entries)
+		return -EINVAL;
+	entries = rounddown_pow_of_two(entries);
+
+	if (atomic_long_add_return(pages, &ep->user->locked_vm) > limit &&
+	    !capable(CAP_IPC_LOCK)) {
+		atomic_long_sub(pages, &ep->user->locked_vm);
+		return -EPERM;
+	}
+
+	items = vzalloc(entries * sizeof(*items));
+	ring = vmalloc_user(size);
+	if (!items || !ring) {
+		vfree(items);
+		vfree(ring);
+		atomic_long_sub(pages, &ep->user->locked_vm);
+		return -ENOMEM;
+	}
+
+	ring->mask = entries - 1;
+	ring->entries = entries;
+	ring->header_length = sizeof(struct epoll_ring);
+
+	spin_lock_irq(&ep->ring_lock);
+	ep->ring_size = size;
+	ep->ring_entries = entries;
+	ep->ring_tail = 0;
+	ep->ring_items = items;
+
+	/* The poll callback looks at ep->ring without any lock */
+	smp_wmb();
+	ep->ring = ring;
+	spin_unlock_irq(&ep->ring_lock);
+
+	return 0;
+}
+
+static int ep_eventpoll_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct eventpoll *ep = file->private_data;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	int error = 0;
+
+	/* Both sides must see the same pages */
+	if (vma->vm_pgoff || !(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+
+	mutex_lock(&ep->ring_mtx);
+	if (!ep->ring)
+		error = ep_ring_alloc(ep, size);
+	else if (size != ep->ring_size)
+		error = -EINVAL;
+	if (!error)
+		error = remap_vmalloc_range(vma, ep->ring, 0);
+	mutex_unlock(&ep->ring_mtx);
+
+	return error;
+}
+
 #ifdef CONFIG_PROC_FS
 static int ep_show_fdinfo(struct seq_file *m, struct file *f)
 {
@@ -860,6 +1148,7 @@ static const struct file_operations eventpoll_fops = {
 #endif
 	.release	= ep_eventpoll_release,
 	.poll		= ep_eventpoll_poll,
+	.mmap		= ep_eventpoll_mmap,
 	.llseek		= noop_llseek,
 };
 
@@ -914,13 +1203,14 @@ static int ep_alloc(struct eventpoll **pep)
 	if (unlikely(!ep))
 		goto free_uid;
 
-	spin_lock_init(&ep->lock);
 	mutex_init(&ep->mtx);
 	init_waitqueue_head(&ep->wq);
 	init_waitqueue_head(&ep->poll_wait);
 	INIT_LIST_HEAD(&ep->rdllist);
+	init_llist_head(&ep->rdllq);
+	spin_lock_init(&ep->ring_lock);
+	mutex_init(&ep->ring_mtx);
 	ep->rbr = RB_ROOT;
-	ep->ovflist = EP_UNACTIVE_PTR;
 	ep->user = user;
 
 	*pep = ep;
@@ -968,8 +1258,6 @@ static struct epitem *ep_find(struct eventpoll *ep, struct file *file, int fd)
  */
 static int ep_poll_callback(wait_queue_t *wait, unsigned mode, int sync, void *key)
 {
-	int pwake = 0;
-	unsigned long flags;
 	struct epitem *epi = ep_item_from_wait(wait);
 	struct eventpoll *ep = epi->ep;
 
@@ -984,8 +1272,6 @@ static int ep_poll_callback(wait_queue_t *wait, unsigned mode, int sync, void *k
 		list_del_init(&wait->task_list);
 	}
 
-	spin_lock_irqsave(&ep->lock, flags);
-
 	/*
 	 * If the event mask does not contain any poll(2) event, we consider the
 	 * descriptor to be disabled. This condition is likely the effect of the
@@ -993,7 +1279,7 @@ static int ep_poll_callback(wait_queue_t *wait, unsigned mode, int sync, void *k
 	 * until the next EPOLL_CTL_MOD will be issued.
 	 */
 	if (!(epi->event.events & ~EP_PRIVATE_BITS))
-		goto out_unlock;
+		return 1;
 
 	/*
 	 * Check the events coming with the callback. At this stage, not
@@ -1002,50 +1288,53 @@ static int ep_poll_callback(wait_queue_t *wait, unsigned mode, int sync, void *k
 	 * test for "key" != NULL before the event match test.
 	 */
 	if (key && !((unsigned long) key & epi->event.events))
-		goto out_unlock;
+		return 1;
 
 	/*
-	 * If we are transferring events to userspace, we can hold no locks
-	 * (because we're accessing user memory, and because of linux f_op->poll()
-	 * semantics). All the events that happen during that period of time are
-	 * chained in ep->ovflist and requeued later on.
+	 * If userspace mapped an event ring, hand it the event right away,
+	 * it won't even need to enter the kernel to pick it up.
 	 */
-	if (unlikely(ep->ovflist != EP_UNACTIVE_PTR)) {
-		if (epi->next == EP_UNACTIVE_PTR) {
-			epi->next = ep->ovflist;
-			ep->ovflist = epi;
-			if (epi->ws) {
-				/*
-				 * Activate ep->ws since epi->ws may get
-				 * deactivated at any time.
-				 */
-				__pm_stay_awake(ep->ws);
-			}
-
-		}
-		goto out_unlock;
+	if (key && ep_ring_post(ep, epi, (unsigned long) key & epi->event.events)) {
+		/* Pairs with set_current_state() in ep_poll() */
+		smp_mb();
+		goto out_wakeup;
 	}
 
-	/* If this file is already in the ready list we exit soon */
-	if (!ep_is_linked(&epi->rdllink)) {
-		list_add_tail(&epi->rdllink, &ep->rdllist);
+	/*
+	 * Record what the wakeup reported before queueing the item, so that
+	 * the consumer finding it on the ready list also finds the key.
+	 */
+	if (epi->event.events & EPOLLETKEY)
+		ep_add_revents(epi, key ? (unsigned long) key & epi->event.events :
+				    EP_REVENTS_POLL);
+
+	/*
+	 * Claim the item for ep->rdllq. If it is already queued there is
+	 * nothing left to do: the consumer will see it, and has not been
+	 * told yet, or has already been woken up for it.
+	 */
+	if (cmpxchg(&epi->rdlnode.next, EP_UNACTIVE_PTR, NULL) != EP_UNACTIVE_PTR)
+		return 1;
+
+	if (ep_has_wakeup_source(epi)) {
+		/*
+		 * Activate ep->ws too, since a consumer that is delivering
+		 * the item right now might deactivate epi->ws at any time.
+		 */
 		ep_pm_stay_awake_rcu(epi);
+		__pm_stay_awake(ep->ws);
 	}
+	llist_add(&epi->rdlnode, &ep->rdllq);
 
+out_wakeup:
 	/*
 	 * Wake up ( if active ) both the eventpoll wait list and the ->poll()
-	 * wait list.
+	 * wait list. The llist_add() above is a full barrier, which pairs
+	 * with set_current_state() in ep_poll().
 	 */
 	if (waitqueue_active(&ep->wq))
-		wake_up_locked(&ep->wq);
+		wake_up(&ep->wq);
 	if (waitqueue_active(&ep->poll_wait))
-		pwake++;
-
-out_unlock:
-	spin_unlock_irqrestore(&ep->lock, flags);
-
-	/* We have to call this outside the lock */
-	if (pwake)
 		ep_poll_safewake(&ep->poll_wait);
 
 	return 1;
@@ -1232,7 +1521,6 @@ static int ep_insert(struct eventpoll *ep, struct epoll_event *event,
 		     struct file *tfile, int fd)
 {
 	int error, revents, pwake = 0;
-	unsigned long flags;
 	long user_watches;
 	struct epitem *epi;
 	struct ep_pqueue epq;
@@ -1251,7 +1539,8 @@ static int ep_insert(struct eventpoll *ep, struct epoll_event *event,
 	ep_set_ffd(&epi->ffd, tfile, fd);
 	epi->event = *event;
 	epi->nwait = 0;
-	epi->next = EP_UNACTIVE_PTR;
+	epi->revents = 0;
+	epi->rdlnode.next = EP_UNACTIVE_PTR;
 	if (epi->event.events & EPOLLWAKEUP) {
 		error = ep_create_wakeup_source(epi);
 		if (error)
@@ -1298,23 +1587,22 @@ static int ep_insert(struct eventpoll *ep, struct epoll_event *event,
 	if (reverse_path_check())
 		goto error_remove_epi;
 
-	/* We have to drop the new item inside our item list to keep track of it */
-	spin_lock_irqsave(&ep->lock, flags);
-
-	/* If the file is already "ready" we drop it inside the ready list */
+	/*
+	 * If the file is already "ready" we drop it inside the ready list.
+	 * "rdllist" is protected by "mtx", which we hold.
+	 */
 	if ((revents & event->events) && !ep_is_linked(&epi->rdllink)) {
+		if (epi->event.events & EPOLLETKEY)
+			ep_add_revents(epi, revents & event->events);
 		list_add_tail(&epi->rdllink, &ep->rdllist);
 		ep_pm_stay_awake(epi);
 
 		/* Notify waiting tasks that events are available */
-		if (waitqueue_active(&ep->wq))
-			wake_up_locked(&ep->wq);
+		ep_wake_up(ep);
 		if (waitqueue_active(&ep->poll_wait))
 			pwake++;
 	}
 
-	spin_unlock_irqrestore(&ep->lock, flags);
-
 	atomic_long_inc(&ep->user->epoll_watches);
 
 	/* We have to call this outside the lock */
@@ -1336,14 +1624,9 @@ error_unregister:
 
 	/*
 	 * We need to do this because an event could have been arrived on some
-	 * allocated wait queue. Note that we don't care about the ep->ovflist
-	 * list, since that is used/cleaned only inside a section bound by "mtx".
-	 * And ep_insert() is called with "mtx" held.
+	 * allocated wait queue, and queued the item on ep->rdllq.
 	 */
-	spin_lock_irqsave(&ep->lock, flags);
-	if (ep_is_linked(&epi->rdllink))
-		list_del_init(&epi->rdllink);
-	spin_unlock_irqrestore(&ep->lock, flags);
+	ep_unqueue(ep, epi);
 
 	wakeup_source_unregister(ep_wakeup_source(epi));
 
@@ -1385,9 +1668,8 @@ static int ep_modify(struct eventpoll *ep, struct epitem *epi, struct epoll_even
 	 * 1) Flush epi changes above to other CPUs.  This ensures
 	 *    we do not miss events from ep_poll_callback if an
 	 *    event occurs immediately after we call f_op->poll().
-	 *    We need this because we did not take ep->lock while
-	 *    changing epi above (but ep_poll_callback does take
-	 *    ep->lock).
+	 *    We need this because ep_poll_callback runs without
+	 *    any lock we could take while changing epi above.
 	 *
 	 * 2) We also need to ensure we do not miss _past_ events
 	 *    when calling f_op->poll().  This barrier also
@@ -1410,18 +1692,17 @@ static int ep_modify(struct eventpoll *ep, struct epitem *epi, struct epoll_even
 	 * list, push it inside.
 	 */
 	if (revents & event->events) {
-		spin_lock_irq(&ep->lock);
+		if (epi->event.events & EPOLLETKEY)
+			ep_add_revents(epi, revents & event->events);
 		if (!ep_is_linked(&epi->rdllink)) {
 			list_add_tail(&epi->rdllink, &ep->rdllist);
 			ep_pm_stay_awake(epi);
 
 			/* Notify waiting tasks that events are available */
-			if (waitqueue_active(&ep->wq))
-				wake_up_locked(&ep->wq);
+			ep_wake_up(ep);
 			if (waitqueue_active(&ep->poll_wait))
 				pwake++;
 		}
-		spin_unlock_irq(&ep->lock);
 	}
 
 	/* We have to call this outside the lock */
@@ -1471,7 +1752,17 @@ static int ep_send_events_proc(struct eventpoll *ep, struct list_head *head,
 
 		list_del_init(&epi->rdllink);
 
-		revents = ep_item_poll(epi, &pt);
+		/*
+		 * An EPOLLETKEY item trusts the keys its wakeups carried, and
+		 * only goes through f_op->poll() when one of them had none.
+		 */
+		revents = 0;
+		if (epi->event.events & EPOLLETKEY)
+			revents = xchg(&epi->revents, 0);
+		if (revents && !(revents & EP_REVENTS_POLL))
+			revents &= epi->event.events;
+		else
+			revents = ep_item_poll(epi, &pt);
 
 		/*
 		 * If the event mask intersect the caller-requested one,
@@ -1482,6 +1773,8 @@ static int ep_send_events_proc(struct eventpoll *ep, struct list_head *head,
 		if (revents) {
 			if (__put_user(revents, &uevent->events) ||
 			    __put_user(epi->event.data, &uevent->data)) {
+				if (epi->event.events & EPOLLETKEY)
+					ep_add_revents(epi, revents);
 				list_add(&epi->rdllink, head);
 				ep_pm_stay_awake(epi);
 				return eventcnt ? eventcnt : -EFAULT;
@@ -1500,7 +1793,7 @@ static int ep_send_events_proc(struct eventpoll *ep, struct list_head *head,
 				 * into ep->rdllist besides us. The epoll_ctl()
 				 * callers are locked out by
 				 * ep_scan_ready_list() holding "mtx" and the
-				 * poll callback will queue them in ep->ovflist.
+				 * poll callback will queue them in ep->rdllq.
 				 */
 				list_add_tail(&epi->rdllink, &ep->rdllist);
 				ep_pm_stay_awake(epi);
@@ -1533,6 +1826,28 @@ static inline struct timespec ep_set_mstimeout(long ms)
 	return timespec_add_safe(now, ts);
 }
 
+/*
+ * Spin for at most "busy_poll_usecs" waiting for events, so that a caller
+ * about to block doesn't pay a sleep and a wakeup for a short gap between
+ * two events. Gives up early when the CPU is wanted elsewhere.
+ */
+static void ep_busy_loop(struct eventpoll *ep)
+{
+	unsigned long usecs = ACCESS_ONCE(busy_poll_usecs);
+	u64 end;
+
+	if (!usecs)
+		return;
+
+	end = local_clock() + usecs * NSEC_PER_USEC;
+	while (!ep_events_available(ep)) {
+		if (need_resched() || signal_pending(current) ||
+		    local_clock() > end)
+			break;
+		cpu_relax();
+	}
+}
+
 /**
  * ep_poll - Retrieves ready events, and delivers them to the caller supplied
  *           event buffer.
@@ -1547,6 +1862,9 @@ static inline struct timespec ep_set_mstimeout(long ms)
  *           until at least one event has been retrieved (or an error
  *           occurred).
  *
+ * If an event ring is mapped, this also returns as soon as it holds events,
+ * possibly with zero events fetched in @events.
+ *
  * Returns: Returns the number of ready events which have been fetched, or an
  *          error code, in case of error.
  */
@@ -1554,7 +1872,6 @@ static int ep_poll(struct eventpoll *ep, struct epoll_event __user *events,
 		   int maxevents, long timeout)
 {
 	int res = 0, eavail, timed_out = 0;
-	unsigned long flags;
 	long slack = 0;
 	wait_queue_t wait;
 	ktime_t expires, *to = NULL;
@@ -1571,12 +1888,12 @@ static int ep_poll(struct eventpoll *ep, struct epoll_event __user *events,
 		 * caller specified a non blocking operation.
 		 */
 		timed_out = 1;
-		spin_lock_irqsave(&ep->lock, flags);
 		goto check_events;
 	}
 
 fetch_events:
-	spin_lock_irqsave(&ep->lock, flags);
+	if (!ep_events_available(ep))
+		ep_busy_loop(ep);
 
 	if (!ep_events_available(ep)) {
 		/*
@@ -1585,6 +1902,7 @@ fetch_events:
 		 * ep_poll_callback() when events will become available.
 		 */
 		init_waitqueue_entry(&wait, current);
+		spin_lock_irq(&ep->wq.lock);
 		__add_wait_queue_exclusive(&ep->wq, &wait);
 
 		for (;;) {
@@ -1601,13 +1919,14 @@ fetch_events:
 				break;
 			}
 
-			spin_unlock_irqrestore(&ep->lock, flags);
+			spin_unlock_irq(&ep->wq.lock);
 			if (!schedule_hrtimeout_range(to, slack, HRTIMER_MODE_ABS))
 				timed_out = 1;
 
-			spin_lock_irqsave(&ep->lock, flags);
+			spin_lock_irq(&ep->wq.lock);
 		}
 		__remove_wait_queue(&ep->wq, &wait);
+		spin_unlock_irq(&ep->wq.lock);
 
 		set_current_state(TASK_RUNNING);
 	}
@@ -1615,15 +1934,14 @@ check_events:
 	/* Is it worth to try to dig for events ? */
 	eavail = ep_events_available(ep);
 
-	spin_unlock_irqrestore(&ep->lock, flags);
-
 	/*
 	 * Try to transfer events to user space. In case we get 0 events and
 	 * there's still timeout left over, we go trying again in search of
-	 * more luck.
+	 * more luck, unless the events are waiting on the ring.
 	 */
 	if (!res && eavail &&
-	    !(res = ep_send_events(ep, events, maxevents)) && !timed_out)
+	    !(res = ep_send_events(ep, events, maxevents)) && !timed_out &&
+	    !ep_ring_ready(ep))
 		goto fetch_events;
 
 	return res;
@@ -1829,6 +2147,11 @@ SYSCALL_DEFINE4(epoll_ctl, int, epfd, int, op, int, fd,
 	if (file == tfile || !is_file_epoll(file))
 		goto error_tgt_fput;
 
+	/* Trusting the wakeup key only makes sense for edge triggered items */
+	if (ep_op_has_event(op) && (epds.events & EPOLLETKEY) &&
+	    !(epds.events & EPOLLET))
+		goto error_tgt_fput;
+
 	/*
 	 * At this point it is safe to assume that the "private_data" contains
 	 * our own data structure.
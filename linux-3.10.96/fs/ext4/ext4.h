@@ -2106,6 +2106,7 @@ extern int ext4_mb_add_groupinfo(struct super_block *sb,
 extern int ext4_group_add_blocks(handle_t *handle, struct super_block *sb,
 				ext4_fsblk_t block, unsigned long count);
 extern int ext4_trim_fs(struct super_block *, struct fstrim_range *);
+extern void ext4_mb_queue_discards(struct super_block *, struct list_head *);
 
 /* inode.c */
 struct buffer_head *ext4_getblk(handle_t *, struct inode *,
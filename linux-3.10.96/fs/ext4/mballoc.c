@@ -2719,6 +2719,38 @@ static inline int ext4_issue_discard(struct super_block *sb,
 	return sb_issue_discard(sb, discard_block, count, GFP_NOFS, 0);
 }
 
+/*
+ * Called with the committed transaction's callback list before the
+ * callbacks run.  Queue the discards of all the extents freed by the
+ * transaction at once, so the block layer can merge them, and have
+ * ext4_free_data_callback() wait for them before the blocks go back to
+ * the buddy.  Extents whose discard can't be queued are discarded
+ * synchronously by the callback as before.
+ */
+void ext4_mb_queue_discards(struct super_block *sb, struct list_head *list)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	struct ext4_journal_cb_entry *jce;
+	struct ext4_free_data *entry;
+	ext4_fsblk_t discard_block;
+	int count;
+
+	spin_lock(&sbi->s_md_lock);
+	list_for_each_entry(jce, list, jce_list) {
+		if (jce->jce_func != ext4_free_data_callback)
+			continue;
+		entry = (struct ext4_free_data *)jce;
+		discard_block = (EXT4_C2B(sbi, entry->efd_start_cluster) +
+				 ext4_group_first_block_no(sb, entry->efd_group));
+		count = EXT4_C2B(sbi, entry->efd_count);
+		trace_ext4_discard_blocks(sb,
+				(unsigned long long) discard_block, count);
+		entry->efd_discard_queued = !sb_queue_discard(sb, discard_block,
+							     count, GFP_ATOMIC);
+	}
+	spin_unlock(&sbi->s_md_lock);
+}
+
 /*
  * This function is called by the jbd2 layer once the commit has finished,
  * so we know we can free the blocks that were released with that commit.
@@ -2736,9 +2768,16 @@ static void ext4_free_data_callback(struct super_block *sb,
 		 entry->efd_count, entry->efd_group, entry);
 
 	if (test_opt(sb, DISCARD)) {
-		err = ext4_issue_discard(sb, entry->efd_group,
-					 entry->efd_start_cluster,
-					 entry->efd_count);
+		/*
+		 * The first queued extent waits for all of the transaction,
+		 * the flush is then a no-op for the others.
+		 */
+		if (entry->efd_discard_queued)
+			err = blkdev_flush_discards(sb->s_bdev);
+		else
+			err = ext4_issue_discard(sb, entry->efd_group,
+						 entry->efd_start_cluster,
+						 entry->efd_count);
 		if (err && err != -EOPNOTSUPP)
 			ext4_msg(sb, KERN_WARNING, "discard request in"
 				 " group:%d block:%d count:%d failed"
@@ -4800,6 +4839,7 @@ do_more:
 		new_entry->efd_group = block_group;
 		new_entry->efd_count = count_clusters;
 		new_entry->efd_tid = handle->h_transaction->t_tid;
+		new_entry->efd_discard_queued = false;
 
 		ext4_lock_group(sb, block_group);
 		mb_clear_bits(bitmap_bh->b_data, bit, count_clusters);
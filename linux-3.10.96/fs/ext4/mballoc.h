@@ -108,6 +108,9 @@ struct ext4_free_data {
 
 	/* transaction which freed this extent */
 	tid_t				efd_tid;
+
+	/* discard queued by ext4_mb_queue_discards(), to be flushed */
+	bool				efd_discard_queued;
 };
 
 struct ext4_prealloc_space {
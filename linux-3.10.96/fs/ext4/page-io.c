@@ -330,6 +330,7 @@ static int io_submit_init(struct ext4_io_submit *io,
 
 	io_end->offset = (page->index << PAGE_CACHE_SHIFT) + bh_offset(bh);
 
+	bio->bi_flags |= wbc_to_bio_flags(wbc);
 	io->io_bio = bio;
 	io->io_op = (wbc->sync_mode == WB_SYNC_ALL ?  WRITE_SYNC : WRITE);
 	io->io_next_block = bh->b_blocknr;
@@ -14,6 +14,12 @@ struct kiocb;
 
 #define KIOCB_KEY		0
 
+/* ki_flags */
+#define KIOCB_F_FIXED_FILE	0x1	/* ki_filp is registered, no ref held */
+#define KIOCB_F_FIXED_BUF	0x2	/* ki_buf lies in ki_fixed */
+#define KIOCB_F_FIXED_REF	0x4	/* counted in the ctx's reg_inflight */
+#define KIOCB_F_RING		0x8	/* taken from a submission ring */
+
 /*
  * We use ki_cancel == KIOCB_CANCELLED to indicate that a kiocb has been either
  * cancelled or completed (this makes a certain amount of sense because
@@ -49,6 +55,7 @@ struct kiocb {
 	void			*private;
 	/* State that we remember to be able to restart/retry  */
 	unsigned short		ki_opcode;
+	unsigned short		ki_flags;	/* KIOCB_F_* */
     //ζȡļС,do_sync_read()
 	size_t			ki_nbytes; 	/* copy of iocb->aio_nbytes */
 	char 			__user *ki_buf;	/* remaining iocb->aio_buf */
@@ -61,6 +68,11 @@ struct kiocb {
 
 	struct list_head	ki_list;	/* the aio core uses this
 						 * for cancellation */
+	struct work_struct	ki_work;	/* deferred submission or
+						 * poll wakeup */
+	void			*ki_fixed;	/* registered buffer */
+	void			*ki_poll;	/* poll state, see aio_poll() */
+	unsigned long		ki_rlim_fsize;	/* submitter's, ring writes */
 
 	/*
 	 * If the aio_resfd field of the userspace iocb is not zero,
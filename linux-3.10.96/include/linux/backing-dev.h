@@ -114,6 +114,7 @@ struct backing_dev_info {
     //balance_dirty_pages()нҳ̫࣬bdiҳ̫࣬bdi->dirty_exceeded=1ʾҳ̫ࡣȻ̿ߣ
     //˳balance_dirty_pages()ʱ0
 	int dirty_exceeded;
+	unsigned long dirty_sleep;	/* last time a dirtier was throttled */
 
 	unsigned int min_ratio;
 	unsigned int max_ratio, max_prop_frac;
@@ -44,5 +44,7 @@ extern void blk_iopoll_enable(struct blk_iopoll *);
 extern void blk_iopoll_disable(struct blk_iopoll *);
 
 extern int blk_iopoll_enabled;
+extern int blk_iopoll_budget;
+extern int blk_iopoll_time_limit_us;
 
 #endif
@@ -7,6 +7,7 @@
 
 struct blk_mq_tags;
 struct blk_flush_queue;
+struct blk_rq_hist;
 
 struct blk_mq_cpu_notifier {
 	struct list_head list;
@@ -114,6 +115,21 @@ struct blk_mq_hw_ctx {
 	//RH_KABI_EXTEND(int			dispatch_busy)
 	//ӦǱʾӲзæblk_mq_update_dispatch_busy()÷æ
 	int			dispatch_busy;
+
+	RH_KABI_EXTEND(unsigned long		poll_considered)
+	RH_KABI_EXTEND(unsigned long		poll_invoked)
+	RH_KABI_EXTEND(unsigned long		poll_success)
+
+	/*
+	 * Request timeouts: BLK_MQ_TIMEOUT_BUCKETS bitmaps of driver tags,
+	 * one per coarse deadline slot, see blk_mq_add_timer().
+	 */
+	RH_KABI_EXTEND(unsigned long		*timeout_map)
+	RH_KABI_EXTEND(unsigned int		timeout_map_bits)
+	RH_KABI_EXTEND(unsigned long		timeout_slot)
+
+	/* completion latency histograms, see blk_stat_hist_enable() */
+	RH_KABI_EXTEND(struct blk_rq_hist __percpu	*lat_hist)
 };
 
 #ifdef __GENKSYMS__
@@ -170,6 +186,12 @@ struct blk_mq_queue_data {
 struct request_aux {
 	int internal_tag;//__blk_mq_alloc_requestиֵtag
 	struct blk_issue_stat issue_stat;
+	/* in ctx->front_hash while on ctx->rq_list */
+	struct hlist_node ctx_front_hash;
+#ifdef CONFIG_BLK_CGROUP_IOLATENCY
+	struct blkcg_gq *iolat_blkg;	/* pinned group, see blk-iolatency.c */
+	u64 iolat_start_ns;
+#endif
 }____cacheline_aligned_in_smp;
 
 /* None of these function pointers are covered by RHEL kABI */
@@ -195,6 +217,7 @@ typedef int (init_request_fn)(struct blk_mq_tag_set *set, struct request *,
 typedef void (exit_request_fn)(struct blk_mq_tag_set *set, struct request *,
 		unsigned int);
 typedef int (reinit_request_fn)(void *, struct request *);
+typedef int (poll_fn)(struct blk_mq_hw_ctx *, unsigned int);
 
 typedef void (busy_iter_fn)(struct blk_mq_hw_ctx *, struct request *, void *,
 		bool);
@@ -213,6 +236,11 @@ struct blk_mq_aux_ops {
 	 */
 	get_budget_fn		*get_budget;
 	put_budget_fn		*put_budget;
+
+	/*
+	 * Called to poll for completion of a specific tag.
+	 */
+	poll_fn			*poll;
 };
 //nvme_dev_add()Ϊnvme_mq_ops
 struct blk_mq_ops {
@@ -294,6 +322,7 @@ enum {
 	//tagõĻblk_mq_dispatch_rq_list()req nvmeӲǰȡtagʱ䲻tagҲʧܣΪtag
 	BLK_MQ_F_TAG_SHARED	= 1 << 2,//tagreqǰtagʹreqtag??????queue_set_hctx_shared()
 	BLK_MQ_F_SG_MERGE	= 1 << 3,
+	BLK_MQ_F_NUMA_MAP	= 1 << 4,	/* group hw queues per node */
 	BLK_MQ_F_BLOCKING	= 1 << 6,
 	BLK_MQ_F_NO_SCHED	= 1 << 7,
 
@@ -377,6 +406,22 @@ void blk_mq_delay_kick_requeue_list(struct request_queue *q, unsigned long msecs
 void blk_mq_complete_request(struct request *rq, int error);
 void blk_mq_complete_request_sync(struct request *rq, int error);
 
+/*
+ * Successfully completed requests gathered by a driver's completion or
+ * poll loop, to be ended together.
+ */
+struct blk_mq_batch {
+	struct list_head	list;
+	unsigned int		nr;
+};
+
+#define BLK_MQ_BATCH(name)	\
+	struct blk_mq_batch name = { .list = LIST_HEAD_INIT(name.list) }
+
+bool blk_mq_add_to_batch(struct request *rq, struct blk_mq_batch *batch,
+			 int error);
+void blk_mq_end_request_batch(struct blk_mq_batch *batch);
+
 bool blk_mq_queue_stopped(struct request_queue *q);
 void blk_mq_stop_hw_queue(struct blk_mq_hw_ctx *hctx);
 void blk_mq_start_hw_queue(struct blk_mq_hw_ctx *hctx);
@@ -426,6 +471,16 @@ static inline struct request_aux *rq_aux(struct request *rq)
 {
 	return __rq_aux(rq, rq->q);
 }
+
+static inline blk_qc_t request_to_qc_t(struct blk_mq_hw_ctx *hctx,
+				       struct request *rq)
+{
+	if (rq->tag != -1)
+		return blk_tag_to_qc_t(rq->tag, hctx->queue_num, false);
+
+	return blk_tag_to_qc_t(rq_aux(rq)->internal_tag, hctx->queue_num,
+			       true);
+}
 //ǸӲδq->queue_hw_ctx[i]ȡӲнṹ
 #define queue_for_each_hw_ctx(q, hctx, i)				\
 	for ((i) = 0; (i) < (q)->nr_hw_queues &&			\
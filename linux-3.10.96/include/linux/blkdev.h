@@ -9,6 +9,7 @@
 #include <linux/genhd.h>
 #include <linux/list.h>
 #include <linux/timer.h>
+#include <linux/hrtimer.h>
 #include <linux/workqueue.h>
 #include <linux/pagemap.h>
 #include <linux/backing-dev.h>
@@ -38,6 +39,8 @@ struct blk_flush_queue;
 struct pr_ops;
 struct blk_queue_stats;
 struct blk_stat_callback;
+struct rq_wb;
+struct blk_discard_batch;
 
 #define BLKDEV_MIN_RQ	4
 #define BLKDEV_MAX_RQ	128	/* Default maximum */
@@ -46,7 +49,7 @@ struct blk_stat_callback;
  * Maximum number of blkcg policies allowed to be registered concurrently.
  * Defined here to simplify include dependency.
  */
-#define BLKCG_MAX_POLS		2//ӦblockֿƲ
+#define BLKCG_MAX_POLS		3//ӦblockֿƲ
 
 struct request;
 typedef void (rq_end_io_fn)(struct request *, int);
@@ -640,6 +643,30 @@ struct request_queue {
 	RH_KABI_EXTEND(exit_rq_fn		*exit_rq_fn)
 	RH_KABI_EXTEND(size_t			cmd_size)
 	RH_KABI_EXTEND(void			*rq_alloc_data)
+
+	/*
+	 * hybrid poll sleep before spinning: -1 classic polling, 0 half of
+	 * the mean completion time from poll_stat, >0 fixed nanoseconds
+	 */
+	RH_KABI_EXTEND(int			poll_nsec)
+
+	/* buffered writeback throttling state, see block/blk-wbt.c */
+	RH_KABI_EXTEND(struct rq_wb		*rq_wb)
+
+	/* flush coalescing window and counters, see block/blk-flush.c */
+	RH_KABI_EXTEND(unsigned int		flush_coalesce_usec)
+	RH_KABI_EXTEND(u64			flush_pending_ns)
+	RH_KABI_EXTEND(struct hrtimer		flush_coalesce_timer)
+	RH_KABI_EXTEND(unsigned long		flush_requested)
+	RH_KABI_EXTEND(unsigned long		flush_issued)
+	/* blk-mq flushes parked for, or riding on, mq_flush_leader */
+	RH_KABI_EXTEND(struct list_head		mq_flush_pending)
+	RH_KABI_EXTEND(struct list_head		mq_flush_running)
+	RH_KABI_EXTEND(struct request		*mq_flush_leader)
+
+	/* asynchronous discard batching, see blkdev_queue_discard() */
+	RH_KABI_EXTEND(struct blk_discard_batch	*discard_batch)
+	RH_KABI_EXTEND(unsigned int		discard_batch_mbps)
 };
 
 #define QUEUE_FLAG_QUEUED	1	/* uses generic tag queueing */
@@ -673,6 +700,7 @@ struct request_queue {
 #define QUEUE_FLAG_PREEMPT_ONLY	28	/* only process REQ_PREEMPT requests */
 #define QUEUE_FLAG_QUIESCED    29	/* queue has been quiesced */
 #define QUEUE_FLAG_SCSI_PASSTHROUGH 30	/* queue supports SCSI commands */
+#define QUEUE_FLAG_POLL	       31	/* IO polling enabled if set */
 
 #define QUEUE_FLAG_DEFAULT	((1 << QUEUE_FLAG_IO_STAT) |		\
 				 (1 << QUEUE_FLAG_STACKABLE)	|	\
@@ -769,6 +797,7 @@ static inline void queue_flag_clear(unsigned int flag, struct request_queue *q)
 	test_bit(QUEUE_FLAG_PREEMPT_ONLY, &(q)->queue_flags)
 #define blk_queue_scsi_passthrough(q)	\
 	test_bit(QUEUE_FLAG_SCSI_PASSTHROUGH, &(q)->queue_flags)
+#define blk_queue_poll(q)	test_bit(QUEUE_FLAG_POLL, &(q)->queue_flags)
 
 extern int blk_set_preempt_only(struct request_queue *q);
 extern void blk_clear_preempt_only(struct request_queue *q);
@@ -1014,6 +1043,8 @@ extern int sg_scsi_ioctl(struct request_queue *, struct gendisk *, fmode_t,
 
 extern void blk_queue_bio(struct request_queue *q, struct bio *bio);
 
+bool blk_poll(struct request_queue *q, blk_qc_t cookie);
+
 /*
  * A queue has just exitted congestion.  Note this in the global counter of
  * congested queues, and wake up anyone who was waiting for requests to be
@@ -1286,6 +1317,9 @@ struct blk_plug {
     //mqʱ·reqӵplug->mq_listϣblk_mq_make_request()
 	struct list_head mq_list; /* blk-mq requests */
 	struct list_head cb_list; /* md requires an unplug callback */
+	/* blk-mq requests allocated ahead for the submitter, see nr_ios */
+	RH_KABI_EXTEND(struct list_head cached_rqs)
+	RH_KABI_EXTEND(unsigned short nr_ios) /* I/Os the submitter expects */
 };
 #define BLK_MAX_REQUEST_COUNT 16
 #define BLK_PLUG_FLUSH_SIZE (128 * 1024)
@@ -1300,6 +1334,7 @@ struct blk_plug_cb {
 extern struct blk_plug_cb *blk_check_plugged(blk_plug_cb_fn unplug,
 					     void *data, int size);
 extern void blk_start_plug(struct blk_plug *);
+extern void blk_start_plug_nr_ios(struct blk_plug *, unsigned short);
 extern void blk_finish_plug(struct blk_plug *);
 extern void blk_flush_plug_list(struct blk_plug *, bool);
 
@@ -1323,7 +1358,8 @@ static inline bool blk_needs_flush_plug(struct task_struct *tsk)
 {
 	struct blk_plug *plug = tsk->plug;
 
-	return plug && (!list_empty(&plug->list) || !list_empty(&plug->cb_list));
+	return plug && (!list_empty(&plug->list) || !list_empty(&plug->cb_list) ||
+			!list_empty(&plug->cached_rqs));
 }
 
 /*
@@ -1353,6 +1389,9 @@ static inline struct request *blk_map_queue_find_tag(struct blk_queue_tag *bqt,
 extern int blkdev_issue_flush(struct block_device *, gfp_t, sector_t *);
 extern int blkdev_issue_discard(struct block_device *bdev, sector_t sector,
 		sector_t nr_sects, gfp_t gfp_mask, unsigned long flags);
+extern int blkdev_queue_discard(struct block_device *bdev, sector_t sector,
+		sector_t nr_sects, gfp_t gfp_mask);
+extern int blkdev_flush_discards(struct block_device *bdev);
 extern int blkdev_issue_write_same(struct block_device *bdev, sector_t sector,
 		sector_t nr_sects, gfp_t gfp_mask, struct page *page);
 extern int blkdev_issue_zeroout(struct block_device *bdev, sector_t sector,
@@ -1364,6 +1403,13 @@ static inline int sb_issue_discard(struct super_block *sb, sector_t block,
 				    nr_blocks << (sb->s_blocksize_bits - 9),
 				    gfp_mask, flags);
 }
+static inline int sb_queue_discard(struct super_block *sb, sector_t block,
+		sector_t nr_blocks, gfp_t gfp_mask)
+{
+	return blkdev_queue_discard(sb->s_bdev, block << (sb->s_blocksize_bits - 9),
+				    nr_blocks << (sb->s_blocksize_bits - 9),
+				    gfp_mask);
+}
 static inline int sb_issue_zeroout(struct super_block *sb, sector_t block,
 		sector_t nr_blocks, gfp_t gfp_mask)
 {
@@ -1937,6 +1983,11 @@ static inline void blk_start_plug(struct blk_plug *plug)
 {
 }
 
+static inline void blk_start_plug_nr_ios(struct blk_plug *plug,
+					 unsigned short nr_ios)
+{
+}
+
 static inline void blk_finish_plug(struct blk_plug *plug)
 {
 }
@@ -23,7 +23,11 @@ struct blk_trace {
 	struct dentry *dir;
 	struct dentry *dropped_file;
 	struct dentry *msg_file;
+	struct dentry *compact_file;
 	atomic_t dropped;
+	bool compact;		/* batched, variable length records */
+	struct blk_trace_batch __percpu *batch;
+	struct delayed_work batch_work;	/* flushes idle cpus' batches */
 };
 
 extern int blk_trace_ioctl(struct block_device *, unsigned, char __user *);
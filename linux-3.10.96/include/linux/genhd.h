@@ -64,6 +64,8 @@ enum {
 #include <linux/string.h>
 #include <linux/fs.h>
 #include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <asm/local.h>
 
 struct partition {
 	unsigned char boot_ind;		/* 0x80 - active */
@@ -85,6 +87,7 @@ struct disk_stats {
 	unsigned long ticks[2];//blk_account_io_done()и£jiffies - req->start_time ÿһreqʱ
 	unsigned long io_ticks;//iostat utilõpart_round_stats_single()
 	unsigned long time_in_queue;//part_round_stats_singleи
+	local_t in_flight[2];		/* this cpu's share, may go negative */
 };
 
 #define PARTITION_META_INFO_VOLNAMELTH	64
@@ -119,10 +122,6 @@ struct hd_struct {
 	int make_it_fail;
 #endif
 	unsigned long stamp;//ͳIOʹutilʱõ¼һεϵͳʱ䣬part_round_stats->part_round_stats_singleи
-	
-	//rq,ԣӦbioɣpart_dec_in_flight()part_inc_in_flight()
-	//inflight[1]̷sdainflight[0]浱ǰ豸Ĵ̷sda2
-	atomic_t in_flight[2];
 #ifdef	CONFIG_SMP
     //¼ʹʵͳݣÿCPUһpart_round_stats()ͳIOʹʱֻеǰCPUӣdiskstats_show()ȡIOʹͳ
     //ʱۼCPUIOݡ
@@ -218,6 +217,7 @@ struct gendisk {
 	struct blk_integrity *integrity;
 #endif
 	int node_id;
+	struct completion scan_done;	/* partition scan of add_disk() over */
 };
 //struct hd_struct *partһ̷sda2part_to_disḳsda
 static inline struct gendisk *part_to_disk(struct hd_struct *part)
@@ -337,6 +337,20 @@ extern struct hd_struct *disk_map_sector_rcu(struct gendisk *disk,
 	res;								\
 })
 
+#define part_stat_local_inc(part, field)				\
+	local_inc(&this_cpu_ptr((part)->dkstats)->field)
+#define part_stat_local_dec(part, field)				\
+	local_dec(&this_cpu_ptr((part)->dkstats)->field)
+
+#define part_stat_local_read(part, field)				\
+({									\
+	long res = 0;							\
+	unsigned int _cpu;						\
+	for_each_possible_cpu(_cpu)					\
+		res += local_read(&per_cpu_ptr((part)->dkstats, _cpu)->field); \
+	res;								\
+})
+
 static inline void part_stat_set_all(struct hd_struct *part, int value)
 {
 	int i;
@@ -368,6 +382,10 @@ static inline void free_part_stats(struct hd_struct *part)
 
 #define part_stat_read(part, field)	((part)->dkstats.field)
 
+#define part_stat_local_inc(part, field)	local_inc(&(part)->dkstats.field)
+#define part_stat_local_dec(part, field)	local_dec(&(part)->dkstats.field)
+#define part_stat_local_read(part, field)	local_read(&(part)->dkstats.field)
+
 static inline void part_stat_set_all(struct hd_struct *part, int value)
 {
 	memset(&part->dkstats, value, sizeof(struct disk_stats));
@@ -397,26 +415,38 @@ static inline void free_part_stats(struct hd_struct *part)
 	part_stat_add(cpu, gendiskp, field, 1)
 #define part_stat_sub(cpu, gendiskp, field, subnd)			\
 	part_stat_add(cpu, gendiskp, field, -subnd)
-//һµreqˣreq
+/*
+ * In-flight requests are counted per cpu, like the other disk stats, so
+ * starting and completing I/O never bounces a shared cacheline.  The
+ * cpu that completes a request need not be the one that started it, so
+ * only the sum over all cpus is meaningful.  Callers of the inc/dec side
+ * hold part_stat_lock().
+ */
 static inline void part_inc_in_flight(struct hd_struct *part, int rw)
 {
-    //ǰ豸
-	atomic_inc(&part->in_flight[rw]);
-	if (part->partno)//豸
-		atomic_inc(&part_to_disk(part)->part0.in_flight[rw]);
+	part_stat_local_inc(part, in_flight[rw]);
+	if (part->partno)
+		part_stat_local_inc(&part_to_disk(part)->part0, in_flight[rw]);
 }
-//һreqӶƳˣ1req
+
 static inline void part_dec_in_flight(struct hd_struct *part, int rw)
 {
-    //ǰ豸
-	atomic_dec(&part->in_flight[rw]);
-	if (part->partno)//豸
-		atomic_dec(&part_to_disk(part)->part0.in_flight[rw]);
+	part_stat_local_dec(part, in_flight[rw]);
+	if (part->partno)
+		part_stat_local_dec(&part_to_disk(part)->part0, in_flight[rw]);
+}
+
+static inline unsigned int part_in_flight_rw(struct hd_struct *part, int rw)
+{
+	long inflight = part_stat_local_read(part, in_flight[rw]);
+
+	/* a racing reader may see a completion before its start */
+	return inflight > 0 ? inflight : 0;
 }
 
-static inline int part_in_flight(struct hd_struct *part)
+static inline unsigned int part_in_flight(struct hd_struct *part)
 {
-	return atomic_read(&part->in_flight[0]) + atomic_read(&part->in_flight[1]);
+	return part_in_flight_rw(part, READ) + part_in_flight_rw(part, WRITE);
 }
 
 static inline struct partition_meta_info *alloc_part_info(struct gendisk *disk)
@@ -422,6 +422,7 @@ void wait_for_stable_page(struct page *page);
  * Add an arbitrary waiter to a page's wait queue
  */
 extern void add_page_wait_queue(struct page *page, wait_queue_t *waiter);
+extern int wait_on_page_locked_async(struct page *page, wait_queue_t *waiter);
 
 /*
  * Fault a userspace page into pagetables.  Return non-zero on a fault.
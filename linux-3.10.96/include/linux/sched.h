@@ -681,9 +681,8 @@ struct user_struct {
 	struct hlist_node uidhash_node;
 	kuid_t uid;
 
-#ifdef CONFIG_PERF_EVENTS
+	/* pinned pages charged against RLIMIT_MEMLOCK */
 	atomic_long_t locked_vm;
-#endif
 };
 
 extern int uids_sysfs_init(void);
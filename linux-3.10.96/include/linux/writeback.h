@@ -80,6 +80,20 @@ struct writeback_control {
 	unsigned range_cyclic:1;	/* range_start is cyclic */
 };
 
+#ifdef CONFIG_BLOCK
+/*
+ * bio->bi_flags for a writeback bio.  Periodic and background flushing
+ * is marked so the block layer can throttle it below foreground IO.
+ */
+static inline unsigned long wbc_to_bio_flags(struct writeback_control *wbc)
+{
+	if (wbc->sync_mode != WB_SYNC_ALL &&
+	    (wbc->for_kupdate || wbc->for_background))
+		return 1UL << BIO_BACKGROUND;
+	return 0;
+}
+#endif
+
 /*
  * fs/fs-writeback.c
  */	
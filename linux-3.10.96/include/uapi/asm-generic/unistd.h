@@ -692,9 +692,15 @@ __SC_COMP(__NR_process_vm_writev, sys_process_vm_writev, \
 __SYSCALL(__NR_kcmp, sys_kcmp)
 #define __NR_finit_module 273
 __SYSCALL(__NR_finit_module, sys_finit_module)
+#define __NR_io_ring_setup 274
+__SYSCALL(__NR_io_ring_setup, sys_io_ring_setup)
+#define __NR_io_ring_enter 275
+__SYSCALL(__NR_io_ring_enter, sys_io_ring_enter)
+#define __NR_io_ring_register 276
+__SYSCALL(__NR_io_ring_register, sys_io_ring_register)
 
 #undef __NR_syscalls
-#define __NR_syscalls 274
+#define __NR_syscalls 277
 
 /*
  * All syscalls below here should go away really,
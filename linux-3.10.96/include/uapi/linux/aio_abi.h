@@ -37,10 +37,10 @@ enum {
 	IOCB_CMD_PWRITE = 1,
 	IOCB_CMD_FSYNC = 2,
 	IOCB_CMD_FDSYNC = 3,
-	/* These two are experimental.
+	/* This one is experimental.
 	 * IOCB_CMD_PREADX = 4,
-	 * IOCB_CMD_POLL = 5,
 	 */
+	IOCB_CMD_POLL = 5,	/* aio_buf holds the POLL* event mask */
 	IOCB_CMD_NOOP = 6,
 	IOCB_CMD_PREADV = 7,
 	IOCB_CMD_PWRITEV = 8,
@@ -54,6 +54,16 @@ enum {
  */
 #define IOCB_FLAG_RESFD		(1 << 0)
 
+/*
+ * IOCB_FLAG_FIXED_FILE - "aio_fildes" is an index into the files
+ *                        registered with IORING_REGISTER_FILES.
+ * IOCB_FLAG_FIXED_BUF  - PREAD/PWRITE only: "aio_buf" lies within the
+ *                        buffer registered with IORING_REGISTER_BUFFERS
+ *                        whose index is in "aio_reserved2".
+ */
+#define IOCB_FLAG_FIXED_FILE	(1 << 1)
+#define IOCB_FLAG_FIXED_BUF	(1 << 2)
+
 /* read() from /dev/aio returns these structures. */
 struct io_event {
 	__u64		data;		/* the data field from the iocb */
@@ -104,6 +114,73 @@ struct iocb {
 	__u32	aio_resfd;
 }; /* 64 bytes */
 
+/*
+ * Shared submission ring, see io_ring_setup().
+ *
+ * The completion side is the regular aio ring found at the context id,
+ * io_ring_setup() additionally maps one of these at params->sq_ring.
+ * The application fills iocbs[tail & mask], then advances tail; the
+ * kernel consumes entries from head on io_ring_enter() or, with
+ * IORING_SETUP_SQPOLL, from a kernel thread polling the ring.  That
+ * thread goes to sleep after sq_thread_idle msecs without work and sets
+ * IORING_SQ_NEED_WAKEUP, io_ring_enter(IORING_ENTER_SQ_WAKEUP) restarts
+ * it.  Setting up such a thread needs CAP_SYS_ADMIN.  Entries that
+ * can't be turned into a request at all (reserved fields set, overflow)
+ * are skipped and counted in dropped; any other failure is reported as
+ * a completion event.  aio_key is filled in for submitted entries, so
+ * io_cancel() can be passed the address of the ring slot, but only
+ * until the application reuses that slot.  The ring isn't inherited by
+ * a child on fork().
+ *
+ * Reads and writes of files other than regular files and block devices
+ * need an O_NONBLOCK descriptor, or complete with EOPNOTSUPP; they are
+ * retried once the file polls ready.  Writes are checked against the
+ * RLIMIT_FSIZE of the submitter (of the ring's creator with SQPOLL) and
+ * fail with EFBIG as a whole if they would cross it.
+ */
+#define AIO_SQ_RING_MAGIC	0xa10a5c01
+
+struct aio_sq_ring {
+	__u32	head;		/* consumer index, written by the kernel */
+	__u32	tail;		/* producer index, written by the app */
+	__u32	mask;		/* entries - 1 */
+	__u32	entries;
+	__u32	flags;		/* IORING_SQ_* */
+	__u32	dropped;
+	__u32	magic;
+	__u32	header_length;	/* size of aio_sq_ring */
+	__u32	reserved[8];
+
+	struct iocb	iocbs[0];
+}; /* 64 bytes + ring size */
+
+#define IORING_SQ_NEED_WAKEUP	(1U << 0)
+
+struct io_ring_params {
+	__u32	sq_entries;	/* [o] submission ring size */
+	__u32	cq_entries;	/* [o] completion ring size */
+	__u32	flags;		/* [i] IORING_SETUP_* */
+	__u32	sq_thread_idle;	/* [i] msecs, for IORING_SETUP_SQPOLL */
+	__u64	sq_ring;	/* [o] address of the struct aio_sq_ring */
+	__u64	resv[4];
+};
+
+#define IORING_SETUP_SQPOLL	(1U << 0)	/* kernel submission thread */
+
+#define IORING_ENTER_GETEVENTS	(1U << 0)	/* wait for min_complete */
+#define IORING_ENTER_SQ_WAKEUP	(1U << 1)	/* wake the SQPOLL thread */
+
+/*
+ * io_ring_register() opcodes, valid for any aio context.  Buffers are
+ * passed as an array of struct iovec, files as an array of __s32 fds.
+ * Only one set of each can be registered at a time, and unregistering
+ * fails with EBUSY while requests using either set are in flight.
+ */
+#define IORING_REGISTER_BUFFERS		0
+#define IORING_UNREGISTER_BUFFERS	1
+#define IORING_REGISTER_FILES		2
+#define IORING_UNREGISTER_FILES		3
+
 #undef IFBIG
 #undef IFLITTLE
 
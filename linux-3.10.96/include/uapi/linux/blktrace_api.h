@@ -91,6 +91,7 @@ enum blktrace_notify {
 
 #define BLK_IO_TRACE_MAGIC	0x65617400
 #define BLK_IO_TRACE_VERSION	0x07
+#define BLK_IO_TRACE_COMPACT_VERSION	0x08
 
 /*
  * The trace itself
@@ -109,6 +110,86 @@ struct blk_io_trace {
 	__u16 pdu_len;		/* length of data after this trace */
 };
 
+/*
+ * Compact trace stream
+ *
+ * Writing 1 to the "compact" file in the trace's debugfs directory before
+ * BLKTRACESTART makes the kernel gather queue events per cpu and write
+ * them to that cpu's relay file in batches of variable length records.
+ * Notify events (BLK_TN_*) and events with a large pdu are still written
+ * as struct blk_io_trace.  Each record in the stream starts with a __u32
+ * magic whose low byte tells what follows it:
+ *
+ *   BLK_IO_TRACE_VERSION		struct blk_io_trace, pdu_len bytes
+ *   BLK_IO_TRACE_COMPACT_VERSION	struct blk_io_trace_batch, len bytes
+ *
+ * A batch carries nr events of one device, seen on one cpu.  Event i has
+ * sequence number hdr.sequence + i.  Every event is encoded as
+ *
+ *   __u8	flags		BLK_IO_TRACE_C_*
+ *   __u8	act		action & 0xff (__BLK_TA_* or __BLK_TN_*)
+ *   varint	cat		action >> BLK_TC_SHIFT
+ *   varint	time		nanoseconds since the previous event
+ *   svarint	sector		sector minus the previous event's sector
+ *   varint	bytes
+ *   varint	pid		only with BLK_IO_TRACE_C_PID
+ *   varint	error		only with BLK_IO_TRACE_C_ERROR
+ *   varint	pdu_len		only with BLK_IO_TRACE_C_PDU, then the pdu
+ *
+ * where a varint is an unsigned LEB128 number (7 bits per byte, least
+ * significant group first, top bit set on all but the last byte) and an
+ * svarint is a zigzag encoded varint, ((v << 1) ^ (v >> 63)).  The first
+ * event's deltas are against hdr.time and hdr.sector.  A missing pid is
+ * the previous event's, hdr.pid for the first one.  A missing error or
+ * pdu_len is 0.  Decoding a batch back into struct blk_io_trace:
+ *
+ *	time = hdr.time; sector = hdr.sector; pid = hdr.pid;
+ *	for (i = 0; i < hdr.nr; i++) {
+ *		flags = *p++;
+ *		t.action = *p++;
+ *		t.action |= get_varint(&p) << BLK_TC_SHIFT;
+ *		time += get_varint(&p);
+ *		v = get_varint(&p);
+ *		sector += (v >> 1) ^ -(v & 1);
+ *		t.bytes = get_varint(&p);
+ *		if (flags & BLK_IO_TRACE_C_PID)
+ *			pid = get_varint(&p);
+ *		t.error = flags & BLK_IO_TRACE_C_ERROR ? get_varint(&p) : 0;
+ *		t.pdu_len = flags & BLK_IO_TRACE_C_PDU ? get_varint(&p) : 0;
+ *		pdu = p;
+ *		p += t.pdu_len;
+ *
+ *		t.magic = BLK_IO_TRACE_MAGIC | BLK_IO_TRACE_VERSION;
+ *		t.sequence = hdr.sequence + i;
+ *		t.time = time;
+ *		t.sector = sector;
+ *		t.pid = pid;
+ *		t.device = hdr.device;
+ *		t.cpu = hdr.cpu;
+ *	}
+ *
+ * A cpu's partial batch is written out when a notify event is logged on
+ * that cpu, on all cpus about every 100ms while the trace runs, and when
+ * the trace is stopped or torn down.
+ */
+enum {
+	BLK_IO_TRACE_C_PID	= 1 << 0,	/* pid differs from previous */
+	BLK_IO_TRACE_C_ERROR	= 1 << 1,	/* non-zero error */
+	BLK_IO_TRACE_C_PDU	= 1 << 2,	/* pdu follows */
+};
+
+struct blk_io_trace_batch {
+	__u32 magic;		/* MAGIC << 8 | compact version */
+	__u32 sequence;		/* event number of the first event */
+	__u64 time;		/* base time, in nanoseconds */
+	__u64 sector;		/* base disk offset */
+	__u32 pid;		/* base pid */
+	__u32 device;		/* device number */
+	__u32 cpu;		/* on what cpu the events happened */
+	__u16 nr;		/* number of events */
+	__u16 len;		/* length of the events after this header */
+};
+
 /*
  * The remap event
  */
@@ -16,6 +16,30 @@
  * allocated to not conflict with sg.h ones anyway.
  */
 #define BSG_FLAG_Q_AT_TAIL 0x10 /* default, == 0 at this bit, is Q_AT_HEAD */
+#define BSG_FLAG_REG_BUF   0x20 /* data in a registered buffer, see below */
+
+/*
+ * Registered data buffers.  BSG_REGISTER_BUFFERS pins the pages of up to
+ * BSG_MAX_REG_BUFS user buffers, given as an array of struct iovec, once.
+ * A command with BSG_FLAG_REG_BUF set then names a buffer by its index in
+ * request_extra, and dout_xferp or din_xferp hold a byte offset into that
+ * buffer instead of a user address: the data moves without mapping or
+ * copying on each command.  Bidirectional commands can't use registered
+ * buffers.  BSG_UNREGISTER_BUFFERS fails with EBUSY while commands using
+ * them are outstanding; closing the device releases them as well.  The
+ * pinned pages count against RLIMIT_MEMLOCK, and registration fails with
+ * EOPNOTSUPP on a device that needs its data bounced.
+ */
+#define BSG_REGISTER_BUFFERS	0x2290
+#define BSG_UNREGISTER_BUFFERS	0x2291
+
+#define BSG_MAX_REG_BUFS	64
+
+struct bsg_buf_reg {
+	__u64 iov;		/* [i] array of struct iovec */
+	__u32 nr;		/* [i] number of buffers */
+	__u32 flags;		/* [i] must be 0 */
+};
 
 struct sg_io_v4 {
 	__s32 guard;		/* [i] 'Q' to differentiate from v3 */
@@ -26,6 +26,14 @@
 #define EPOLL_CTL_DEL 2
 #define EPOLL_CTL_MOD 3
 
+/*
+ * Edge Triggered delivery that reports the events carried by the wakeups
+ * since the last delivery, instead of polling the file again. Only valid
+ * together with EPOLLET. Files whose wakeups don't carry the events still
+ * get polled.
+ */
+#define EPOLLETKEY (1 << 27)
+
 /*
  * Request the handling of system wakeup events so as to prevent system suspends
  * from happening while those events are being processed.
@@ -61,5 +69,32 @@ struct epoll_event {
 	__u64 data;
 } EPOLL_PACKED;
 
+/*
+ * Event ring, set up by mmap()ing the epoll file at offset 0. The number
+ * of entries is derived from the size of the first mapping, further
+ * mappings must have the same size. Events of EPOLLETKEY items are posted
+ * here straight from the wakeup, except for EPOLLONESHOT and EPOLLWAKEUP
+ * ones and when the wakeup carries no events. Those, and the events that
+ * find the ring full (counted in "overflow"), are still reported by
+ * epoll_wait(), which also returns as soon as the ring is not empty.
+ * The application consumes entries from head to tail and then stores
+ * the new head. An entry only carries a copy of the item's data: once
+ * EPOLL_CTL_DEL, or the close of the last reference to the file, has
+ * removed an item, the unconsumed entries with its data have "events"
+ * cleared and must be skipped. The ring is charged against
+ * RLIMIT_MEMLOCK, mmap() fails with EPERM past it.
+ */
+struct epoll_ring {
+	__u32	head;		/* consumer index, written by the app */
+	__u32	tail;		/* producer index, written by the kernel */
+	__u32	mask;		/* entries - 1 */
+	__u32	entries;
+	__u32	overflow;
+	__u32	header_length;	/* size of epoll_ring */
+	__u32	reserved[10];
+
+	struct epoll_event events[0];
+}; /* 64 bytes + ring size */
+
 
 #endif /* _UAPI_LINUX_EVENTPOLL_H */
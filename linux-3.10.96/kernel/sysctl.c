@@ -115,6 +115,8 @@ extern int sysctl_nr_trim_pages;
 #endif
 #ifdef CONFIG_BLOCK
 extern int blk_iopoll_enabled;
+extern int blk_iopoll_budget;
+extern int blk_iopoll_time_limit_us;
 #endif
 
 /* Constants used for minimum and  maximum */
@@ -1078,6 +1080,22 @@ static struct ctl_table kern_table[] = {
 		.mode		= 0644,
 		.proc_handler	= proc_dointvec,
 	},
+	{
+		.procname	= "blk_iopoll_budget",
+		.data		= &blk_iopoll_budget,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec_minmax,
+		.extra1		= &one,
+	},
+	{
+		.procname	= "blk_iopoll_time_limit_us",
+		.data		= &blk_iopoll_time_limit_us,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec_minmax,
+		.extra1		= &one,
+	},
 #endif
 	{ }
 };
@@ -58,6 +58,154 @@ static atomic_t blk_probes_ref = ATOMIC_INIT(0);
 static void blk_register_tracepoints(void);
 static void blk_unregister_tracepoints(void);
 
+/*
+ * Per-cpu batch of compact events, see struct blk_io_trace_batch.  The
+ * header and the encoded events are contiguous so a full batch goes out
+ * with a single relay_reserve().
+ */
+#define BLK_TRACE_BATCH_BYTES	2048
+#define BLK_TRACE_EVENT_MAX	48	/* worst case encoding without pdu */
+#define BLK_TRACE_BATCH_DELAY	(HZ / 10)	/* max age of a partial batch */
+
+struct blk_trace_batch {
+	struct blk_io_trace_batch hdr;
+	unsigned char data[BLK_TRACE_BATCH_BYTES];
+	u64 last_time;
+	u64 last_sector;
+	u32 last_pid;
+};
+
+static unsigned char *blk_put_varint(unsigned char *p, u64 v)
+{
+	while (v >= 0x80) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+/*
+ * Called with interrupts disabled, on the cpu owning the batch.
+ */
+static void blk_trace_batch_flush(struct blk_trace *bt,
+				  struct blk_trace_batch *b)
+{
+	size_t len = sizeof(b->hdr) + b->hdr.len;
+	void *t;
+
+	if (!b->hdr.nr)
+		return;
+
+	t = relay_reserve(bt->rchan, len);
+	if (t)
+		memcpy(t, &b->hdr, len);
+
+	b->hdr.nr = 0;
+	b->hdr.len = 0;
+}
+
+static void blk_trace_batch_flush_cpu(void *info)
+{
+	struct blk_trace *bt = info;
+
+	blk_trace_batch_flush(bt, this_cpu_ptr(bt->batch));
+}
+
+/*
+ * Batches are otherwise only written out when full, so a cpu going idle
+ * would hold its last events back from live readers.  Deferrable, there
+ * is no point in waking an idle machine just for that.
+ */
+static void blk_trace_batch_work(struct work_struct *work)
+{
+	struct blk_trace *bt = container_of(to_delayed_work(work),
+					    struct blk_trace, batch_work);
+
+	on_each_cpu(blk_trace_batch_flush_cpu, bt, 1);
+	if (bt->trace_state == Blktrace_running)
+		schedule_delayed_work(&bt->batch_work, BLK_TRACE_BATCH_DELAY);
+}
+
+/*
+ * Write out every cpu's batch once no event can be added to them anymore:
+ * the trace is stopped or unhooked from its queue.  Events are added with
+ * interrupts off after checking the state, so synchronize_sched() waits
+ * for any that saw it running.
+ */
+static void blk_trace_batch_drain(struct blk_trace *bt)
+{
+	cancel_delayed_work_sync(&bt->batch_work);
+	synchronize_sched();
+	on_each_cpu(blk_trace_batch_flush_cpu, bt, 1);
+}
+
+/*
+ * Append an event to this cpu's batch.  Called with interrupts disabled.
+ * Returns false if the event is too large to be batched, in which case
+ * the batch has been written out and the caller logs a regular record.
+ */
+static bool blk_trace_batch_add(struct blk_trace *bt, sector_t sector,
+				int bytes, u32 what, pid_t pid, int error,
+				int pdu_len, void *pdu_data)
+{
+	struct blk_trace_batch *b = this_cpu_ptr(bt->batch);
+	unsigned long *sequence = this_cpu_ptr(bt->sequence);
+	u64 time = ktime_to_ns(ktime_get());
+	s64 delta;
+	unsigned char *p;
+	unsigned char flags = 0;
+
+	if (b->hdr.len + BLK_TRACE_EVENT_MAX + pdu_len > BLK_TRACE_BATCH_BYTES)
+		blk_trace_batch_flush(bt, b);
+	if (BLK_TRACE_EVENT_MAX + pdu_len > BLK_TRACE_BATCH_BYTES)
+		return false;
+
+	if (!b->hdr.nr) {
+		b->hdr.magic = BLK_IO_TRACE_MAGIC | BLK_IO_TRACE_COMPACT_VERSION;
+		b->hdr.sequence = *sequence + 1;
+		b->hdr.time = b->last_time = time;
+		b->hdr.sector = b->last_sector = sector;
+		b->hdr.pid = b->last_pid = pid;
+		b->hdr.device = bt->dev;
+		b->hdr.cpu = smp_processor_id();
+	}
+	++(*sequence);
+
+	if (pid != b->last_pid)
+		flags |= BLK_IO_TRACE_C_PID;
+	if (error)
+		flags |= BLK_IO_TRACE_C_ERROR;
+	if (pdu_len)
+		flags |= BLK_IO_TRACE_C_PDU;
+
+	delta = (s64) ((u64) sector - b->last_sector);
+
+	p = b->data + b->hdr.len;
+	*p++ = flags;
+	*p++ = what & 0xff;
+	p = blk_put_varint(p, what >> BLK_TC_SHIFT);
+	p = blk_put_varint(p, time - b->last_time);
+	p = blk_put_varint(p, ((u64) delta << 1) ^ (u64) (delta >> 63));
+	p = blk_put_varint(p, (u32) bytes);
+	if (flags & BLK_IO_TRACE_C_PID)
+		p = blk_put_varint(p, (u32) pid);
+	if (flags & BLK_IO_TRACE_C_ERROR)
+		p = blk_put_varint(p, (u16) error);
+	if (flags & BLK_IO_TRACE_C_PDU) {
+		p = blk_put_varint(p, pdu_len);
+		memcpy(p, pdu_data, pdu_len);
+		p += pdu_len;
+	}
+
+	b->hdr.len = p - b->data;
+	b->hdr.nr++;
+	b->last_time = time;
+	b->last_sector = sector;
+	b->last_pid = pid;
+	return true;
+}
+
 /*
  * Send out a notify message.
  */
@@ -86,6 +234,10 @@ static void trace_note(struct blk_trace *bt, pid_t pid, int action,
 	if (!bt->rchan)
 		return;
 
+	/* keep the batched events ahead of the note in the stream */
+	if (bt->compact)
+		blk_trace_batch_flush(bt, this_cpu_ptr(bt->batch));
+
 	t = relay_reserve(bt->rchan, sizeof(*t) + len);
 	if (t) {
 		t->magic = BLK_IO_TRACE_MAGIC | BLK_IO_TRACE_VERSION;
@@ -239,6 +391,16 @@ static void __blk_add_trace(struct blk_trace *bt, sector_t sector, int bytes,
 	if (unlikely(tsk->btrace_seq != blktrace_seq))
 		trace_note_tsk(bt, tsk);
 
+	if (bt->compact) {
+		/* checked again with irqs off, see blk_trace_batch_drain() */
+		if (unlikely(bt->trace_state != Blktrace_running) ||
+		    blk_trace_batch_add(bt, sector, bytes, what, pid, error,
+					pdu_len, pdu_data)) {
+			local_irq_restore(flags);
+			return;
+		}
+	}
+
 	t = relay_reserve(bt->rchan, sizeof(*t) + pdu_len);
 	if (t) {
 		sequence = per_cpu_ptr(bt->sequence, cpu);
@@ -280,17 +442,20 @@ static DEFINE_MUTEX(blk_tree_mutex);
 
 static void blk_trace_free(struct blk_trace *bt)
 {
+	debugfs_remove(bt->compact_file);
 	debugfs_remove(bt->msg_file);
 	debugfs_remove(bt->dropped_file);
 	relay_close(bt->rchan);
 	debugfs_remove(bt->dir);
 	free_percpu(bt->sequence);
 	free_percpu(bt->msg_data);
+	free_percpu(bt->batch);
 	kfree(bt);
 }
 
 static void blk_trace_cleanup(struct blk_trace *bt)
 {
+	blk_trace_batch_drain(bt);
 	blk_trace_free(bt);
 	if (atomic_dec_and_test(&blk_probes_ref))
 		blk_unregister_tracepoints();
@@ -362,6 +527,51 @@ static const struct file_operations blk_msg_fops = {
 	.llseek =	noop_llseek,
 };
 
+static ssize_t blk_compact_read(struct file *filp, char __user *buffer,
+				size_t count, loff_t *ppos)
+{
+	struct blk_trace *bt = filp->private_data;
+	char buf[4];
+
+	snprintf(buf, sizeof(buf), "%d\n", bt->compact);
+
+	return simple_read_from_buffer(buffer, count, ppos, buf, strlen(buf));
+}
+
+/*
+ * The record format can only be switched while the trace is not running,
+ * so a reader never sees both kinds of queue events within one run.
+ */
+static ssize_t blk_compact_write(struct file *filp, const char __user *buffer,
+				 size_t count, loff_t *ppos)
+{
+	struct blk_trace *bt = filp->private_data;
+	char buf[8];
+	bool enable;
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, buffer, count))
+		return -EFAULT;
+	buf[count] = '\0';
+
+	if (strtobool(buf, &enable))
+		return -EINVAL;
+	if (bt->trace_state == Blktrace_running)
+		return -EBUSY;
+
+	bt->compact = enable;
+	return count;
+}
+
+static const struct file_operations blk_compact_fops = {
+	.owner =	THIS_MODULE,
+	.open =		simple_open,
+	.read =		blk_compact_read,
+	.write =	blk_compact_write,
+	.llseek =	default_llseek,
+};
+
 /*
  * Keep track of how many times we encountered a full subbuffer, to aid
  * the user space app in telling how many lost events there were.
@@ -457,6 +667,11 @@ int do_blk_trace_setup(struct request_queue *q, char *name, dev_t dev,
 	if (!bt->msg_data)
 		goto err;
 
+	bt->batch = alloc_percpu(struct blk_trace_batch);
+	if (!bt->batch)
+		goto err;
+	INIT_DEFERRABLE_WORK(&bt->batch_work, blk_trace_batch_work);
+
 	ret = -ENOENT;
 
 	mutex_lock(&blk_tree_mutex);
@@ -488,6 +703,11 @@ int do_blk_trace_setup(struct request_queue *q, char *name, dev_t dev,
 	if (!bt->msg_file)
 		goto err;
 
+	bt->compact_file = debugfs_create_file("compact", 0644, dir, bt,
+					       &blk_compact_fops);
+	if (!bt->compact_file)
+		goto err;
+
 	bt->rchan = relay_open("trace", dir, buts->buf_size,
 				buts->buf_nr, &blk_relay_callbacks, bt);
 	if (!bt->rchan)
@@ -603,11 +823,16 @@ int blk_trace_startstop(struct request_queue *q, int start)
 			bt->trace_state = Blktrace_running;
 
 			trace_note_time(bt);
+			if (bt->compact)
+				schedule_delayed_work(&bt->batch_work,
+						      BLK_TRACE_BATCH_DELAY);
 			ret = 0;
 		}
 	} else {
 		if (bt->trace_state == Blktrace_running) {
 			bt->trace_state = Blktrace_stopped;
+			if (bt->compact)
+				blk_trace_batch_drain(bt);
 			relay_flush(bt->rchan);
 			ret = 0;
 		}
@@ -1474,6 +1699,7 @@ static int blk_trace_remove_queue(struct request_queue *q)
 	if (atomic_dec_and_test(&blk_probes_ref))
 		blk_unregister_tracepoints();
 
+	blk_trace_batch_drain(bt);
 	blk_trace_free(bt);
 	return 0;
 }
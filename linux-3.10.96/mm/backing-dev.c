@@ -464,6 +464,7 @@ int bdi_init(struct backing_dev_info *bdi)
 	}
 
 	bdi->dirty_exceeded = 0;
+	bdi->dirty_sleep = jiffies;
 
 	bdi->bw_time_stamp = jiffies;
 	bdi->written_stamp = 0;
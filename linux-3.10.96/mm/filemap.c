@@ -604,6 +604,38 @@ void add_page_wait_queue(struct page *page, wait_queue_t *waiter)
 }
 EXPORT_SYMBOL_GPL(add_page_wait_queue);
 
+/**
+ * wait_on_page_locked_async - queue a callback for the unlock of a page
+ * @page: the page to wait on
+ * @waiter: waiter whose ->func is called from unlock_page()
+ *
+ * The page wait queues are hashed, so ->func gets a struct wait_bit_key
+ * and has to check it refers to PG_locked of @page.  It runs under the
+ * wait queue lock and must dequeue itself.
+ *
+ * Returns 0 if @waiter was queued, or -EAGAIN if @page was already
+ * unlocked, in which case nothing was queued.
+ */
+int wait_on_page_locked_async(struct page *page, wait_queue_t *waiter)
+{
+	wait_queue_head_t *q = page_waitqueue(page);
+	unsigned long flags;
+	int ret = 0;
+
+	spin_lock_irqsave(&q->lock, flags);
+	__add_wait_queue(q, waiter);
+	/* pairs with smp_mb__after_clear_bit() in unlock_page() */
+	smp_mb();
+	if (!PageLocked(page)) {
+		__remove_wait_queue(q, waiter);
+		ret = -EAGAIN;
+	}
+	spin_unlock_irqrestore(&q->lock, flags);
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL(wait_on_page_locked_async);
+
 /**
  * unlock_page - unlock a locked page
  * @page: the page
@@ -1462,6 +1462,7 @@ pause:
 					  period,
 					  pause,
 					  start_time);
+		bdi->dirty_sleep = now;
 		__set_current_state(TASK_KILLABLE);
         //pause
 		io_schedule_timeout(pause);